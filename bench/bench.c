@@ -0,0 +1,523 @@
+/* Measures the cost per call of the APIs interposed by mockeagain.so, to
+ * be run once without it for the raw libc numbers and once with it for
+ * each mode to compare, see run.sh. The result lines are CSV:
+ *
+ *     mode,api,fds,calls,ns_per_call
+ *
+ * where fds is the number of sockets open during the run, all of which
+ * are polled by the poll benchmark. The reads and writes are timed one by
+ * one, each after a poll() of its fd left out of the time, so that they
+ * are passed on to libc in the mocked modes too rather than faked. */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+
+
+#define BATCH 256
+#define READ_LOW_WATER 4096
+#define READ_FILL 65536
+
+
+typedef struct {
+    int                 nfds;
+    int                *fds;
+    struct pollfd      *pfds;
+    int                 wfd;        /* written to by the benchmarks */
+    int                 wpeer;
+    int                 rfd;        /* read from by the benchmarks */
+    int                 rpeer;
+} bench_t;
+
+
+typedef uint64_t (*bench_handler) (bench_t *b, int n);
+
+
+static uint64_t bench_poll(bench_t *b, int n);
+static uint64_t bench_writev(bench_t *b, int n);
+static uint64_t bench_send(bench_t *b, int n);
+static uint64_t bench_read(bench_t *b, int n);
+static uint64_t bench_recv(bench_t *b, int n);
+static uint64_t bench_recvfrom(bench_t *b, int n);
+static uint64_t bench_socket(bench_t *b, int n);
+static uint64_t bench_close(bench_t *b, int n);
+static uint64_t bench_timer(bench_t *b, int n);
+static void ready(bench_t *b, int fd, short events);
+static uint64_t per_call(uint64_t ns, int n);
+static int open_fds(bench_t *b, int nfds);
+static void close_fds(bench_t *b);
+static void drain(int fd);
+static void fill(bench_t *b);
+static uint64_t run(bench_t *b, bench_handler handler, uint64_t *calls);
+static uint64_t now_ns();
+void bench_whitelisted();
+
+
+static const struct {
+    const char         *name;
+    bench_handler       handler;
+} benches[] = {
+    { "poll", bench_poll },
+    { "writev", bench_writev },
+    { "send", bench_send },
+    { "read", bench_read },
+    { "recv", bench_recv },
+    { "recvfrom", bench_recvfrom },
+    { "socket", bench_socket },
+    { "close", bench_close }
+};
+
+
+static uint64_t min_ns = 50000000;
+static uint64_t timer_ns;       /* the cost of timing a single call */
+static char buf[READ_FILL];
+
+
+int
+main(int argc, char **argv)
+{
+    int                  i, k;
+    int                  nfds;
+    uint64_t             ns, calls;
+    const char          *p;
+    struct rlimit        rlim;
+    bench_t              b;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <mode> <fds>...\n", argv[0]);
+        return 2;
+    }
+
+    p = getenv("BENCH_TIME_MS");
+    if (p != NULL && atoi(p) > 0) {
+        min_ns = (uint64_t) atoi(p) * 1000000;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+        rlim.rlim_cur = rlim.rlim_max;
+        (void) setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+
+    memset(buf, 'x', sizeof(buf));
+
+    timer_ns = run(&b, bench_timer, &calls) / calls;
+
+    for (i = 2; i < argc; i++) {
+        nfds = atoi(argv[i]);
+
+        if (open_fds(&b, nfds) != 0) {
+            fprintf(stderr, "bench: skipping %d fds: %s\n", nfds,
+                    strerror(errno));
+            continue;
+        }
+
+        for (k = 0; k < (int) (sizeof(benches) / sizeof(benches[0])); k++) {
+            ns = run(&b, benches[k].handler, &calls);
+
+            printf("%s,%s,%d,%llu,%.1f\n", argv[1], benches[k].name, nfds,
+                   (unsigned long long) calls, (double) ns / calls);
+            fflush(stdout);
+        }
+
+        close_fds(&b);
+    }
+
+    return 0;
+}
+
+
+/* Run the batches of a benchmark for min_ns in total, and return the time
+ * they took; each handler only times the calls measured, leaving out what
+ * it does to set up the next batch */
+static uint64_t
+run(bench_t *b, bench_handler handler, uint64_t *calls)
+{
+    uint64_t             total;
+
+    total = 0;
+    *calls = 0;
+
+    /* warm up the fd state and the caches first */
+
+    (void) handler(b, BATCH);
+
+    while (total < min_ns) {
+        total += handler(b, BATCH);
+        *calls += BATCH;
+    }
+
+    return total;
+}
+
+
+static uint64_t
+bench_poll(bench_t *b, int n)
+{
+    int                  i;
+    uint64_t             start;
+
+    start = now_ns();
+
+    for (i = 0; i < n; i++) {
+        (void) poll(b->pfds, b->nfds, 0);
+    }
+
+    return now_ns() - start;
+}
+
+
+static uint64_t
+bench_writev(bench_t *b, int n)
+{
+    int                  i;
+    uint64_t             start, ns;
+    struct iovec         iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = 1;
+
+    ns = 0;
+
+    for (i = 0; i < n; i++) {
+        ready(b, b->wfd, POLLOUT);
+
+        start = now_ns();
+        (void) writev(b->wfd, &iov, 1);
+        ns += now_ns() - start;
+    }
+
+    drain(b->wpeer);
+
+    return per_call(ns, n);
+}
+
+
+static uint64_t
+bench_send(bench_t *b, int n)
+{
+    int                  i;
+    uint64_t             start, ns;
+
+    ns = 0;
+
+    for (i = 0; i < n; i++) {
+        ready(b, b->wfd, POLLOUT);
+
+        start = now_ns();
+        (void) send(b->wfd, buf, 1, 0);
+        ns += now_ns() - start;
+    }
+
+    drain(b->wpeer);
+
+    return per_call(ns, n);
+}
+
+
+static uint64_t
+bench_read(bench_t *b, int n)
+{
+    int                  i;
+    char                 c;
+    uint64_t             start, ns;
+
+    ns = 0;
+
+    for (i = 0; i < n; i++) {
+        ready(b, b->rfd, POLLIN);
+
+        start = now_ns();
+        (void) read(b->rfd, &c, 1);
+        ns += now_ns() - start;
+    }
+
+    fill(b);
+
+    return per_call(ns, n);
+}
+
+
+static uint64_t
+bench_recv(bench_t *b, int n)
+{
+    int                  i;
+    char                 c;
+    uint64_t             start, ns;
+
+    ns = 0;
+
+    for (i = 0; i < n; i++) {
+        ready(b, b->rfd, POLLIN);
+
+        start = now_ns();
+        (void) recv(b->rfd, &c, 1, 0);
+        ns += now_ns() - start;
+    }
+
+    fill(b);
+
+    return per_call(ns, n);
+}
+
+
+static uint64_t
+bench_recvfrom(bench_t *b, int n)
+{
+    int                  i;
+    char                 c;
+    uint64_t             start, ns;
+    struct sockaddr      sa;
+    socklen_t            len;
+
+    ns = 0;
+
+    for (i = 0; i < n; i++) {
+        ready(b, b->rfd, POLLIN);
+        len = sizeof(sa);
+
+        start = now_ns();
+        (void) recvfrom(b->rfd, &c, 1, 0, &sa, &len);
+        ns += now_ns() - start;
+    }
+
+    fill(b);
+
+    return per_call(ns, n);
+}
+
+
+/* The sockets created here are closed by the raw system call, so that only
+ * socket() is measured, and the other way round for close() */
+static uint64_t
+bench_socket(bench_t *b, int n)
+{
+    int                  i;
+    uint64_t             start, ns;
+    static int           fds[BATCH];
+
+    start = now_ns();
+
+    for (i = 0; i < n; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+    }
+
+    ns = now_ns() - start;
+
+    for (i = 0; i < n; i++) {
+        if (fds[i] >= 0) {
+            (void) syscall(SYS_close, fds[i]);
+        }
+    }
+
+    return ns;
+}
+
+
+static uint64_t
+bench_close(bench_t *b, int n)
+{
+    int                  i;
+    uint64_t             start;
+    static int           fds[BATCH];
+
+    for (i = 0; i < n; i++) {
+        fds[i] = syscall(SYS_socket, AF_INET, SOCK_STREAM, 0);
+    }
+
+    start = now_ns();
+
+    for (i = 0; i < n; i++) {
+        (void) close(fds[i]);
+    }
+
+    return now_ns() - start;
+}
+
+
+/* Times nothing, for the cost of timing each call to be taken off */
+static uint64_t
+bench_timer(bench_t *b, int n)
+{
+    int                  i;
+    uint64_t             start, ns;
+
+    ns = 0;
+
+    for (i = 0; i < n; i++) {
+        start = now_ns();
+        ns += now_ns() - start;
+    }
+
+    return ns;
+}
+
+
+/* Have fd reported ready, as an event loop would before each call; an
+ * AF_UNIX socket stops being reported writable long before its writes
+ * would fail, so the peer is drained then */
+static void
+ready(bench_t *b, int fd, short events)
+{
+    struct pollfd        pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & events)) {
+        return;
+    }
+
+    if (events & POLLOUT) {
+        drain(b->wpeer);
+
+    } else {
+        fill(b);
+    }
+
+    (void) poll(&pfd, 1, 0);
+}
+
+
+/* The time of n calls timed one by one, less what timing them cost */
+static uint64_t
+per_call(uint64_t ns, int n)
+{
+    uint64_t             overhead;
+
+    overhead = (uint64_t) n * timer_ns;
+
+    return ns > overhead ? ns - overhead : 0;
+}
+
+
+static int
+open_fds(bench_t *b, int nfds)
+{
+    int                  i;
+    int                  sv[2];
+    struct rlimit        rlim;
+
+    memset(b, 0, sizeof(bench_t));
+
+    /* leave room for stdio, the sockets of bench_socket() and whatever
+     * mockeagain.so may open itself */
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0
+        && rlim.rlim_cur != RLIM_INFINITY
+        && (rlim_t) nfds + BATCH + 16 > rlim.rlim_cur)
+    {
+        errno = EMFILE;
+        return -1;
+    }
+
+    if (nfds < 4) {
+        nfds = 4;
+    }
+
+    b->nfds = nfds & ~1;
+    b->fds = malloc(b->nfds * sizeof(int));
+    b->pfds = malloc(b->nfds * sizeof(struct pollfd));
+
+    if (b->fds == NULL || b->pfds == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (i = 0; i < b->nfds; i += 2) {
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) != 0) {
+            b->nfds = i;
+            close_fds(b);
+            return -1;
+        }
+
+        b->fds[i] = sv[0];
+        b->fds[i + 1] = sv[1];
+
+        b->pfds[i].fd = sv[0];
+        b->pfds[i].events = POLLIN|POLLOUT;
+        b->pfds[i + 1].fd = sv[1];
+        b->pfds[i + 1].events = POLLIN|POLLOUT;
+    }
+
+    /* the last two pairs carry the data */
+
+    b->wfd = b->fds[b->nfds - 4];
+    b->wpeer = b->fds[b->nfds - 3];
+    b->rfd = b->fds[b->nfds - 2];
+    b->rpeer = b->fds[b->nfds - 1];
+
+    fill(b);
+
+    return 0;
+}
+
+
+static void
+close_fds(bench_t *b)
+{
+    int                  i;
+
+    for (i = 0; i < b->nfds; i++) {
+        (void) syscall(SYS_close, b->fds[i]);
+    }
+
+    free(b->fds);
+    free(b->pfds);
+}
+
+
+/* drain and fill bypass mockeagain.so to cost the same in every mode */
+static void
+drain(int fd)
+{
+    while (syscall(SYS_read, fd, buf, sizeof(buf)) > 0) {
+        /* void */
+    }
+}
+
+
+static void
+fill(bench_t *b)
+{
+    int                  n;
+
+    if (ioctl(b->rfd, FIONREAD, &n) == 0 && n >= READ_LOW_WATER) {
+        return;
+    }
+
+    (void) syscall(SYS_write, b->rpeer, buf, sizeof(buf));
+}
+
+
+static uint64_t
+now_ns()
+{
+    struct timespec      ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* Listed in MOCKEAGAIN_WL by the whitelist mode but never on the stack, so
+ * that every call pays for the full check */
+void
+bench_whitelisted()
+{
+    fprintf(stderr, "bench: not to be called\n");
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+
+# Runs the loopback echo server and client with mockeagain.so preloaded in
+# each MOCKEAGAIN mode and with both poll() and epoll, and prints one CSV
+# line per run:
+#
+#     mode,model,connections,requests,bytes,ok,secs,conns_per_sec,
+#     bytes_per_sec
+#
+# A last run with MOCKEAGAIN_READ_PATTERNS checks that a pattern using every
+# byte value matches. The exit status is 1 if any of the runs lost or
+# corrupted data, or if the pattern did not match. The E2E_CONNECTIONS,
+# E2E_CONCURRENCY, E2E_REQUESTS and E2E_BYTES environments override the
+# size of each run.
+
+so=${1:-./mockeagain.so}
+echo=${2:-./bench/echo}
+
+conns=${E2E_CONNECTIONS:-100}
+concurrency=${E2E_CONCURRENCY:-10}
+requests=${E2E_REQUESTS:-2}
+bytes=${E2E_BYTES:-2048}
+
+case $so in
+    /*) ;;
+    *) so=$PWD/$so ;;
+esac
+
+failed=0
+
+echo "mode,model,connections,requests,bytes,ok,secs,conns_per_sec,bytes_per_sec"
+
+for mode in none w r rw; do
+    for model in poll epoll; do
+        if [ $mode = none ]; then
+            mockeagain=
+        else
+            mockeagain=$mode
+        fi
+
+        LD_PRELOAD=$so MOCKEAGAIN=$mockeagain \
+            $echo $mode $model $conns $concurrency $requests $bytes \
+            || failed=1
+    done
+done
+
+# a read pattern made of all the 256 byte values, in the order they start
+# the body of the first request on the first connection
+
+pattern=$(awk 'BEGIN {
+    printf "stall=1:"
+    for (i = 0; i < 256; i++)
+        printf "\\x%02x", i * 131 % 256
+}')
+
+log=${TMPDIR:-/tmp}/mockeagain-e2e.$$
+
+LD_PRELOAD=$so MOCKEAGAIN_READ_PATTERNS=$pattern MOCKEAGAIN_VERBOSE=1 \
+    $echo patterns poll $conns $concurrency $requests $bytes 2>"$log" \
+    || failed=1
+
+if ! grep -q "has found a match" "$log"; then
+    echo "e2e: the pattern of all the byte values never matched" >&2
+    failed=1
+fi
+
+rm -f "$log"
+
+exit $failed
@@ -0,0 +1,973 @@
+/* A loopback echo server and a client keeping many connections busy, both
+ * speaking a tiny subset of HTTP/1.1, to check end to end that every byte
+ * makes it through mockeagain.so intact and to see what each mode costs,
+ * see e2e.sh:
+ *
+ *     echo <mode> <poll|epoll> <connections> <concurrency> <requests>
+ *          <bytes>
+ *
+ * The server runs in a child process, reading the requests with read()
+ * and echoing their bodies back with writev() as they come in, and the
+ * client sends them with send() and checks the responses with recv(). Each
+ * connection carries the given number of requests of the given body size,
+ * and the result line is CSV:
+ *
+ *     mode,model,connections,requests,bytes,ok,secs,conns_per_sec,
+ *     bytes_per_sec
+ *
+ * where bytes counts the body bytes echoed back and checked. The exit
+ * status is 1 if anything went wrong. */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+
+
+#define HEADER_MAX 1024
+#define CHUNK_SIZE 16384
+#define WAIT_TIMEOUT 1000           /* ms */
+#define RUN_TIMEOUT 300             /* s */
+
+
+typedef struct conn_s  conn_t;
+typedef struct loop_s  loop_t;
+
+typedef void (*conn_handler) (loop_t *l, conn_t *c, int events);
+
+
+enum {
+    STATE_CONNECTING = 0,
+    STATE_HEADER,                   /* the server waits for the request
+                                       header, the client for the response
+                                       header */
+    STATE_BODY
+};
+
+
+struct conn_s {
+    int                 fd;
+    unsigned            gen;        /* bumped on close, to drop the events
+                                       still pending for the old fd */
+    int                 want;       /* POLLIN and POLLOUT */
+    int                 registered; /* the events known to epoll */
+    conn_handler        handler;
+    int                 state;
+    int                 id;
+    int                 request;
+
+    char                header[HEADER_MAX];
+    size_t              header_len;
+    size_t              body_len;   /* of the current request */
+
+    /* the server echoes from a buffer, the client generates the request
+     * on the fly */
+    char               *out;
+    size_t              out_size;
+    size_t              out_start;
+    size_t              out_end;
+    size_t              body_read;  /* by the server */
+
+    char                request_header[HEADER_MAX];
+    size_t              request_header_len;
+    size_t              sent;       /* by the client, header included */
+    size_t              request_len;
+    size_t              received;   /* body bytes checked by the client */
+};
+
+
+struct loop_s {
+    int                 epfd;       /* -1 for poll() */
+    conn_t             *conns;
+    int                 nconns;
+    struct pollfd      *pfds;
+    conn_t            **ready;
+    int                *ready_events;
+    unsigned           *ready_gens;
+};
+
+
+typedef struct {
+    int                 connections;
+    int                 concurrency;
+    int                 requests;
+    size_t              bytes;
+
+    int                 started;
+    int                 active;
+    int                 done;
+    int                 failed;
+    int                 completed;  /* requests */
+    uint64_t            checked;
+    struct sockaddr_in  addr;
+} client_t;
+
+
+static int init_loop(loop_t *l, int use_epoll, int nconns);
+static conn_t *add_conn(loop_t *l, int fd, int want, conn_handler handler);
+static void close_conn(loop_t *l, conn_t *c);
+static void update_conn(loop_t *l, conn_t *c);
+static int wait_events(loop_t *l, int timeout);
+static void run_server(int use_epoll, int lfd, int nconns);
+static void accept_conns(loop_t *l, conn_t *c, int events);
+static void serve(loop_t *l, conn_t *c, int events);
+static int read_request(conn_t *c);
+static int flush_response(conn_t *c);
+static void start_conns(loop_t *l);
+static void talk(loop_t *l, conn_t *c, int events);
+static int send_request(conn_t *c);
+static int check_response(loop_t *l, conn_t *c);
+static void end_conn(loop_t *l, conn_t *c, int ok);
+static void fill_body(conn_t *c, size_t off, char *buf, size_t n);
+static int set_nonblocking(int fd);
+static double now_secs();
+
+
+static client_t client;
+
+
+int
+main(int argc, char **argv)
+{
+    int                  lfd;
+    int                  use_epoll;
+    int                  ok, status;
+    pid_t                pid;
+    double               start, secs;
+    socklen_t            len;
+    loop_t               l;
+
+    if (argc < 7) {
+        fprintf(stderr, "usage: %s <mode> <poll|epoll> <connections> "
+                "<concurrency> <requests> <bytes>\n", argv[0]);
+        return 2;
+    }
+
+    use_epoll = strcmp(argv[2], "epoll") == 0;
+
+    client.connections = atoi(argv[3]);
+    client.concurrency = atoi(argv[4]);
+    client.requests = atoi(argv[5]);
+    client.bytes = (size_t) strtoul(argv[6], NULL, 10);
+
+    if (client.connections <= 0 || client.concurrency <= 0
+        || client.requests <= 0)
+    {
+        fprintf(stderr, "echo: bad arguments\n");
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("echo: socket");
+        return 1;
+    }
+
+    memset(&client.addr, 0, sizeof(client.addr));
+    client.addr.sin_family = AF_INET;
+    client.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    len = sizeof(client.addr);
+
+    if (bind(lfd, (struct sockaddr *) &client.addr, len) != 0
+        || listen(lfd, 1024) != 0
+        || getsockname(lfd, (struct sockaddr *) &client.addr, &len) != 0
+        || set_nonblocking(lfd) != 0)
+    {
+        perror("echo: listen");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid < 0) {
+        perror("echo: fork");
+        return 1;
+    }
+
+    if (pid == 0) {
+        /* the server may accept new connections before it sees the old
+         * ones closed */
+        run_server(use_epoll, lfd, 2 * client.concurrency + 16);
+        _exit(1);
+    }
+
+    (void) close(lfd);
+
+    if (init_loop(&l, use_epoll, client.concurrency) != 0) {
+        (void) kill(pid, SIGTERM);
+        return 1;
+    }
+
+    start = now_secs();
+
+    start_conns(&l);
+
+    while (client.done < client.connections) {
+        if (wait_events(&l, WAIT_TIMEOUT) < 0) {
+            client.failed++;
+            break;
+        }
+
+        if (now_secs() - start > RUN_TIMEOUT) {
+            fprintf(stderr, "echo: timed out with %d connections done\n",
+                    client.done);
+            client.failed++;
+            break;
+        }
+
+        start_conns(&l);
+    }
+
+    secs = now_secs() - start;
+
+    (void) kill(pid, SIGTERM);
+    (void) waitpid(pid, &status, 0);
+
+    ok = client.failed == 0
+         && client.checked == (uint64_t) client.connections
+                              * client.requests * client.bytes;
+
+    printf("%s,%s,%d,%d,%llu,%d,%.3f,%.0f,%.0f\n", argv[1],
+           use_epoll ? "epoll" : "poll", client.done, client.completed,
+           (unsigned long long) client.checked, ok, secs,
+           client.done / secs, client.checked / secs);
+
+    return ok ? 0 : 1;
+}
+
+
+static int
+init_loop(loop_t *l, int use_epoll, int nconns)
+{
+    int                  i;
+
+    memset(l, 0, sizeof(loop_t));
+
+    l->epfd = -1;
+    l->nconns = nconns;
+
+    l->conns = calloc(nconns, sizeof(conn_t));
+    l->pfds = calloc(nconns, sizeof(struct pollfd));
+    l->ready = calloc(nconns, sizeof(conn_t *));
+    l->ready_events = calloc(nconns, sizeof(int));
+    l->ready_gens = calloc(nconns, sizeof(unsigned));
+
+    if (l->conns == NULL || l->pfds == NULL || l->ready == NULL
+        || l->ready_events == NULL || l->ready_gens == NULL)
+    {
+        fprintf(stderr, "echo: out of memory\n");
+        return -1;
+    }
+
+    for (i = 0; i < nconns; i++) {
+        l->conns[i].fd = -1;
+    }
+
+    if (use_epoll) {
+        l->epfd = epoll_create(nconns);
+        if (l->epfd < 0) {
+            perror("echo: epoll_create");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static conn_t *
+add_conn(loop_t *l, int fd, int want, conn_handler handler)
+{
+    int                  i;
+    conn_t              *c;
+    unsigned             gen;
+    struct epoll_event   ev;
+
+    for (i = 0; i < l->nconns; i++) {
+        if (l->conns[i].fd < 0) {
+            break;
+        }
+    }
+
+    if (i == l->nconns) {
+        return NULL;
+    }
+
+    c = &l->conns[i];
+
+    gen = c->gen;
+    free(c->out);
+    memset(c, 0, sizeof(conn_t));
+
+    c->gen = gen;
+    c->fd = fd;
+    c->want = want;
+    c->handler = handler;
+
+    if (l->epfd >= 0) {
+        ev.events = want;
+        ev.data.ptr = c;
+
+        if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            perror("echo: epoll_ctl");
+            c->fd = -1;
+            return NULL;
+        }
+
+        c->registered = want;
+    }
+
+    return c;
+}
+
+
+static void
+close_conn(loop_t *l, conn_t *c)
+{
+    /* close() drops the fd from the epoll set as well */
+
+    (void) close(c->fd);
+
+    c->fd = -1;
+    c->gen++;
+}
+
+
+static void
+update_conn(loop_t *l, conn_t *c)
+{
+    struct epoll_event   ev;
+
+    if (l->epfd < 0 || c->want == c->registered) {
+        return;
+    }
+
+    ev.events = c->want;
+    ev.data.ptr = c;
+
+    if (epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0) {
+        c->registered = c->want;
+    }
+}
+
+
+/* Wait for the events and call the handlers of the connections ready,
+ * which may close them or open others meanwhile */
+static int
+wait_events(loop_t *l, int timeout)
+{
+    int                  i, n, nready;
+    conn_t              *c;
+    struct epoll_event   events[256];
+
+    nready = 0;
+
+    if (l->epfd >= 0) {
+        n = epoll_wait(l->epfd, events,
+                       l->nconns < 256 ? l->nconns : 256, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                return 0;
+            }
+
+            perror("echo: epoll_wait");
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+
+            l->ready[nready] = c;
+            l->ready_events[nready] = events[i].events;
+            l->ready_gens[nready] = c->gen;
+            nready++;
+        }
+
+    } else {
+        for (i = 0; i < l->nconns; i++) {
+            l->pfds[i].fd = l->conns[i].fd;
+            l->pfds[i].events = l->conns[i].want;
+            l->pfds[i].revents = 0;
+        }
+
+        n = poll(l->pfds, l->nconns, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                return 0;
+            }
+
+            perror("echo: poll");
+            return -1;
+        }
+
+        for (i = 0; i < l->nconns && nready < n; i++) {
+            if (l->pfds[i].revents) {
+                c = &l->conns[i];
+
+                l->ready[nready] = c;
+                l->ready_events[nready] = l->pfds[i].revents;
+                l->ready_gens[nready] = c->gen;
+                nready++;
+            }
+        }
+    }
+
+    for (i = 0; i < nready; i++) {
+        c = l->ready[i];
+
+        if (c->fd >= 0 && c->gen == l->ready_gens[i]) {
+            c->handler(l, c, l->ready_events[i]);
+        }
+    }
+
+    return nready;
+}
+
+
+static void
+run_server(int use_epoll, int lfd, int nconns)
+{
+    loop_t               l;
+
+    signal(SIGTERM, SIG_DFL);
+
+    if (init_loop(&l, use_epoll, nconns) != 0
+        || add_conn(&l, lfd, POLLIN, accept_conns) == NULL)
+    {
+        _exit(1);
+    }
+
+    for ( ;; ) {
+        if (wait_events(&l, WAIT_TIMEOUT) < 0) {
+            _exit(1);
+        }
+    }
+}
+
+
+static void
+accept_conns(loop_t *l, conn_t *c, int events)
+{
+    int                  fd;
+    conn_t              *sc;
+
+    for ( ;; ) {
+        fd = accept(c->fd, NULL, NULL);
+        if (fd < 0) {
+            return;
+        }
+
+        if (set_nonblocking(fd) != 0) {
+            (void) close(fd);
+            continue;
+        }
+
+        sc = add_conn(l, fd, POLLIN, serve);
+        if (sc == NULL) {
+            (void) close(fd);
+            continue;
+        }
+
+        sc->state = STATE_HEADER;
+    }
+}
+
+
+static void
+serve(loop_t *l, conn_t *c, int events)
+{
+    int                  rc;
+
+    if (events & (POLLIN|POLLERR|POLLHUP)) {
+        rc = read_request(c);
+        if (rc != 0) {
+            close_conn(l, c);
+            return;
+        }
+    }
+
+    if (flush_response(c) != 0) {
+        close_conn(l, c);
+        return;
+    }
+
+    c->want = POLLIN | (c->out_end > c->out_start ? POLLOUT : 0);
+
+    update_conn(l, c);
+}
+
+
+/* Read as much of the request as is there, queueing the response header
+ * and the body bytes to be echoed; returns -1 once the client is gone */
+static int
+read_request(conn_t *c)
+{
+    char                *p, *eoh;
+    size_t               n, size;
+    ssize_t              rc;
+
+    for ( ;; ) {
+        if (c->state == STATE_HEADER) {
+            rc = read(c->fd, c->header + c->header_len,
+                      HEADER_MAX - 1 - c->header_len);
+            if (rc <= 0) {
+                return rc < 0 && errno == EAGAIN ? 0 : -1;
+            }
+
+            c->header_len += rc;
+            c->header[c->header_len] = '\0';
+
+            eoh = strstr(c->header, "\r\n\r\n");
+            if (eoh == NULL) {
+                if (c->header_len == HEADER_MAX - 1) {
+                    return -1;
+                }
+
+                continue;
+            }
+
+            p = strcasestr(c->header, "\r\nContent-Length:");
+            if (p == NULL || p > eoh) {
+                return -1;
+            }
+
+            c->body_len = (size_t) strtoul(p + 17, NULL, 10);
+            c->body_read = 0;
+            c->state = STATE_BODY;
+
+            size = c->out_end + HEADER_MAX + CHUNK_SIZE;
+
+            if (size > c->out_size) {
+                p = realloc(c->out, size);
+                if (p == NULL) {
+                    return -1;
+                }
+
+                c->out = p;
+                c->out_size = size;
+            }
+
+            c->out_end += sprintf(c->out + c->out_end,
+                                  "HTTP/1.1 200 OK\r\n"
+                                  "Content-Length: %zu\r\n\r\n", c->body_len);
+
+            /* the body bytes read along with the header */
+
+            eoh += 4;
+            n = c->header + c->header_len - eoh;
+
+            if (n > c->body_len) {
+                return -1;
+            }
+
+            memcpy(c->out + c->out_end, eoh, n);
+            c->out_end += n;
+            c->body_read = n;
+            c->header_len = 0;
+        }
+
+        if (c->body_read == c->body_len) {
+            c->state = STATE_HEADER;
+            continue;
+        }
+
+        /* make room for another chunk of the body */
+
+        if (c->out_start == c->out_end) {
+            c->out_start = 0;
+            c->out_end = 0;
+        }
+
+        if (c->out_size - c->out_end < CHUNK_SIZE) {
+            size = c->out_end + CHUNK_SIZE;
+
+            p = realloc(c->out, size);
+            if (p == NULL) {
+                return -1;
+            }
+
+            c->out = p;
+            c->out_size = size;
+        }
+
+        n = c->body_len - c->body_read;
+        if (n > c->out_size - c->out_end) {
+            n = c->out_size - c->out_end;
+        }
+
+        rc = read(c->fd, c->out + c->out_end, n);
+        if (rc <= 0) {
+            return rc < 0 && errno == EAGAIN ? 0 : -1;
+        }
+
+        c->out_end += rc;
+        c->body_read += rc;
+    }
+}
+
+
+static int
+flush_response(conn_t *c)
+{
+    ssize_t              rc;
+    struct iovec         iov[2];
+    int                  iovcnt;
+    size_t               half;
+
+    /* two iovecs, for writev() to have something to cut short */
+
+    while (c->out_start < c->out_end) {
+        half = (c->out_end - c->out_start) / 2;
+
+        iov[0].iov_base = c->out + c->out_start;
+        iov[0].iov_len = half;
+        iov[1].iov_base = c->out + c->out_start + half;
+        iov[1].iov_len = c->out_end - c->out_start - half;
+
+        iovcnt = 2;
+
+        if (half == 0) {
+            iov[0] = iov[1];
+            iovcnt = 1;
+        }
+
+        rc = writev(c->fd, iov, iovcnt);
+        if (rc < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        c->out_start += rc;
+    }
+
+    return 0;
+}
+
+
+static void
+start_conns(loop_t *l)
+{
+    int                  fd, one;
+    conn_t              *c;
+
+    while (client.active < client.concurrency
+           && client.started < client.connections)
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || set_nonblocking(fd) != 0) {
+            perror("echo: socket");
+            client.failed++;
+            client.done = client.connections;
+            return;
+        }
+
+        one = 1;
+        (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (connect(fd, (struct sockaddr *) &client.addr,
+                    sizeof(client.addr)) != 0
+            && errno != EINPROGRESS)
+        {
+            perror("echo: connect");
+            (void) close(fd);
+            client.failed++;
+            client.done = client.connections;
+            return;
+        }
+
+        c = add_conn(l, fd, POLLOUT, talk);
+        if (c == NULL) {
+            (void) close(fd);
+            client.failed++;
+            client.done = client.connections;
+            return;
+        }
+
+        c->id = client.started++;
+        c->state = STATE_CONNECTING;
+        client.active++;
+    }
+}
+
+
+static void
+talk(loop_t *l, conn_t *c, int events)
+{
+    int                  err;
+    socklen_t            len;
+
+    if (c->state == STATE_CONNECTING) {
+        len = sizeof(err);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0
+            || err != 0)
+        {
+            fprintf(stderr, "echo: connect: %s\n", strerror(err));
+            end_conn(l, c, 0);
+            return;
+        }
+
+        c->state = STATE_HEADER;
+        c->request_len = 0;
+    }
+
+    if (send_request(c) != 0) {
+        end_conn(l, c, 0);
+        return;
+    }
+
+    if (events & (POLLIN|POLLERR|POLLHUP)) {
+        if (check_response(l, c) != 0) {
+            return;
+        }
+    }
+
+    c->want = POLLIN | (c->sent < c->request_len ? POLLOUT : 0);
+
+    update_conn(l, c);
+}
+
+
+/* Send what is left of the current request, starting it if need be */
+static int
+send_request(conn_t *c)
+{
+    char                 buf[CHUNK_SIZE];
+    size_t               off, n, hlen;
+    ssize_t              rc;
+
+    if (c->request_len == 0) {
+        c->request_header_len = sprintf(c->request_header,
+                                        "POST /echo HTTP/1.1\r\n"
+                                        "Host: localhost\r\n"
+                                        "Content-Length: %zu\r\n\r\n",
+                                        client.bytes);
+        c->request_len = c->request_header_len + client.bytes;
+        c->sent = 0;
+        c->header_len = 0;
+        c->received = 0;
+    }
+
+    hlen = c->request_header_len;
+
+    while (c->sent < c->request_len) {
+        if (c->sent < hlen) {
+            n = hlen - c->sent;
+            memcpy(buf, c->request_header + c->sent, n);
+
+        } else {
+            n = 0;
+        }
+
+        off = c->sent + n - hlen;
+
+        if (c->request_len - hlen - off < sizeof(buf) - n) {
+            fill_body(c, off, buf + n, c->request_len - hlen - off);
+            n += c->request_len - hlen - off;
+
+        } else {
+            fill_body(c, off, buf + n, sizeof(buf) - n);
+            n = sizeof(buf);
+        }
+
+        rc = send(c->fd, buf, n, 0);
+        if (rc < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        c->sent += rc;
+    }
+
+    return 0;
+}
+
+
+/* Check the response bytes as they come in, moving on to the next request
+ * or connection once one is complete; returns -1 if the connection has
+ * been ended */
+static int
+check_response(loop_t *l, conn_t *c)
+{
+    char                 buf[CHUNK_SIZE];
+    char                 expected[CHUNK_SIZE];
+    char                *eoh, *p;
+    size_t               n;
+    ssize_t              rc;
+
+    for ( ;; ) {
+        if (c->state == STATE_HEADER) {
+            rc = recv(c->fd, c->header + c->header_len,
+                      HEADER_MAX - 1 - c->header_len, 0);
+            if (rc <= 0) {
+                goto again;
+            }
+
+            c->header_len += rc;
+            c->header[c->header_len] = '\0';
+
+            eoh = strstr(c->header, "\r\n\r\n");
+            if (eoh == NULL) {
+                if (c->header_len == HEADER_MAX - 1) {
+                    end_conn(l, c, 0);
+                    return -1;
+                }
+
+                continue;
+            }
+
+            p = strcasestr(c->header, "\r\nContent-Length:");
+
+            if (strncmp(c->header, "HTTP/1.1 200 ", 13) != 0
+                || p == NULL || p > eoh
+                || strtoul(p + 17, NULL, 10) != client.bytes)
+            {
+                fprintf(stderr, "echo: bad response header\n");
+                end_conn(l, c, 0);
+                return -1;
+            }
+
+            eoh += 4;
+            n = c->header + c->header_len - eoh;
+
+            if (n > client.bytes) {
+                end_conn(l, c, 0);
+                return -1;
+            }
+
+            fill_body(c, 0, expected, n);
+
+            if (memcmp(eoh, expected, n) != 0) {
+                fprintf(stderr, "echo: bad body on connection %d\n", c->id);
+                end_conn(l, c, 0);
+                return -1;
+            }
+
+            c->received = n;
+            c->state = STATE_BODY;
+
+        } else {
+            n = client.bytes - c->received;
+            if (n > sizeof(buf)) {
+                n = sizeof(buf);
+            }
+
+            rc = recv(c->fd, buf, n, 0);
+            if (rc <= 0) {
+                goto again;
+            }
+
+            fill_body(c, c->received, expected, rc);
+
+            if (memcmp(buf, expected, rc) != 0) {
+                fprintf(stderr, "echo: bad body on connection %d\n", c->id);
+                end_conn(l, c, 0);
+                return -1;
+            }
+
+            c->received += rc;
+        }
+
+        if (c->received < client.bytes) {
+            continue;
+        }
+
+        client.checked += client.bytes;
+        client.completed++;
+
+        if (++c->request == client.requests) {
+            end_conn(l, c, 1);
+            return -1;
+        }
+
+        c->state = STATE_HEADER;
+        c->request_len = 0;
+
+        if (send_request(c) != 0) {
+            end_conn(l, c, 0);
+            return -1;
+        }
+    }
+
+again:
+
+    if (rc == 0 || (rc < 0 && errno != EAGAIN)) {
+        fprintf(stderr, "echo: connection %d lost: %s\n", c->id,
+                rc == 0 ? "closed" : strerror(errno));
+        end_conn(l, c, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+end_conn(loop_t *l, conn_t *c, int ok)
+{
+    if (!ok) {
+        client.failed++;
+    }
+
+    close_conn(l, c);
+
+    client.active--;
+    client.done++;
+}
+
+
+/* The body bytes depend on the connection, the request and the offset, so
+ * that bytes lost, repeated or swapped all show */
+static void
+fill_body(conn_t *c, size_t off, char *buf, size_t n)
+{
+    size_t               i;
+    uint32_t             seed;
+
+    seed = (uint32_t) c->id * 2654435761u + (uint32_t) c->request * 40503u;
+
+    for (i = 0; i < n; i++) {
+        buf[i] = (char) ((off + i) * 131 + seed + ((off + i) >> 8));
+    }
+}
+
+
+static int
+set_nonblocking(int fd)
+{
+    int                  flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+static double
+now_secs()
+{
+    struct timespec      ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+
+# Runs the microbenchmarks without mockeagain.so and with it in each mode,
+# and prints one CSV line per API, mode and number of fds, along with the
+# difference to the raw libc call:
+#
+#     mode,api,fds,calls,ns_per_call,overhead_ns
+#
+# BENCH_FDS overrides the numbers of fds, BENCH_TIME_MS the time spent on
+# each line (50ms by default).
+
+so=${1:-./mockeagain.so}
+bench=${2:-./bench/bench}
+fds=${BENCH_FDS:-"10 100 1000 10000 100000"}
+
+case $so in
+    /*) ;;
+    *) so=$PWD/$so ;;
+esac
+
+wpat='hang:never written by the benchmark'
+rpat='stall:never read by the benchmark'
+
+{
+    $bench raw $fds
+
+    LD_PRELOAD=$so $bench passthrough $fds
+
+    LD_PRELOAD=$so MOCKEAGAIN=rw $bench mocked $fds
+
+    LD_PRELOAD=$so MOCKEAGAIN=rw MOCKEAGAIN_WL=bench_whitelisted \
+        $bench whitelist $fds
+
+    LD_PRELOAD=$so MOCKEAGAIN_WRITE_PATTERNS=$wpat \
+        MOCKEAGAIN_READ_PATTERNS=$rpat $bench patterns $fds
+
+} | awk -F, '
+    BEGIN { print "mode,api,fds,calls,ns_per_call,overhead_ns" }
+    $1 == "raw" { raw[$2 "," $3] = $5 }
+    { printf "%s,%.1f\n", $0, $5 - raw[$2 "," $3] }
+'
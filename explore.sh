@@ -0,0 +1,172 @@
+#!/bin/sh
+
+# Runs a test command once for every stream offset in a range, with
+# mockeagain.so preloaded and MOCKEAGAIN_SPLIT injecting a single EAGAIN at
+# that offset of every mocked fd, as many runs at a time as there are CPUs,
+# and reports the offsets the test failed at:
+#
+#     sh explore.sh [-j jobs] [-o dir] [-t secs] [-p] [first-]last
+#         command [args...]
+#
+# With -p, every pair of offsets in the range is run instead. The command
+# fails a run by exiting with a status other than 0, or by running longer
+# than the timeout of -t (60 seconds by default, if timeout(1) is around).
+#
+# The runs inherit MOCKEAGAIN ("rw" if not set) and any other mockeagain
+# environment, like MOCKEAGAIN_TARGET to split only some connections. The
+# report goes to dir/report (a temporary directory by default) as CSV:
+#
+#     offset,status,split
+#
+# where split is the number of streams actually cut at the offset, 0
+# meaning that no stream got that far while mocked; the output of the
+# failed runs is kept in dir/<offset>.out. The exit status is 1 if any of
+# the runs failed.
+#
+# The MOCKEAGAIN_SO environment points to the library, mockeagain.so next
+# to this script by default.
+
+usage() {
+    echo "usage: $0 [-j jobs] [-o dir] [-t secs] [-p] [first-]last" \
+         "command [args...]" >&2
+    exit 2
+}
+
+# runs a single offset (or pair of offsets), called back through xargs
+if [ "$1" = "--run" ]; then
+    dir=$2
+    split=$3
+    shift 3
+
+    name=$(echo "$split" | tr , _)
+
+    rm -f "$dir/$name.stats"
+
+    MOCKEAGAIN=${MOCKEAGAIN-rw} MOCKEAGAIN_SPLIT=$split \
+    MOCKEAGAIN_STATS=$dir/$name.stats LD_PRELOAD=$MOCKEAGAIN_SO \
+        $EXPLORE_TIMEOUT "$@" >"$dir/$name.out" 2>&1 </dev/null
+    status=$?
+
+    # the streams cut at the offsets, as counted in the totals per API of
+    # every process writing them out at exit
+
+    reached=$(sed -n 's/^mockeagain:   [a-z0-9_]*: .*split \([0-9]*\).*/\1/p' \
+                  "$dir/$name.stats" 2>/dev/null \
+              | awk '{ n += $1 } END { print n + 0 }')
+
+    echo "$split,$status,$reached" >"$dir/$name.result"
+
+    rm -f "$dir/$name.stats"
+
+    if [ $status -eq 0 ]; then
+        rm -f "$dir/$name.out"
+    fi
+
+    exit 0
+fi
+
+jobs=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+dir=
+secs=60
+pairs=0
+
+while getopts j:o:t:p opt; do
+    case $opt in
+        j) jobs=$OPTARG ;;
+        o) dir=$OPTARG ;;
+        t) secs=$OPTARG ;;
+        p) pairs=1 ;;
+        *) usage ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+
+[ $# -ge 2 ] || usage
+
+case $1 in
+    *-*) first=${1%-*}; last=${1#*-} ;;
+    *) first=0; last=$1 ;;
+esac
+
+shift
+
+case $first$last in
+    ''|*[!0-9]*) usage ;;
+esac
+
+if [ -z "$MOCKEAGAIN_SO" ]; then
+    MOCKEAGAIN_SO=$(cd "$(dirname "$0")" && pwd)/mockeagain.so
+fi
+
+case $MOCKEAGAIN_SO in
+    /*) ;;
+    *) MOCKEAGAIN_SO=$PWD/$MOCKEAGAIN_SO ;;
+esac
+
+if [ ! -f "$MOCKEAGAIN_SO" ]; then
+    echo "explore: $MOCKEAGAIN_SO not found, run make first" >&2
+    exit 2
+fi
+
+if [ -z "$dir" ]; then
+    dir=$(mktemp -d "${TMPDIR:-/tmp}/mockeagain-explore.XXXXXX") || exit 2
+
+else
+    mkdir -p "$dir" || exit 2
+    rm -f "$dir"/*.result "$dir"/*.out
+fi
+
+EXPLORE_TIMEOUT=
+if [ "$secs" != 0 ] && command -v timeout >/dev/null 2>&1; then
+    EXPLORE_TIMEOUT="timeout $secs"
+fi
+
+export MOCKEAGAIN_SO EXPLORE_TIMEOUT
+
+if [ $pairs = 1 ]; then
+    awk -v first=$first -v last=$last 'BEGIN {
+        for (a = first; a <= last; a++)
+            for (b = a + 1; b <= last; b++)
+                print a "," b
+    }'
+
+else
+    awk -v first=$first -v last=$last 'BEGIN {
+        for (a = first; a <= last; a++)
+            print a
+    }'
+
+fi | xargs -P "$jobs" -I {} sh "$0" --run "$dir" {} "$@"
+
+echo "offset,status,split" >"$dir/report"
+
+find "$dir" -name '*.result' -exec cat {} + \
+    | sort -t , -k 1,1n -k 2,2n >>"$dir/report"
+
+awk -F , -v dir="$dir" '
+    NR == 1 { next }
+    {
+        runs++
+
+        if ($NF == 0) {
+            missed++
+        }
+
+        if ($(NF - 1) != 0) {
+            failed++
+            offset = $1
+            for (i = 2; i < NF - 1; i++) {
+                offset = offset "," $i
+            }
+            name = offset
+            gsub(/,/, "_", name)
+            printf "explore: failed at offset %s with status %s, " \
+                   "see %s/%s.out\n", offset, $(NF - 1), dir, name
+        }
+    }
+    END {
+        printf "explore: %d runs, %d failed, %d never reached the offset, " \
+               "report in %s/report\n", runs, failed, missed, dir
+        exit failed > 0
+    }' "$dir/report"
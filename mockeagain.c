@@ -6,8 +6,21 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
 #include <sys/uio.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <dlfcn.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -15,8 +28,13 @@
 #include <stdio.h>
 #include <errno.h>
 #include <execinfo.h>
-#include <string.h>
-#include <search.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 
 #if DDEBUG
 #   define dd(...) \
@@ -28,22 +46,616 @@
 #endif
 
 
-#define MAX_FD 1024
+/* the socket types without the SOCK_NONBLOCK and SOCK_CLOEXEC flags */
+#ifndef SOCK_TYPE_MASK
+#define SOCK_TYPE_MASK 0xf
+#endif
+
+
+/* the per-fd readiness flags may be set by the thread running the event
+ * loop and cleared by whichever thread does the I/O, so they are always
+ * accessed atomically; everything else in an fd_state_t is only touched
+ * by the thread currently doing I/O on that fd */
+#define fd_load(_field)         __atomic_load_n(&(_field), __ATOMIC_RELAXED)
+#define fd_store(_field, _val)  __atomic_store_n(&(_field), (_val),         \
+                                                 __ATOMIC_RELAXED)
+#define fd_clear(_field, _bits) __atomic_fetch_and(&(_field), ~(_bits),     \
+                                                   __ATOMIC_RELAXED)
+
+
+/* the per-fd state table is a directory of lazily allocated pages */
+#define FD_PAGE_BITS 10
+#define FD_PAGE_SIZE (1 << FD_PAGE_BITS)
+#define FD_PAGE_MASK (FD_PAGE_SIZE - 1)
+
+/* upper bound for fds we are able to track when RLIMIT_NOFILE is unlimited */
+#define FD_LIMIT_MAX (1 << 24)
+
+/* the most iovec slots a mocked partial writev() passes on */
+#define MAX_CLAMPED_IOV 64
+
+/* the burst size of the token buckets, as a fraction of a second's worth of
+ * bytes; readiness is held back until a bucket is full again */
+#define RATE_BURST_DIVISOR 100
+
+/* set in the transitions of a pattern matcher that complete a pattern */
+#define MATCH_FLAG 0x80000000
+
+/* the statistics blocks of the threads of all the processes sharing the
+ * segment, the last one being shared by any threads beyond that */
+#define MAX_STATS_THREADS 1024
+#define STATS_MAGIC 0x4d454147          /* "GAEM" */
+#define STATS_VERSION 2
+#define STATS_NAME_LEN 16
+
+/* the records in the log ring of each thread, a power of 2, and the most
+ * threads logging at once; records beyond either are dropped. The flusher
+ * is woken early once a ring is 3/4 full. */
+#define LOG_RING_SIZE 16384
+#define MAX_LOG_THREADS 256
+#define LOG_FLUSH_INTERVAL 10           /* ms */
+#define LOG_LINE_LEN 512
+
+/* the records the trace file of MOCKEAGAIN_TRACE has room for; the file
+ * is sparse, so the room not used takes no disk space */
+#define TRACE_MAGIC 0x5254454d          /* "METR" */
+#define TRACE_VERSION 1
+#define TRACE_MAX_RECORDS (1 << 24)
+#define MAX_TRACE_PROCS 255
 
 #define MAX_BACKTRACE 64
 #define MAX_WHITELIST 64
 
+#define WHITELIST_CACHE_BITS 12
+#define WHITELIST_CACHE_SIZE (1 << WHITELIST_CACHE_BITS)
+
+#define MAX_TARGETS 32
+
+#define MAX_SPLITS 16
+
+#define MAX_FD_EPOLLS 4
+
+/* the MOCKEAGAIN_CONTROL segment, a page holding the configuration text */
+#define CONTROL_MAGIC 0x4c54434d        /* "MCTL" */
+#define CONTROL_VERSION 1
+#define CONTROL_CONFIG_LEN 4080
+
+
+/* an epoll registration as the application made it; the kernel gets the
+ * fd itself as the event data instead, so that epoll_wait() results can be
+ * mapped back to our per-fd state without any search */
+typedef struct {
+    uint32_t        events;
+    epoll_data_t    data;
+} epoll_reg_t;
+
+
+/* the epoll instances an fd is registered edge-triggered in, as epfd + 1
+ * so that 0 marks a free slot */
+typedef struct {
+    int             epfds[MAX_FD_EPOLLS];
+} fd_epolls_t;
+
+
+/* a token bucket limiting the bytes transferred in one direction */
+typedef struct {
+    int32_t         tokens;
+    uint32_t        stamp;          /* time of the last refill in us,
+                                       wrapping; 0 if never filled */
+} bucket_t;
+
+
+/* everything we know about a single fd, kept in one compact record so that
+ * an interposed call only ever touches a single cache line */
+typedef struct {
+    short           active;         /* revents of the last poll() */
+    unsigned char   polled;
+    unsigned char   weird;
+    unsigned char   targeted;       /* TARGET_UPSTREAM or TARGET_DOWNSTREAM
+                                       for connections, with TARGET_MATCHED
+                                       if one of the rules matches them */
+    unsigned char   snd_timeout;
+    unsigned char   epoll_et;       /* registered edge-triggered in some
+                                       epoll instance */
+    unsigned char   rcv_fault;      /* PATTERN_STALL or PATTERN_ERROR */
+    unsigned char   rcv_errno;      /* the errno of PATTERN_ERROR */
+    uint16_t        tgen;           /* targets_generation that targeted was
+                                       matched against, 0 for none */
+    bucket_t        rbucket;
+    bucket_t        wbucket;
+    uint32_t        rrandom;        /* PRNG states for reads and writes,
+                                       0 until seeded */
+    uint32_t        wrandom;
+    uint32_t        wmatch;         /* states of the pattern matchers */
+    uint32_t        rmatch;
+    uint32_t        rcv_until;      /* end of PATTERN_STALL in ms, wrapping;
+                                       0 for never */
+    uint32_t        mgen;           /* generation of the matchers wmatch
+                                       and rmatch are states of */
+    epoll_reg_t   **epoll_regs;     /* the shadow interest set if this fd
+                                       is an epoll instance itself */
+} __attribute__((aligned(64))) fd_state_t;
+
+
+/* the MOCKEAGAIN_CONTROL segment, written by a test harness: it writes
+ * the configuration text first, one NAME=value per line, then bumps the
+ * generation, and mockeagain copies the generation into applied once it
+ * has switched to that configuration */
+typedef struct {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            generation;
+    uint32_t            applied;
+    char                config[CONTROL_CONFIG_LEN];
+} control_t;
+
+
+/* a MOCKEAGAIN_TARGET rule, matched against the server end of a connection:
+ * the peer of the fds connected, the local end of the fds accepted */
+typedef struct {
+    int                 roles;      /* TARGET_UPSTREAM and TARGET_DOWNSTREAM */
+    int                 family;     /* AF_UNSPEC for any address */
+    unsigned char       addr[16];
+    int                 port;       /* 0 for any */
+    char               *path;       /* of AF_UNIX sockets */
+} target_t;
+
+
+/* a pattern to look for in a data stream, and what to do when found */
+typedef struct {
+    unsigned char      *data;
+    size_t              len;
+    int                 action;
+    int                 arg;        /* as given by "action=arg:pattern" */
+} mock_pattern_t;
+
+
+/* an Aho-Corasick automaton looking for many patterns at once, compiled
+ * into a DFA over the classes of bytes that appear in the patterns. The
+ * states are represented by their row offset in the transition table, so
+ * that the matching state per fd is a single word and each byte costs one
+ * lookup. */
+typedef struct {
+    uint32_t           *delta;
+    int                *match;      /* the pattern completed by each state,
+                                       -1 for none */
+    int                 nclasses;
+    int                 npatterns;
+    uint32_t            size;       /* of delta, in entries */
+    uint32_t            generation; /* bumped by every init_patterns() */
+    mock_pattern_t     *patterns;
+    unsigned char       classes[256];
+} matcher_t;
+
+
+typedef struct {
+    char          *name;
+    uintptr_t      start;       /* 0 if not resolved at init time */
+    uintptr_t      end;
+} whitelist_func_t;
+
+
+/* the functions of MOCKEAGAIN_WL along with the decisions taken for the
+ * return addresses seen so far, replaced as a whole when the list changes
+ * so that no decision outlives the list it was taken for */
+typedef struct {
+    int                 nfuncs;
+    int                 unresolved;
+    char               *names;      /* the tokenized copy of MOCKEAGAIN_WL
+                                       the funcs point into */
+    whitelist_func_t    funcs[MAX_WHITELIST];
+    uint64_t            cache[WHITELIST_CACHE_SIZE];
+                                    /* return address << 1 | decision, 0 for
+                                       empty slots */
+} whitelist_t;
+
+
+enum {
+    PATTERN_HANG = 1,
+    PATTERN_RESET,
+    PATTERN_CLOSE
+};
+
+
+enum {
+    PATTERN_STALL = 1,
+    PATTERN_ERROR
+};
+
+
+static const char *write_actions[] = { NULL, "hang", "reset", "close" };
+static const char *read_actions[] = { NULL, "stall", "error" };
+
+
+/* the protocols MOCKEAGAIN_FRAMER knows the message boundaries of */
+enum {
+    FRAMER_HTTP = 1,
+    FRAMER_TLS,
+    FRAMER_RESP,
+    FRAMER_MYSQL,
+    FRAMER_MAX
+};
+
+
+static const char *framer_names[] = { NULL, "http", "tls", "resp", "mysql" };
+
+
+enum {
+    FRAME_HEADER = 0,       /* in a record header or a protocol line */
+    FRAME_BODY,             /* in a body of known length */
+    FRAME_CRLF,             /* in the line ending a RESP bulk string or an
+                               HTTP chunk */
+    FRAME_CHUNK,            /* in an HTTP chunk size line */
+    FRAME_TRAILER,          /* in the HTTP trailer */
+    FRAME_STREAM            /* in a body running to the end of the stream,
+                               or lost track of the messages */
+};
+
+
+/* what the HTTP and RESP framers have seen of the message they are in */
+enum {
+    FRAME_STARTED = 0x01,   /* the start line */
+    FRAME_RESPONSE = 0x02,
+    FRAME_LENGTH = 0x04,    /* a Content-Length header */
+    FRAME_CHUNKED = 0x08,   /* a Transfer-Encoding header with "chunked" */
+    FRAME_IN_LENGTH = 0x10, /* in the values of those */
+    FRAME_IN_ENCODING = 0x20,
+    FRAME_NAME_DONE = 0x40, /* past the header name or chunk size */
+    FRAME_NULL = 0x80       /* a RESP bulk string of length -1 */
+};
+
+
+/* where a framer got in the stream of one direction of an fd; only the
+ * bytes in headers are looked at one by one, bodies are skipped at once */
+typedef struct {
+    uint64_t            left;       /* bytes to the end of the body */
+    uint64_t            value;      /* the length field being parsed */
+    uint16_t            pos;        /* bytes into the header or line, just
+                                       0 or 1 in bodies */
+    uint16_t            status;     /* of an HTTP response */
+    uint8_t             framer;     /* the framer that set it up */
+    uint8_t             state;
+    uint8_t             match;      /* the header name or value matched so
+                                       far, the RESP type */
+    uint8_t             flags;
+} frame_t;
+
+
+typedef struct {
+    frame_t             read;
+    frame_t             write;
+} fd_frames_t;
+
+
+/* how far the stream of one direction of an fd got, for MOCKEAGAIN_SPLIT */
+typedef struct {
+    uint64_t            offset;     /* bytes transferred so far */
+    uint64_t            done;       /* the offset of the last EAGAIN plus 1,
+                                       0 for none */
+} split_t;
+
+
+typedef struct {
+    split_t             read;
+    split_t             write;
+} fd_splits_t;
+
+
+/* the interposed calls, as told apart in the messages and statistics */
+enum {
+    API_POLL = 0,
+    API_PPOLL,
+    API_SELECT,
+    API_PSELECT,
+    API_EPOLL_WAIT,
+    API_EPOLL_PWAIT,
+    API_EPOLL_CTL,
+    API_SOCKET,
+    API_CLOSE,
+    API_WRITE,
+    API_WRITEV,
+    API_SEND,
+    API_SENDTO,
+    API_SENDMSG,
+    API_SENDMMSG,
+    API_SENDFILE,
+    API_SPLICE,
+    API_READ,
+    API_READV,
+    API_RECV,
+    API_RECVFROM,
+    API_RECVMSG,
+    API_RECVMMSG,
+    API_SOCKETPAIR,
+    API_ACCEPT,
+    API_ACCEPT4,
+    API_DUP,
+    API_DUP2,
+    API_DUP3,
+    API_FCNTL,
+    API_CONNECT,
+    API_CLOCK_GETTIME,
+    API_GETTIMEOFDAY,
+    API_TIME,
+    API_PTHREAD_COND_TIMEDWAIT,
+    API_SEM_TIMEDWAIT,
+    API_CLOCK_NANOSLEEP,
+    API_TIMERFD_SETTIME,
+    API_MAX
+};
+
+
+static const char *api_names[] = {
+    "poll", "ppoll", "select", "pselect", "epoll_wait", "epoll_pwait",
+    "epoll_ctl", "socket", "close", "write", "writev", "send", "sendto",
+    "sendmsg", "sendmmsg", "sendfile", "splice", "read", "readv", "recv",
+    "recvfrom", "recvmsg", "recvmmsg", "socketpair", "accept", "accept4",
+    "dup", "dup2", "dup3", "fcntl", "connect", "clock_gettime",
+    "gettimeofday", "time", "pthread_cond_timedwait", "sem_timedwait",
+    "clock_nanosleep", "timerfd_settime"
+};
+
+
+/* the statistics counted per thread and API, and per fd */
+enum {
+    STAT_EAGAIN = 0,        /* EAGAINs faked */
+    STAT_PARTIAL,           /* transfers cut short */
+    STAT_RBYTES,            /* bytes read and written by mocked calls */
+    STAT_WBYTES,
+    STAT_HELD,              /* events suppressed or held back */
+    STAT_WAITS,             /* calls into the event APIs */
+    STAT_BYPASS,            /* calls passed on for whitelisted callers */
+    STAT_SPLIT,             /* streams cut at MOCKEAGAIN_SPLIT offsets */
+    STAT_MAX
+};
+
+
+static const char *stat_names[] = {
+    "eagain", "partial", "rbytes", "wbytes", "held", "waits", "bypass",
+    "split"
+};
+
+
+typedef struct {
+    int32_t             pid;        /* of the owner, 0 for the overflow
+                                       block */
+    uint32_t            reserved;
+    uint64_t            counters[API_MAX][STAT_MAX];
+} __attribute__((aligned(64))) thread_stats_t;
+
+
+typedef struct {
+    uint64_t            counters[STAT_MAX];
+} fd_stats_t;
+
+
+/* the head of the statistics, followed by MAX_STATS_THREADS blocks of
+ * thread_stats_t; it is laid out so that it can be read by other processes
+ * in the MOCKEAGAIN_STATS_SHM segment */
+typedef struct {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            napis;
+    uint32_t            nstats;
+    uint32_t            nslots;
+    uint32_t            used;       /* slots claimed so far, may exceed
+                                       nslots */
+    int32_t             pid;
+    uint32_t            reserved;
+    char                api_names[API_MAX][STATS_NAME_LEN];
+    char                stat_names[STAT_MAX][STATS_NAME_LEN];
+} __attribute__((aligned(64))) stats_header_t;
+
+
+/* the verbose events, formatted only when the log is written out */
+enum {
+    LOG_WRITE = 0,
+    LOG_READ,
+    LOG_SPLICE,
+    LOG_EAGAIN,
+    LOG_MATCH,
+    LOG_FAIL,
+    LOG_TIMEOUT,
+    LOG_HANG,
+    LOG_STALL,
+    LOG_HOLD,
+    LOG_BYPASS,
+    LOG_POLLED,
+    LOG_EPOLL_CTL,
+    LOG_WAIT_MORE,
+    LOG_SLEEP,
+    LOG_REARM,
+    LOG_TARGET,
+    LOG_WARP,
+    LOG_FRAME,
+    LOG_SPLIT,
+    LOG_MAX
+};
+
+
+/* the MOCKEAGAIN_VERBOSE level each event needs; the second level adds the
+ * calls passed on untouched and the details of the event APIs */
+static const unsigned char log_levels[] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1
+};
+
 
-static void *libc_handle = NULL;
-static short active_fds[MAX_FD + 1];
-static char  polled_fds[MAX_FD + 1];
-static char  weird_fds[MAX_FD + 1];
-static char  snd_timeout_fds[MAX_FD + 1];
-static char **matchbufs = NULL;
-static size_t matchbuf_len = 0;
-static const char *pattern = NULL;
-static int verbose = -1;
-static int mocking_type = -1;
+/* a verbose event as recorded in the hot path; the meaning of a to d
+ * depends on the event, see format_log_record() */
+typedef struct {
+    int64_t             time;       /* us */
+    int64_t             a;
+    int64_t             b;
+    int32_t             c;
+    int32_t             d;
+    int32_t             fd;
+    uint16_t            event;
+    uint16_t            api;
+} log_record_t;
+
+
+/* a single-producer single-consumer ring of log records; head is only
+ * written by the owner thread and tail only by whoever holds log_mutex */
+typedef struct {
+    uint32_t            head;
+    uint32_t            dropped;
+    int                 slot;
+    int                 used;       /* claimed by a live thread */
+    uint32_t            tail __attribute__((aligned(64)));
+    log_record_t        records[LOG_RING_SIZE] __attribute__((aligned(64)));
+} log_ring_t;
+
+
+/* the mocking decisions as recorded in a trace */
+enum {
+    TRACE_BUDGET = 1,       /* bytes granted to a read or write, 0 for an
+                               EAGAIN */
+    TRACE_CONSUME,          /* readiness withdrawn after a transfer, or
+                               not */
+    TRACE_EAGAIN,           /* EAGAIN faked, for whatever reason */
+    TRACE_POLL,             /* events let through by an event API */
+    TRACE_MATCH,            /* pattern found in the data */
+    TRACE_FAIL,             /* read failed by an error pattern */
+    TRACE_PROC              /* pid of the process numbered proc */
+};
+
+
+/* the streams of decisions replayed per fd */
+enum {
+    REPLAY_READS = 0,
+    REPLAY_WRITES,
+    REPLAY_POLL,
+    REPLAY_MAX
+};
+
+
+/* the head of a trace file, followed by the records */
+typedef struct {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            record_size;
+    uint32_t            capacity;
+    uint64_t            count;      /* records appended so far, may exceed
+                                       capacity */
+    uint32_t            nprocs;     /* processes tracing so far, forked
+                                       ones included */
+    uint32_t            reserved[9];
+} trace_header_t;
+
+
+/* a single mocking decision. For TRACE_BUDGET and TRACE_CONSUME requested
+ * and granted are bytes, for TRACE_POLL the events reported by the kernel
+ * and let through. arg is whether readiness was withdrawn for
+ * TRACE_CONSUME, the us to hold back for TRACE_POLL, the pattern for
+ * TRACE_MATCH and the errno for TRACE_FAIL. */
+typedef struct {
+    int32_t             fd;
+    uint32_t            requested;
+    uint32_t            granted;
+    uint32_t            arg;
+    uint8_t             api;
+    uint8_t             dir;        /* MOCKING_READS or MOCKING_WRITES */
+    uint8_t             decision;
+    uint8_t             proc;       /* in order of fork, 0 for the first
+                                       process */
+} trace_record_t;
+
+
+/* where the decisions of an fd are in replay_index */
+typedef struct {
+    uint32_t            first[REPLAY_MAX];
+    uint32_t            count[REPLAY_MAX];
+    uint32_t            pos[REPLAY_MAX];
+} replay_stream_t;
+
+
+/* the state of a single call into one of the event APIs */
+typedef struct {
+    int                 api;
+    int64_t             deadline;   /* in us, -1 for none */
+    int64_t             holdback;   /* us until the first fd held back by
+                                       the rate limit may be ready again,
+                                       0 for none */
+    const sigset_t     *sigmask;
+} wait_ctx_t;
+
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static fd_state_t **fd_pages = NULL;
+static int fd_npages = 0;
+static matcher_t no_patterns;
+static matcher_t *write_matcher = &no_patterns;
+static matcher_t *read_matcher = &no_patterns;
+static uint32_t matcher_generation = 0;
+static uint64_t rate = 0;
+static int32_t rate_burst = 0;
+static int random_chunks = 0;
+static target_t *targets = NULL;
+static int ntargets = 0;
+static uint16_t targets_generation = 0;    /* never 0 once loaded */
+static control_t *control = NULL;
+static uint32_t control_generation = 0;
+static char *control_config = NULL;     /* NAME=value strings */
+static pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int framer = 0;
+static fd_frames_t **frame_pages = NULL;
+static uint64_t *splits = NULL;         /* sorted */
+static int nsplits = 0;
+static fd_splits_t **split_pages = NULL;
+static fd_epolls_t **epoll_pages = NULL;
+static int timewarp = 0;
+static int64_t warp_us = 0;             /* how far the clocks were moved
+                                           forward instead of sleeping */
+static uint32_t random_seed = 0;
+static size_t chunk_min = 1;
+static size_t chunk_max = 1;
+static uint32_t eagain_threshold = 0;   /* EAGAIN probability * 2^32 */
+static int verbose = 0;
+static int mocking_type = 0;
+static stats_header_t *stats = NULL;
+static thread_stats_t *stats_slots = NULL;
+static fd_stats_t **fd_stats_pages = NULL;
+static int stats_fd = -1;
+static __thread thread_stats_t *thread_stats
+    __attribute__((tls_model("initial-exec"))) = NULL;
+static int log_fd = -1;
+static int log_threaded = 0;
+static int log_flusher_running = 0;
+static log_ring_t *log_rings[MAX_LOG_THREADS];
+static uint32_t log_lost = 0;
+static pthread_key_t log_key;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static char log_buf[65536];
+static __thread log_ring_t *log_ring
+    __attribute__((tls_model("initial-exec"))) = NULL;
+static trace_header_t *trace = NULL;
+static trace_record_t *trace_records = NULL;
+static uint32_t *trace_nprocs = NULL;
+static uint8_t trace_proc = 0;
+static trace_header_t *replay = NULL;
+static trace_record_t *replay_records = NULL;
+static size_t replay_size = 0;
+static uint32_t replay_nrecords = 0;
+static replay_stream_t *replay_streams = NULL;
+static int replay_nfds = 0;
+static uint32_t *replay_index = NULL;
+static uint64_t replay_counts[3];       /* replayed, mismatched, missed */
+
+
+enum {
+    TARGET_UPSTREAM = 0x01,
+    TARGET_DOWNSTREAM = 0x02,
+    TARGET_MATCHED = 0x04
+};
+
+
+/* what an fd inherits from the one it is accepted or duplicated from,
+ * along with the TARGET_* bits */
+enum {
+    FD_WEIRD = 0x08
+};
 
 
 enum {
@@ -52,30 +664,44 @@ enum {
 };
 
 
-#   define init_libc_handle() \
-        if (libc_handle == NULL) { \
-            libc_handle = RTLD_NEXT; \
-        }
+#define count_stat(_api, _fd, _stat, _n)                                \
+do {                                                                    \
+    if (stats) {                                                        \
+        add_stat(_api, _fd, _stat, _n);                                 \
+    }                                                                   \
+} while (0)
+
 
+/* whether the bytes transferred in the direction of matcher m have to be
+ * looked at, for the patterns, the framer or the split offsets */
+#define scans_data(_m)  ((_m)->npatterns || framer || nsplits)
 
-#define call_original(_symbol, _orig_func, ...)                         \
+
+/* the level is checked before any of the arguments are evaluated */
+#define log_event(_ev, _api, _fd, _a, _b, _c, _d)                       \
 do {                                                                    \
-    init_libc_handle();                                                 \
-                                                                        \
-    if (_orig_func == NULL) {                                           \
-        _orig_func = dlsym(libc_handle, _symbol);                       \
-        if (_orig_func == NULL) {                                       \
-            fprintf(stderr, "mockeagain: could not find the underlying" \
-                    " " _symbol ": %s\n", dlerror());                   \
-            exit(1);                                                    \
-        }                                                               \
+    if (verbose >= log_levels[_ev]) {                                   \
+        add_log_record(_ev, _api, _fd, (int64_t) (_a), (int64_t) (_b),  \
+                       (int32_t) (_c), (int32_t) (_d));                 \
     }                                                                   \
-                                                                        \
-    if (get_verbose_level()) {                                          \
-        fprintf(stderr, "mockeagain: calling the original libc:"        \
-                " '" _symbol "'\n");                                    \
-                                                                        \
+} while (0)
+
+
+/* appending a record is a single atomic add and a store to the mapping */
+#define trace_decision(_api, _fd, _dir, _decision, _req, _granted, _arg)\
+do {                                                                    \
+    if (trace) {                                                        \
+        add_trace_record(_api, _fd, _dir, _decision, _req, _granted,    \
+                         _arg);                                         \
     }                                                                   \
+} while (0)
+
+
+#define call_original(_api, _orig_func, ...)                            \
+do {                                                                    \
+    log_event(LOG_BYPASS, _api, -1, 0, 0, 0, 0);                        \
+                                                                        \
+    count_stat(_api, -1, STAT_BYPASS, 1);                               \
                                                                         \
     retval = (*_orig_func)(__VA_ARGS__);                                \
                                                                         \
@@ -85,7 +711,7 @@ do {                                                                    \
 
 typedef int (*socket_handle) (int domain, int type, int protocol);
 
-typedef int (*poll_handle) (struct pollfd *ufds, unsigned int nfds,
+typedef int (*poll_handle) (struct pollfd *ufds, nfds_t nfds,
     int timeout);
 
 typedef ssize_t (*writev_handle) (int fildes, const struct iovec *iov,
@@ -104,850 +730,8157 @@ typedef ssize_t (*recv_handle) (int sockfd, void *buf, size_t len,
 typedef ssize_t (*recvfrom_handle) (int sockfd, void *buf, size_t len,
     int flags, struct sockaddr *src_addr, socklen_t *addrlen);
 
+typedef ssize_t (*write_handle) (int fd, const void *buf, size_t count);
+
+typedef ssize_t (*sendto_handle) (int sockfd, const void *buf, size_t len,
+    int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
 
-static int get_verbose_level();
-static void init_matchbufs();
-static int now();
-static int get_mocking_type();
+typedef ssize_t (*sendmsg_handle) (int sockfd, const struct msghdr *msg,
+    int flags);
+
+typedef int (*sendmmsg_handle) (int sockfd, struct mmsghdr *msgvec,
+    unsigned int vlen, int flags);
+
+typedef ssize_t (*readv_handle) (int fd, const struct iovec *iov,
+    int iovcnt);
+
+typedef ssize_t (*recvmsg_handle) (int sockfd, struct msghdr *msg,
+    int flags);
+
+typedef int (*recvmmsg_handle) (int sockfd, struct mmsghdr *msgvec,
+    unsigned int vlen, int flags, struct timespec *timeout);
+
+typedef ssize_t (*sendfile_handle) (int out_fd, int in_fd, off_t *offset,
+    size_t count);
+
+typedef ssize_t (*splice_handle) (int fd_in, loff_t *off_in, int fd_out,
+    loff_t *off_out, size_t len, unsigned int flags);
+
+typedef int (*ppoll_handle) (struct pollfd *ufds, nfds_t nfds,
+    const struct timespec *timeout, const sigset_t *sigmask);
+
+typedef int (*select_handle) (int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, struct timeval *timeout);
+
+typedef int (*pselect_handle) (int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, const struct timespec *timeout,
+    const sigset_t *sigmask);
+
+typedef int (*epoll_ctl_handle) (int epfd, int op, int fd,
+    struct epoll_event *event);
+
+typedef int (*socketpair_handle) (int domain, int type, int protocol,
+    int sv[2]);
+
+typedef int (*accept_handle) (int sockfd, struct sockaddr *addr,
+    socklen_t *addrlen);
+
+typedef int (*accept4_handle) (int sockfd, struct sockaddr *addr,
+    socklen_t *addrlen, int flags);
+
+typedef int (*dup_handle) (int oldfd);
+
+typedef int (*dup2_handle) (int oldfd, int newfd);
+
+typedef int (*dup3_handle) (int oldfd, int newfd, int flags);
+
+typedef int (*fcntl_handle) (int fd, int cmd, ...);
+
+typedef int (*connect_handle) (int sockfd, const struct sockaddr *addr,
+    socklen_t addrlen);
+
+typedef int (*clock_gettime_handle) (clockid_t clk, struct timespec *tp);
+
+typedef int (*gettimeofday_handle) (struct timeval *tv, void *tz);
+
+typedef time_t (*time_handle) (time_t *tloc);
+
+typedef int (*pthread_cond_timedwait_handle) (pthread_cond_t *cond,
+    pthread_mutex_t *mutex, const struct timespec *abstime);
+
+typedef int (*sem_timedwait_handle) (sem_t *sem,
+    const struct timespec *abstime);
+
+typedef int (*clock_nanosleep_handle) (clockid_t clk, int flags,
+    const struct timespec *req, struct timespec *rem);
+
+typedef int (*timerfd_settime_handle) (int fd, int flags,
+    const struct itimerspec *new_value, struct itimerspec *old_value);
+
+typedef int (*epoll_wait_handle) (int epfd, struct epoll_event *events,
+    int maxevents, int timeout);
+
+typedef int (*epoll_pwait_handle) (int epfd, struct epoll_event *events,
+    int maxevents, int timeout, const sigset_t *sigmask);
+
+
+/* one entry per interposed API, in the order of the API_* constants */
+typedef struct {
+    poll_handle             poll;
+    ppoll_handle            ppoll;
+    select_handle           select;
+    pselect_handle          pselect;
+    epoll_wait_handle       epoll_wait;
+    epoll_pwait_handle      epoll_pwait;
+    epoll_ctl_handle        epoll_ctl;
+    socket_handle           socket;
+    close_handle            close;
+    write_handle            write;
+    writev_handle           writev;
+    send_handle             send;
+    sendto_handle           sendto;
+    sendmsg_handle          sendmsg;
+    sendmmsg_handle         sendmmsg;
+    sendfile_handle         sendfile;
+    splice_handle           splice;
+    read_handle             read;
+    readv_handle            readv;
+    recv_handle             recv;
+    recvfrom_handle         recvfrom;
+    recvmsg_handle          recvmsg;
+    recvmmsg_handle         recvmmsg;
+    socketpair_handle       socketpair;
+    accept_handle           accept;
+    accept4_handle          accept4;
+    dup_handle              dup;
+    dup2_handle             dup2;
+    dup3_handle             dup3;
+    fcntl_handle            fcntl;
+    connect_handle          connect;
+    clock_gettime_handle    clock_gettime;
+    gettimeofday_handle     gettimeofday;
+    time_handle             time;
+    pthread_cond_timedwait_handle  pthread_cond_timedwait;
+    sem_timedwait_handle    sem_timedwait;
+    clock_nanosleep_handle  clock_nanosleep;
+    timerfd_settime_handle  timerfd_settime;
+} funcs_t;
+
+
+/* the libc functions, resolved once at load time */
+static funcs_t orig;
+
+
+static int mock_poll(struct pollfd *ufds, nfds_t nfds, int timeout);
+static int mock_ppoll(struct pollfd *ufds, nfds_t nfds,
+    const struct timespec *timeout, const sigset_t *sigmask);
+static int mock_select(int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, struct timeval *timeout);
+static int mock_pselect(int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, const struct timespec *timeout,
+    const sigset_t *sigmask);
+static int mock_epoll_wait(int epfd, struct epoll_event *events,
+    int maxevents, int timeout);
+static int mock_epoll_pwait(int epfd, struct epoll_event *events,
+    int maxevents, int timeout, const sigset_t *sigmask);
+static int mock_epoll_ctl(int epfd, int op, int fd,
+    struct epoll_event *event);
+static int mock_socket(int domain, int type, int protocol);
+static int mock_close(int fd);
+static ssize_t mock_write(int fd, const void *buf, size_t len);
+static ssize_t mock_writev(int fd, const struct iovec *iov, int iovcnt);
+static ssize_t mock_send(int fd, const void *buf, size_t len, int flags);
+static ssize_t mock_sendto(int fd, const void *buf, size_t len, int flags,
+    const struct sockaddr *dest_addr, socklen_t addrlen);
+static ssize_t mock_sendmsg(int fd, const struct msghdr *msg, int flags);
+static int mock_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+    int flags);
+static ssize_t mock_sendfile(int out_fd, int in_fd, off_t *offset,
+    size_t count);
+static ssize_t mock_splice(int fd_in, loff_t *off_in, int fd_out,
+    loff_t *off_out, size_t len, unsigned int flags);
+static ssize_t mock_read(int fd, void *buf, size_t len);
+static ssize_t mock_readv(int fd, const struct iovec *iov, int iovcnt);
+static ssize_t mock_recv(int fd, void *buf, size_t len, int flags);
+static ssize_t mock_recvfrom(int fd, void *buf, size_t len, int flags,
+    struct sockaddr *src_addr, socklen_t *addrlen);
+static ssize_t mock_recvmsg(int fd, struct msghdr *msg, int flags);
+static int mock_recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+    int flags, struct timespec *timeout);
+static int mock_socketpair(int domain, int type, int protocol, int sv[2]);
+static void init_accepted_fd(int api, int sockfd, int fd);
+static void target_fd(int api, int fd, fd_state_t *fs, int role,
+    const struct sockaddr *sa, socklen_t len, uint16_t gen);
+static int is_targeted(int api, int fd, fd_state_t *fs);
+static int mock_accept(int sockfd, struct sockaddr *addr,
+    socklen_t *addrlen);
+static int mock_accept4(int sockfd, struct sockaddr *addr,
+    socklen_t *addrlen, int flags);
+static int mock_dup(int oldfd);
+static int mock_dup2(int oldfd, int newfd);
+static int mock_dup3(int oldfd, int newfd, int flags);
+static int mock_fcntl(int fd, int cmd, ...);
+static int mock_connect(int sockfd, const struct sockaddr *addr,
+    socklen_t addrlen);
+static int mock_clock_gettime(clockid_t clk, struct timespec *tp);
+static int mock_gettimeofday(struct timeval *tv, void *tz);
+static time_t mock_time(time_t *tloc);
+static int mock_pthread_cond_timedwait(pthread_cond_t *cond,
+    pthread_mutex_t *mutex, const struct timespec *abstime);
+static int mock_sem_timedwait(sem_t *sem, const struct timespec *abstime);
+static int mock_clock_nanosleep(clockid_t clk, int flags,
+    const struct timespec *req, struct timespec *rem);
+static int mock_timerfd_settime(int fd, int flags,
+    const struct itimerspec *new_value, struct itimerspec *old_value);
+static const struct timespec *unwarp_deadline(const struct timespec *abstime,
+    struct timespec *ts);
+static int is_warped_clock(clockid_t clk);
+static void warp_clock(int api, int64_t us);
+static void init_timewarp();
+static void init_framer();
+static frame_t *get_frame(int fd, int dir, int create);
+static void reset_frames(int fd);
+static size_t get_frame_budget(frame_t *f);
+static void run_framer(int api, int fd, int dir, const struct iovec *iov,
+    int iovcnt, size_t n);
+static size_t feed_frame(frame_t *f, const unsigned char *p, size_t len);
+static void frame_byte(frame_t *f, unsigned char c);
+static void start_body(frame_t *f, uint64_t len);
+static void end_body(frame_t *f);
+static void frame_http(frame_t *f, unsigned char c);
+static void end_http_headers(frame_t *f);
+static void frame_resp(frame_t *f, unsigned char c);
+static void init_splits();
+static split_t *get_split(int fd, int dir, int create);
+static void reset_splits(int fd);
+static void advance_split(int api, int fd, int dir, size_t n);
+static size_t get_split_budget(int api, int fd, int dir, split_t *sp,
+    size_t len);
+static void load_mockeagain() __attribute__((constructor));
+static void init_mockeagain();
+static void do_init();
+static void *get_original(const char *name);
+static void init_originals();
+static void init_dispatch();
+static void init_verbose_level();
+static void init_mocking_type();
+static int is_mocking_enabled();
+static const char *get_config(const char *name);
+static void init_control();
+static int load_control();
+static void apply_control();
+static void reset_fd_mocking();
+static void init_fd_pages();
+static fd_state_t *get_fd_state(int fd);
+static fd_state_t *alloc_fd_state(int fd);
+static void reset_fd_state(fd_state_t *fs);
+static void init_fd_state(int fd, int flags);
+static int get_fd_flags(int fd);
+static void *get_page_entry(void **pages, int n, size_t size, int create);
+static void init_wait_ctx(wait_ctx_t *wc, int api, int timeout,
+    const sigset_t *sigmask);
+static int get_remaining_ms(wait_ctx_t *wc);
+static int get_timeout_ms(time_t sec, long ms);
+static int wait_again(wait_ctx_t *wc);
+static int emulate_timeout(wait_ctx_t *wc);
+static int filter_events(wait_ctx_t *wc, int fd, int events);
+static int decide_events(wait_ctx_t *wc, int fd, fd_state_t *fs, int events);
+static int filter_pollfds(wait_ctx_t *wc, struct pollfd *ufds, nfds_t nfds,
+    int nready);
+static int filter_fdsets(wait_ctx_t *wc, int nfds, fd_set *saved,
+    fd_set *readfds, fd_set *writefds, fd_set *exceptfds);
+static void save_fdsets(fd_set *saved, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds);
+static void restore_fdsets(fd_set *saved, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds);
+static int filter_epoll_wait(int api, int epfd, struct epoll_event *events,
+    int maxevents, int timeout, const sigset_t *sigmask);
+static epoll_reg_t *get_epoll_reg(int epfd, int fd, int create);
+static uint32_t get_epoll_kernel_events(fd_state_t *fs, epoll_reg_t *reg);
+static void update_epoll_reg(int epfd, int fd, fd_state_t *fs,
+    epoll_reg_t *reg);
+static fd_epolls_t *get_fd_epolls(int fd, int create);
+static void set_fd_epoll(int fd, fd_state_t *fs, int epfd, int et);
+static void reset_epolls(int fd);
+static void rearm_epoll(int fd, fd_state_t *fs);
+static void free_epoll_regs(epoll_reg_t **regs);
+static void init_stats();
+static void reset_stats_in_child();
+static void reset_fds_in_child();
+static void reset_control_in_child();
+static void add_stat(int api, int fd, int stat, uint64_t n);
+static void flush_fd_stats(int fd, const char *why);
+static void dump_stats();
+static void dump_stats_on_signal(int signo);
+static int format_stats(char *buf, size_t size, const uint64_t *counters);
+static int append_str(char *buf, size_t size, int n, const char *s);
+static int append_uint(char *buf, size_t size, int n, uint64_t v);
+static void write_stats(const char *buf, size_t len);
+static void init_log();
+static void add_log_record(int event, int api, int fd, int64_t a, int64_t b,
+    int32_t c, int32_t d);
+static log_ring_t *claim_log_ring();
+static void release_log_ring(void *data);
+static void start_log_flusher();
+static void *run_log_flusher(void *data);
+static void drain_log_ring(log_ring_t *ring);
+static void drain_log();
+static void reset_log_in_child();
+static int format_log_record(char *buf, size_t size, log_record_t *r);
+static void write_log(int fd, const char *buf, size_t len);
+static void init_trace();
+static void init_replay(const char *path);
+static void add_trace_record(int api, int fd, int dir, int decision,
+    uint64_t requested, uint64_t granted, uint32_t arg);
+static int get_replay_stream(trace_record_t *r);
+static int build_replay_index();
+static trace_record_t *get_replay_record(int fd, int stream, int decision,
+    uint64_t requested);
+static void report_replay();
+static void reset_trace_in_child();
+static void init_patterns();
+static void parse_patterns(matcher_t *m, const char *name, const char *spec,
+    const char **actions, int nactions);
+static int parse_pattern_arg(const char *p, size_t len);
+static int add_pattern(matcher_t *m, const unsigned char *data, size_t len,
+    int action, int arg);
+static int build_matcher(matcher_t *m);
+static int run_matcher(matcher_t *m, uint32_t *state, const unsigned char *p,
+    size_t len, size_t *pos);
+static void reset_connection(int fd);
+static void init_rate();
+static void refill_bucket(bucket_t *b, int64_t now);
+static int64_t get_bucket_wait(bucket_t *b, int64_t now);
+static size_t get_io_budget(int api, int fd, fd_state_t *fs, int dir,
+    size_t len);
+static size_t decide_io_budget(int api, fd_state_t *fs, int fd, int dir,
+    size_t len);
+static ssize_t fake_eagain(int api, int fd, fd_state_t *fs, int dir);
+static uint32_t get_random(fd_state_t *fs, int fd, int dir);
+static void init_random();
+static void init_targets();
+static int parse_target(target_t *t, const char *p, size_t len);
+static int match_target(int role, const struct sockaddr *sa, socklen_t len,
+    int *port);
+static void consume_io_budget(int api, int fd, fd_state_t *fs, int dir,
+    size_t len, ssize_t n);
+static size_t get_iov_len(const struct iovec *iov, int iovcnt);
+static unsigned int clamp_mmsg(struct mmsghdr *msgvec, unsigned int vlen,
+    size_t budget, struct mmsghdr *first, struct iovec *iov, int niov);
+static size_t match_mmsg(int api, int fd, fd_state_t *fs, int dir,
+    struct mmsghdr *msgvec, int n);
+static int clamp_iov(const struct iovec *iov, int iovcnt, size_t budget,
+    struct iovec *out, int nout);
+static void scan_data(int api, int fd, fd_state_t *fs, int dir,
+    const struct iovec *iov, int iovcnt, size_t n);
+static void match_patterns(int api, int fd, fd_state_t *fs, int dir,
+    const struct iovec *iov, int iovcnt, size_t n);
+static void apply_read_action(int fd, fd_state_t *fs, mock_pattern_t *pat);
+static int read_faulted(int api, int fd, fd_state_t *fs);
+static int64_t get_stall_wait(fd_state_t *fs, int64_t now);
+static int64_t now_us();
 static int is_whitelist();
-static int get_whitelist();
+static int is_whitelisted_addr(whitelist_t *wl, uintptr_t addr);
+static int resolve_whitelisted_addr(whitelist_t *wl, uintptr_t addr);
+static whitelist_t *get_whitelist();
+static void init_whitelist();
 
-#define WHITELIST_UNSET 0x00
-#define WHITELIST_ERR   0x01
-#define WHITELIST_OK    0x02
 
-static char whitelist_status = WHITELIST_UNSET;
+/* NULL if MOCKEAGAIN_WL lists no function */
+static whitelist_t *whitelist = NULL;
 
-int socket(int domain, int type, int protocol)
+static int
+mock_socket(int domain, int type, int protocol)
 {
     int                        fd;
-    static socket_handle       orig_socket = NULL;
 
     dd("calling my socket");
 
-    init_libc_handle();
+    fd = (*orig.socket)(domain, type, protocol);
 
-    if (orig_socket == NULL) {
-        orig_socket = dlsym(libc_handle, "socket");
-        if (orig_socket == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying socket: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
+    dd("socket with type %d (SOCK_STREAM %d, SOCK_DGRAM %d)", type,
+            SOCK_STREAM, SOCK_DGRAM);
+
+    if (fd >= 0) {
+        init_fd_state(fd, (type & SOCK_TYPE_MASK) != SOCK_STREAM
+                          ? FD_WEIRD : 0);
     }
 
-    init_matchbufs();
+    dd("socket returning %d", fd);
 
-    fd = (*orig_socket)(domain, type, protocol);
+    return fd;
+}
 
-    dd("socket with type %d (SOCK_STREAM %d, SOCK_DGRAM %d)", type,
-            SOCK_STREAM, SOCK_DGRAM);
 
-    if (fd <= MAX_FD) {
-        if (!(type & SOCK_STREAM)) {
-            dd("socket: the current fd is weird: %d", fd);
-            weird_fds[fd] = 1;
+static int
+mock_socketpair(int domain, int type, int protocol, int sv[2])
+{
+    int                        retval;
+    int                        flags;
 
-        } else {
-            weird_fds[fd] = 0;
-        }
+    dd("calling my socketpair");
 
-#if 1
-        if (matchbufs && matchbufs[fd]) {
-            free(matchbufs[fd]);
-            matchbufs[fd] = NULL;
-        }
-#endif
+    retval = (*orig.socketpair)(domain, type, protocol, sv);
 
-        active_fds[fd] = 0;
-        polled_fds[fd] = 0;
-        snd_timeout_fds[fd] = 0;
-    }
+    if (retval == 0) {
+        flags = (type & SOCK_TYPE_MASK) != SOCK_STREAM ? FD_WEIRD : 0;
 
-    dd("socket returning %d", fd);
+        init_fd_state(sv[0], flags);
+        init_fd_state(sv[1], flags);
+    }
 
-    return fd;
+    return retval;
 }
 
 
-int
-poll(struct pollfd *ufds, nfds_t nfds, int timeout)
+/* The accepted connections are of the type of the listening socket */
+static int
+mock_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
-    static void             *libc_handle;
-    int                      retval;
-    static poll_handle       orig_poll = NULL;
-    struct pollfd           *p;
-    int                      i;
-    int                      fd;
-    int                      begin = 0;
-    int                      elapsed = 0;
+    int                        fd;
 
-    dd("calling my poll");
+    dd("calling my accept");
 
-    init_libc_handle();
+    fd = (*orig.accept)(sockfd, addr, addrlen);
 
-    if (orig_poll == NULL) {
-        orig_poll = dlsym(libc_handle, "poll");
-        if (orig_poll == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying poll: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
+    if (fd >= 0) {
+        init_accepted_fd(API_ACCEPT, sockfd, fd);
     }
 
-    init_matchbufs();
+    return fd;
+}
+
 
-    dd("calling the original poll");
+static int
+mock_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
+    int flags)
+{
+    int                        fd;
 
-    if (pattern) {
-        begin = now();
-    }
+    dd("calling my accept4");
 
-    retval = (*orig_poll)(ufds, nfds, timeout);
+    fd = (*orig.accept4)(sockfd, addr, addrlen, flags);
 
-    if (pattern) {
-        elapsed = now() - begin;
+    if (fd >= 0) {
+        init_accepted_fd(API_ACCEPT4, sockfd, fd);
     }
 
-    if (retval > 0) {
-        struct timeval  tm;
+    return fd;
+}
 
-        p = ufds;
-        for (i = 0; i < nfds; i++, p++) {
-            fd = p->fd;
-            if (fd > MAX_FD || weird_fds[fd]) {
-                dd("skipping fd %d", fd);
-                continue;
-            }
 
-            if (pattern && (p->revents & POLLOUT) && snd_timeout_fds[fd]) {
+/* Start the state of a connection accepted from sockfd, which is only
+ * targeted if its local end matches a MOCKEAGAIN_TARGET rule */
+static void
+init_accepted_fd(int api, int sockfd, int fd)
+{
+    int                        flags;
+    uint16_t                   gen;
+    socklen_t                  len;
+    fd_state_t                *fs;
+    struct sockaddr_storage    ss;
 
-                if (get_verbose_level()) {
-                    fprintf(stderr, "mockeagain: poll: should suppress write "
-                            "event on fd %d.\n", fd);
-                }
+    flags = get_fd_flags(sockfd) & FD_WEIRD;
 
-                p->revents &= ~POLLOUT;
+    init_fd_state(fd, flags | TARGET_DOWNSTREAM);
 
-                if (p->revents == 0) {
-                    retval--;
-                    continue;
-                }
-            }
+    gen = __atomic_load_n(&targets_generation, __ATOMIC_ACQUIRE);
 
-            active_fds[fd] = p->revents;
-            polled_fds[fd] = 1;
+    if (ntargets && !flags) {
+        fs = get_fd_state(fd);
+        len = sizeof(ss);
 
-            if (get_verbose_level()) {
-                fprintf(stderr, "mockeagain: poll: fd %d polled with events "
-                        "%d\n", fd, p->revents);
-            }
+        if (fs && getsockname(fd, (struct sockaddr *) &ss, &len) == 0) {
+            target_fd(api, fd, fs, TARGET_DOWNSTREAM, (struct sockaddr *) &ss,
+                      len, gen);
         }
+    }
+}
 
-        if (retval == 0) {
-            if (get_verbose_level()) {
-                fprintf(stderr, "mockeagain: poll: emulating timeout on "
-                        "fd %d.\n", fd);
-            }
 
-            if (timeout < 0) {
-                tm.tv_sec = 3600 * 24;
-                tm.tv_usec = 0;
+/* Match the connection on fd in the given role against the rules of
+ * generation gen, and remember the outcome */
+static void
+target_fd(int api, int fd, fd_state_t *fs, int role,
+    const struct sockaddr *sa, socklen_t len, uint16_t gen)
+{
+    int                        port;
+    int                        match;
 
-                if (get_verbose_level()) {
-                    fprintf(stderr, "mockeagain: poll: sleeping 1 day "
-                            "on fd %d.\n", fd);
-                }
+    match = match_target(role, sa, len, &port);
 
-                select(0, NULL, NULL, NULL, &tm);
+    fd_store(fs->targeted, role | (match ? TARGET_MATCHED : 0));
+    fd_store(fs->tgen, gen);
 
-            } else {
+    log_event(LOG_TARGET, api, fd, match, port, role, 0);
+}
 
-                if (elapsed < timeout) {
-                    int     diff;
 
-                    diff = timeout - elapsed;
+/* Whether fd is to be mocked under MOCKEAGAIN_TARGET. The connections are
+ * matched again the first time they are seen after the rules changed, so
+ * that MOCKEAGAIN_CONTROL can target the connections already open; until
+ * a connection in progress has a peer, it keeps its previous outcome. */
+static int
+is_targeted(int api, int fd, fd_state_t *fs)
+{
+    int                        role;
+    uint16_t                   gen;
+    socklen_t                  len;
+    struct sockaddr_storage    ss;
 
-                    tm.tv_sec = diff / 1000;
-                    tm.tv_usec = diff % 1000 * 1000;
+    gen = __atomic_load_n(&targets_generation, __ATOMIC_ACQUIRE);
+    role = fd_load(fs->targeted);
 
-                    if (get_verbose_level()) {
-                        fprintf(stderr, "mockeagain: poll: sleeping %d ms "
-                                "on fd %d.\n", diff, fd);
-                    }
+    if (fd_load(fs->tgen) == gen
+        || !(role & (TARGET_UPSTREAM|TARGET_DOWNSTREAM)))
+    {
+        return (role & TARGET_MATCHED) != 0;
+    }
 
-                    select(0, NULL, NULL, NULL, &tm);
-                }
-            }
-        }
+    role &= TARGET_UPSTREAM|TARGET_DOWNSTREAM;
+    len = sizeof(ss);
+
+    if ((role == TARGET_UPSTREAM
+         ? getpeername(fd, (struct sockaddr *) &ss, &len)
+         : getsockname(fd, (struct sockaddr *) &ss, &len))
+        != 0)
+    {
+        return (fd_load(fs->targeted) & TARGET_MATCHED) != 0;
     }
 
-    return retval;
+    target_fd(api, fd, fs, role, (struct sockaddr *) &ss, len, gen);
+
+    return (fd_load(fs->targeted) & TARGET_MATCHED) != 0;
 }
 
 
-ssize_t
-writev(int fd, const struct iovec *iov, int iovcnt)
+/* A duplicate refers to the same socket as the original fd, but gets
+ * polled and mocked on its own */
+static int
+mock_dup(int oldfd)
 {
-    ssize_t                  retval;
-    static writev_handle     orig_writev = NULL;
-    struct iovec             new_iov[1] = { {NULL, 0} };
-    const struct iovec      *p;
-    int                      i;
-    size_t                   len;
+    int                        fd;
 
+    dd("calling my dup");
 
-    if (is_whitelist()) {
-        call_original("writev", orig_writev, fd, iov, iovcnt);
-        return retval;
+    fd = (*orig.dup)(oldfd);
+
+    if (fd >= 0) {
+        init_fd_state(fd, get_fd_flags(oldfd));
     }
 
-    if ((get_mocking_type() & MOCKING_WRITES)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && !(active_fds[fd] & POLLOUT))
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"writev\" on fd %d to "
-                    "signal EAGAIN.\n", fd);
-        }
+    return fd;
+}
 
-        errno = EAGAIN;
-        return -1;
-    }
 
-    init_libc_handle();
+static int
+mock_dup2(int oldfd, int newfd)
+{
+    int                        fd;
 
-    if (orig_writev == NULL) {
-        orig_writev = dlsym(libc_handle, "writev");
-        if (orig_writev == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying writev: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
-    }
+    dd("calling my dup2");
 
-    if (!(get_mocking_type() & MOCKING_WRITES)) {
-        return (*orig_writev)(fd, iov, iovcnt);
-    }
+    fd = (*orig.dup2)(oldfd, newfd);
 
-    if (fd <= MAX_FD && polled_fds[fd]) {
-        p = iov;
-        for (i = 0; i < iovcnt; i++, p++) {
-            if (p->iov_base == NULL || p->iov_len == 0) {
-                continue;
-            }
+    /* newfd has been closed silently if it was open, unless it is oldfd */
 
-            new_iov[0].iov_base = p->iov_base;
-            new_iov[0].iov_len = 1;
-            break;
+    if (fd >= 0 && fd != oldfd) {
+        if (stats) {
+            flush_fd_stats(fd, "closed");
         }
 
-        len = 0;
-        p = iov;
-        for (i = 0; i < iovcnt; i++, p++) {
-            len += p->iov_len;
-        }
+        init_fd_state(fd, get_fd_flags(oldfd));
     }
 
-    if (new_iov[0].iov_base == NULL) {
-        retval = (*orig_writev)(fd, iov, iovcnt);
+    return fd;
+}
 
-    } else {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"writev\" on fd %d to emit "
-                    "1 of %llu bytes.\n", fd, (unsigned long long) len);
+
+static int
+mock_dup3(int oldfd, int newfd, int flags)
+{
+    int                        fd;
+
+    dd("calling my dup3");
+
+    fd = (*orig.dup3)(oldfd, newfd, flags);
+
+    if (fd >= 0) {
+        if (stats) {
+            flush_fd_stats(fd, "closed");
         }
 
-        if (pattern) {
-            char          *p;
-            size_t         len;
-            char           c;
+        init_fd_state(fd, get_fd_flags(oldfd));
+    }
 
-            c = *(char *) new_iov[0].iov_base;
+    return fd;
+}
 
-            if (matchbufs[fd] == NULL) {
 
-                matchbufs[fd] = malloc(matchbuf_len);
-                if (matchbufs[fd] == NULL) {
-                    fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
-                }
+/* Only the fds connected to a MOCKEAGAIN_TARGET are mocked if there are
+ * any; the fd is tagged before connecting, whatever the outcome, and even
+ * without any rules yet, for MOCKEAGAIN_CONTROL to bring some in later */
+static int
+mock_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    uint16_t                   gen;
+    fd_state_t                *fs;
 
-                p = matchbufs[fd];
-                memset(p, 0, matchbuf_len);
+    dd("calling my connect");
 
-                p[0] = c;
+    fs = alloc_fd_state(sockfd);
 
-                len = 1;
+    if (fs && addr) {
+        gen = __atomic_load_n(&targets_generation, __ATOMIC_ACQUIRE);
 
-            } else {
-                p = matchbufs[fd];
+        if (ntargets) {
+            target_fd(API_CONNECT, sockfd, fs, TARGET_UPSTREAM, addr,
+                      addrlen, gen);
 
-                len = strlen(p);
+        } else {
+            fd_store(fs->targeted, TARGET_UPSTREAM);
+            fd_store(fs->tgen, gen);
+        }
+    }
 
-                if (len < matchbuf_len - 1) {
-                    p[len] = c;
-                    len++;
+    return (*orig.connect)(sockfd, addr, addrlen);
+}
 
-                } else {
-                    memmove(p, p + 1, matchbuf_len - 2);
 
-                    p[matchbuf_len - 2] = c;
-                }
-            }
+/* The clocks that move with the time slept are read with the time warped
+ * so far added, the ones counting CPU time as they are */
+static int
+mock_clock_gettime(clockid_t clk, struct timespec *tp)
+{
+    int                        retval;
+    int64_t                    warp;
 
-            /* test if the pattern matches the matchbuf */
+    retval = (*orig.clock_gettime)(clk, tp);
 
-            dd("matchbuf: %.*s (len: %d)", (int) len, p,
-                    (int) matchbuf_len - 1);
+    warp = __atomic_load_n(&warp_us, __ATOMIC_RELAXED);
 
-            if (len == matchbuf_len - 1 && strncmp(p, pattern, len) == 0) {
-                if (get_verbose_level()) {
-                    fprintf(stderr, "mockeagain: \"writev\" has found a match for "
-                            "the timeout pattern \"%s\" on fd %d.\n", pattern, fd);
-                }
+    if (retval == 0 && warp && tp && is_warped_clock(clk)) {
+        tp->tv_sec += warp / 1000000;
+        tp->tv_nsec += (long) (warp % 1000000) * 1000;
 
-                snd_timeout_fds[fd] = 1;
-            }
+        if (tp->tv_nsec >= 1000000000L) {
+            tp->tv_sec++;
+            tp->tv_nsec -= 1000000000L;
         }
-
-        dd("calling the original writev on fd %d", fd);
-        retval = (*orig_writev)(fd, new_iov, 1);
-        active_fds[fd] &= ~POLLOUT;
     }
 
     return retval;
 }
 
 
-int
-close(int fd)
+static int
+mock_gettimeofday(struct timeval *tv, void *tz)
 {
-    int                     retval;
-    static close_handle     orig_close = NULL;
+    int                        retval;
+    int64_t                    warp;
 
-    if (is_whitelist()) {
-        call_original("close", orig_close, fd);
-        return retval;
-    }
+    retval = (*orig.gettimeofday)(tv, tz);
+
+    warp = __atomic_load_n(&warp_us, __ATOMIC_RELAXED);
 
-    init_libc_handle();
+    if (retval == 0 && warp && tv) {
+        tv->tv_sec += warp / 1000000;
+        tv->tv_usec += (suseconds_t) (warp % 1000000);
 
-    if (orig_close == NULL) {
-        orig_close = dlsym(libc_handle, "close");
-        if (orig_close == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying close: "
-                    "%s\n", dlerror());
-            exit(1);
+        if (tv->tv_usec >= 1000000) {
+            tv->tv_sec++;
+            tv->tv_usec -= 1000000;
         }
     }
 
-    if (fd <= MAX_FD) {
-#if (DDEBUG)
-        if (polled_fds[fd]) {
-            dd("calling the original close on fd %d", fd);
+    return retval;
+}
+
+
+static time_t
+mock_time(time_t *tloc)
+{
+    struct timespec            ts;
+
+    if (mock_clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+        return (time_t) -1;
+    }
+
+    if (tloc) {
+        *tloc = ts.tv_sec;
+    }
+
+    return ts.tv_sec;
+}
+
+
+/* The absolute deadlines are taken off the clocks read with the time
+ * warped, but the kernel waits for them on the real ones */
+static int
+mock_pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+    const struct timespec *abstime)
+{
+    struct timespec            ts;
+
+    return (*orig.pthread_cond_timedwait)(cond, mutex,
+                                          unwarp_deadline(abstime, &ts));
+}
+
+
+static int
+mock_sem_timedwait(sem_t *sem, const struct timespec *abstime)
+{
+    struct timespec            ts;
+
+    return (*orig.sem_timedwait)(sem, unwarp_deadline(abstime, &ts));
+}
+
+
+static int
+mock_clock_nanosleep(clockid_t clk, int flags, const struct timespec *req,
+    struct timespec *rem)
+{
+    struct timespec            ts;
+
+    if ((flags & TIMER_ABSTIME) && is_warped_clock(clk)) {
+        req = unwarp_deadline(req, &ts);
+    }
+
+    return (*orig.clock_nanosleep)(clk, flags, req, rem);
+}
+
+
+/* the clock of a timer fd is not known here, it is taken to be one of
+ * those warped */
+static int
+mock_timerfd_settime(int fd, int flags, const struct itimerspec *new_value,
+    struct itimerspec *old_value)
+{
+    struct timespec            ts;
+    struct itimerspec          its;
+
+    /* a zero it_value disarms the timer, and never moves */
+
+    if ((flags & TFD_TIMER_ABSTIME) && new_value
+        && (new_value->it_value.tv_sec || new_value->it_value.tv_nsec))
+    {
+        its.it_interval = new_value->it_interval;
+        its.it_value = *unwarp_deadline(&new_value->it_value, &ts);
+        new_value = &its;
+    }
+
+    return (*orig.timerfd_settime)(fd, flags, new_value, old_value);
+}
+
+
+/* Move an absolute deadline back by the time warped so far into ts, and
+ * return it, or the deadline itself if there is nothing to move; the
+ * deadlines moved to before the epoch are passed already anyway, and are
+ * kept off zero for timerfd_settime() */
+static const struct timespec *
+unwarp_deadline(const struct timespec *abstime, struct timespec *ts)
+{
+    int64_t                    warp;
+
+    warp = __atomic_load_n(&warp_us, __ATOMIC_RELAXED);
+
+    if (warp == 0 || abstime == NULL
+        || abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L)
+    {
+        return abstime;
+    }
+
+    ts->tv_sec = abstime->tv_sec - warp / 1000000;
+    ts->tv_nsec = abstime->tv_nsec - (long) (warp % 1000000) * 1000;
+
+    if (ts->tv_nsec < 0) {
+        ts->tv_sec--;
+        ts->tv_nsec += 1000000000L;
+    }
+
+    if (ts->tv_sec < 0) {
+        ts->tv_sec = 0;
+        ts->tv_nsec = 1;
+    }
+
+    return ts;
+}
+
+
+static int
+is_warped_clock(clockid_t clk)
+{
+    switch (clk) {
+
+    case CLOCK_REALTIME:
+    case CLOCK_MONOTONIC:
+#ifdef CLOCK_MONOTONIC_RAW
+    case CLOCK_MONOTONIC_RAW:
+#endif
+#ifdef CLOCK_REALTIME_COARSE
+    case CLOCK_REALTIME_COARSE:
+#endif
+#ifdef CLOCK_MONOTONIC_COARSE
+    case CLOCK_MONOTONIC_COARSE:
+#endif
+#ifdef CLOCK_BOOTTIME
+    case CLOCK_BOOTTIME:
+#endif
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static int
+mock_fcntl(int fd, int cmd, ...)
+{
+    int                        retval;
+    void                      *arg;
+    va_list                    args;
+
+    /* every argument of fcntl() fits in a pointer, the way glibc passes
+     * them on too */
+
+    va_start(args, cmd);
+    arg = va_arg(args, void *);
+    va_end(args);
+
+    retval = (*orig.fcntl)(fd, cmd, arg);
+
+    if (retval >= 0 && (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)) {
+        dd("fcntl duplicated fd %d as %d", fd, retval);
+        init_fd_state(retval, get_fd_flags(fd));
+    }
+
+    return retval;
+}
+
+
+static int
+mock_poll(struct pollfd *ufds, nfds_t nfds, int timeout)
+{
+    int                      retval;
+    wait_ctx_t               wc;
+
+    dd("calling my poll");
+
+    init_wait_ctx(&wc, API_POLL, timeout, NULL);
+
+    for ( ;; ) {
+        dd("calling the original poll");
+
+        retval = (*orig.poll)(ufds, nfds, timeout);
+
+        if (retval <= 0) {
+            return retval;
+        }
+
+        retval = filter_pollfds(&wc, ufds, nfds, retval);
+
+        if (retval > 0) {
+            return retval;
+        }
+
+        retval = wait_again(&wc);
+
+        if (retval <= 0) {
+            return retval;
+        }
+
+        timeout = get_remaining_ms(&wc);
+    }
+}
+
+
+static int
+mock_ppoll(struct pollfd *ufds, nfds_t nfds,
+    const struct timespec *timeout, const sigset_t *sigmask)
+{
+    int                      retval;
+    int                      ms = -1;
+    struct timespec          ts;
+    wait_ctx_t               wc;
+
+    dd("calling my ppoll");
+
+    if (timeout) {
+        ms = get_timeout_ms(timeout->tv_sec,
+                            (timeout->tv_nsec + 999999) / 1000000);
+    }
+
+    init_wait_ctx(&wc, API_PPOLL, ms, sigmask);
+
+    for ( ;; ) {
+        retval = (*orig.ppoll)(ufds, nfds, timeout, sigmask);
+
+        if (retval <= 0) {
+            return retval;
+        }
+
+        retval = filter_pollfds(&wc, ufds, nfds, retval);
+
+        if (retval > 0) {
+            return retval;
+        }
+
+        retval = wait_again(&wc);
+
+        if (retval <= 0) {
+            return retval;
+        }
+
+        if (timeout) {
+            ms = get_remaining_ms(&wc);
+
+            ts.tv_sec = ms / 1000;
+            ts.tv_nsec = (long) (ms % 1000) * 1000000;
+            timeout = &ts;
+        }
+    }
+}
+
+
+static int
+mock_select(int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, struct timeval *timeout)
+{
+    int                      retval;
+    int                      ms = -1;
+    fd_set                   saved[3];
+    wait_ctx_t               wc;
+
+    dd("calling my select");
+
+    if (timeout) {
+        ms = get_timeout_ms(timeout->tv_sec, (timeout->tv_usec + 999) / 1000);
+    }
+
+    init_wait_ctx(&wc, API_SELECT, ms, NULL);
+
+    /* the fds asked for that are not ready get polled too, and we may
+     * have to wait again with the same sets */
+
+    save_fdsets(saved, readfds, writefds, exceptfds);
+
+    for ( ;; ) {
+        retval = (*orig.select)(nfds, readfds, writefds, exceptfds, timeout);
+
+        if (retval <= 0) {
+            return retval;
+        }
+
+        retval = filter_fdsets(&wc, nfds, saved, readfds, writefds,
+                               exceptfds);
+
+        if (retval > 0) {
+            return retval;
+        }
+
+        retval = wait_again(&wc);
+
+        if (retval <= 0) {
+            return retval;
+        }
+
+        restore_fdsets(saved, readfds, writefds, exceptfds);
+
+        if (timeout) {
+            ms = get_remaining_ms(&wc);
+
+            timeout->tv_sec = ms / 1000;
+            timeout->tv_usec = (long) (ms % 1000) * 1000;
+        }
+    }
+}
+
+
+static int
+mock_pselect(int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, const struct timespec *timeout,
+    const sigset_t *sigmask)
+{
+    int                      retval;
+    int                      ms = -1;
+    fd_set                   saved[3];
+    struct timespec          ts;
+    wait_ctx_t               wc;
+
+    dd("calling my pselect");
+
+    if (timeout) {
+        ms = get_timeout_ms(timeout->tv_sec,
+                            (timeout->tv_nsec + 999999) / 1000000);
+    }
+
+    init_wait_ctx(&wc, API_PSELECT, ms, sigmask);
+
+    save_fdsets(saved, readfds, writefds, exceptfds);
+
+    for ( ;; ) {
+        retval = (*orig.pselect)(nfds, readfds, writefds, exceptfds, timeout,
+                                 sigmask);
+
+        if (retval <= 0) {
+            return retval;
+        }
+
+        retval = filter_fdsets(&wc, nfds, saved, readfds, writefds,
+                               exceptfds);
+
+        if (retval > 0) {
+            return retval;
+        }
+
+        retval = wait_again(&wc);
+
+        if (retval <= 0) {
+            return retval;
+        }
+
+        restore_fdsets(saved, readfds, writefds, exceptfds);
+
+        if (timeout) {
+            ms = get_remaining_ms(&wc);
+
+            ts.tv_sec = ms / 1000;
+            ts.tv_nsec = (long) (ms % 1000) * 1000000;
+            timeout = &ts;
+        }
+    }
+}
+
+
+static ssize_t
+mock_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t                  retval;
+    struct iovec             new_iov[MAX_CLAMPED_IOV];
+    const struct iovec      *p;
+    int                      i;
+    int                      n = 0;
+    size_t                   len;
+    size_t                   budget;
+    fd_state_t              *fs;
+
+    if (is_whitelist()) {
+        call_original(API_WRITEV, orig.writev, fd, iov, iovcnt);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLOUT))
+    {
+        return fake_eagain(API_WRITEV, fd, fs, MOCKING_WRITES);
+    }
+
+    if (!(mocking_type & MOCKING_WRITES)) {
+        return (*orig.writev)(fd, iov, iovcnt);
+    }
+
+    if (fs && fd_load(fs->polled)) {
+        len = 0;
+        p = iov;
+        for (i = 0; i < iovcnt; i++, p++) {
+            len += p->iov_len;
+        }
+
+        if (len) {
+            budget = get_io_budget(API_WRITEV, fd, fs, MOCKING_WRITES, len);
+            if (budget == 0) {
+                return fake_eagain(API_WRITEV, fd, fs, MOCKING_WRITES);
+            }
+
+            n = clamp_iov(iov, iovcnt, budget, new_iov, MAX_CLAMPED_IOV);
+        }
+    }
+
+    if (n == 0) {
+        retval = (*orig.writev)(fd, iov, iovcnt);
+
+        if (scans_data(write_matcher) && fs && retval > 0) {
+            scan_data(API_WRITEV, fd, fs, MOCKING_WRITES, iov, iovcnt,
+                      (size_t) retval);
+        }
+
+    } else {
+        log_event(LOG_WRITE, API_WRITEV, fd, budget, len, 0, 0);
+
+        dd("calling the original writev on fd %d", fd);
+        retval = (*orig.writev)(fd, new_iov, n);
+
+        if (scans_data(write_matcher) && retval > 0) {
+            scan_data(API_WRITEV, fd, fs, MOCKING_WRITES, new_iov, n,
+                      (size_t) retval);
+        }
+
+        consume_io_budget(API_WRITEV, fd, fs, MOCKING_WRITES, len, retval);
+    }
+
+    return retval;
+}
+
+
+static int
+mock_close(int fd)
+{
+    int                     retval;
+    fd_state_t             *fs;
+
+    if (is_whitelist()) {
+        call_original(API_CLOSE, orig.close, fd);
+        return retval;
+    }
+
+    if (stats) {
+        flush_fd_stats(fd, "closed");
+    }
+
+    fs = get_fd_state(fd);
+    if (fs) {
+#if (DDEBUG)
+        if (fs->polled) {
+            dd("calling the original close on fd %d", fd);
+        }
+#endif
+
+        reset_fd_state(fs);
+    }
+
+    reset_frames(fd);
+    reset_splits(fd);
+    reset_epolls(fd);
+
+    retval = (*orig.close)(fd);
+
+    return retval;
+}
+
+
+static ssize_t
+mock_send(int fd, const void *buf, size_t len, int flags)
+{
+    ssize_t                  retval;
+    size_t                   budget;
+    struct iovec             iov;
+    fd_state_t              *fs;
+
+    dd("calling my send");
+
+    if (is_whitelist()) {
+        call_original(API_SEND, orig.send, fd, buf, len, flags);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLOUT))
+    {
+        return fake_eagain(API_SEND, fd, fs, MOCKING_WRITES);
+    }
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && len)
+    {
+        budget = get_io_budget(API_SEND, fd, fs, MOCKING_WRITES, len);
+        if (budget == 0) {
+            return fake_eagain(API_SEND, fd, fs, MOCKING_WRITES);
+        }
+
+        log_event(LOG_WRITE, API_SEND, fd, budget, len, 0, 0);
+
+        retval = (*orig.send)(fd, buf, budget, flags);
+        consume_io_budget(API_SEND, fd, fs, MOCKING_WRITES, len, retval);
+
+    } else {
+
+        dd("calling the original send on fd %d", fd);
+
+        retval = (*orig.send)(fd, buf, len, flags);
+    }
+
+    if (scans_data(write_matcher) && fs && retval > 0) {
+        iov.iov_base = (void *) buf;
+        iov.iov_len = (size_t) retval;
+
+        scan_data(API_SEND, fd, fs, MOCKING_WRITES, &iov, 1,
+                  (size_t) retval);
+    }
+
+    return retval;
+}
+
+
+static ssize_t
+mock_write(int fd, const void *buf, size_t len)
+{
+    ssize_t                  retval;
+    size_t                   budget;
+    struct iovec             iov;
+    fd_state_t              *fs;
+
+    dd("calling my write");
+
+    if (is_whitelist()) {
+        call_original(API_WRITE, orig.write, fd, buf, len);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLOUT))
+    {
+        return fake_eagain(API_WRITE, fd, fs, MOCKING_WRITES);
+    }
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && len)
+    {
+        budget = get_io_budget(API_WRITE, fd, fs, MOCKING_WRITES, len);
+        if (budget == 0) {
+            return fake_eagain(API_WRITE, fd, fs, MOCKING_WRITES);
+        }
+
+        log_event(LOG_WRITE, API_WRITE, fd, budget, len, 0, 0);
+
+        retval = (*orig.write)(fd, buf, budget);
+        consume_io_budget(API_WRITE, fd, fs, MOCKING_WRITES, len, retval);
+
+    } else {
+
+        dd("calling the original write on fd %d", fd);
+
+        retval = (*orig.write)(fd, buf, len);
+    }
+
+    if (scans_data(write_matcher) && fs && retval > 0) {
+        iov.iov_base = (void *) buf;
+        iov.iov_len = (size_t) retval;
+
+        scan_data(API_WRITE, fd, fs, MOCKING_WRITES, &iov, 1,
+                  (size_t) retval);
+    }
+
+    return retval;
+}
+
+
+static ssize_t
+mock_sendto(int fd, const void *buf, size_t len, int flags,
+    const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    ssize_t                  retval;
+    size_t                   budget;
+    struct iovec             iov;
+    fd_state_t              *fs;
+
+    dd("calling my sendto");
+
+    if (is_whitelist()) {
+        call_original(API_SENDTO, orig.sendto, fd, buf, len, flags, dest_addr,
+                      addrlen);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLOUT))
+    {
+        return fake_eagain(API_SENDTO, fd, fs, MOCKING_WRITES);
+    }
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && len)
+    {
+        budget = get_io_budget(API_SENDTO, fd, fs, MOCKING_WRITES, len);
+        if (budget == 0) {
+            return fake_eagain(API_SENDTO, fd, fs, MOCKING_WRITES);
+        }
+
+        log_event(LOG_WRITE, API_SENDTO, fd, budget, len, 0, 0);
+
+        retval = (*orig.sendto)(fd, buf, budget, flags, dest_addr, addrlen);
+        consume_io_budget(API_SENDTO, fd, fs, MOCKING_WRITES, len, retval);
+
+    } else {
+
+        dd("calling the original sendto on fd %d", fd);
+
+        retval = (*orig.sendto)(fd, buf, len, flags, dest_addr, addrlen);
+    }
+
+    if (scans_data(write_matcher) && fs && retval > 0) {
+        iov.iov_base = (void *) buf;
+        iov.iov_len = (size_t) retval;
+
+        scan_data(API_SENDTO, fd, fs, MOCKING_WRITES, &iov, 1,
+                  (size_t) retval);
+    }
+
+    return retval;
+}
+
+
+static ssize_t
+mock_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    ssize_t                  retval;
+    struct iovec             new_iov[MAX_CLAMPED_IOV];
+    struct msghdr            new_msg;
+    int                      n = 0;
+    size_t                   len;
+    size_t                   budget;
+    fd_state_t              *fs;
+
+    dd("calling my sendmsg");
+
+    if (is_whitelist()) {
+        call_original(API_SENDMSG, orig.sendmsg, fd, msg, flags);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLOUT))
+    {
+        return fake_eagain(API_SENDMSG, fd, fs, MOCKING_WRITES);
+    }
+
+    if (!(mocking_type & MOCKING_WRITES)) {
+        return (*orig.sendmsg)(fd, msg, flags);
+    }
+
+    if (fs && fd_load(fs->polled)) {
+        len = get_iov_len(msg->msg_iov, (int) msg->msg_iovlen);
+
+        if (len) {
+            budget = get_io_budget(API_SENDMSG, fd, fs, MOCKING_WRITES,
+                                   len);
+            if (budget == 0) {
+                return fake_eagain(API_SENDMSG, fd, fs, MOCKING_WRITES);
+            }
+
+            n = clamp_iov(msg->msg_iov, (int) msg->msg_iovlen, budget,
+                          new_iov, MAX_CLAMPED_IOV);
+        }
+    }
+
+    if (n == 0) {
+        retval = (*orig.sendmsg)(fd, msg, flags);
+
+        if (scans_data(write_matcher) && fs && retval > 0) {
+            scan_data(API_SENDMSG, fd, fs, MOCKING_WRITES, msg->msg_iov,
+                      (int) msg->msg_iovlen, (size_t) retval);
+        }
+
+    } else {
+        log_event(LOG_WRITE, API_SENDMSG, fd, budget, len, 0, 0);
+
+        /* the ancillary data goes out with the first byte, like it would
+         * with a short write */
+
+        new_msg = *msg;
+        new_msg.msg_iov = new_iov;
+        new_msg.msg_iovlen = n;
+
+        dd("calling the original sendmsg on fd %d", fd);
+        retval = (*orig.sendmsg)(fd, &new_msg, flags);
+
+        if (scans_data(write_matcher) && retval > 0) {
+            scan_data(API_SENDMSG, fd, fs, MOCKING_WRITES, new_iov, n,
+                      (size_t) retval);
+        }
+
+        consume_io_budget(API_SENDMSG, fd, fs, MOCKING_WRITES, len, retval);
+    }
+
+    return retval;
+}
+
+
+static int
+mock_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+    int flags)
+{
+    int                      retval;
+    struct iovec             new_iov[MAX_CLAMPED_IOV];
+    struct mmsghdr           first;
+    unsigned int             i;
+    unsigned int             n;
+    size_t                   len;
+    size_t                   budget;
+    size_t                   sent;
+    fd_state_t              *fs;
+
+    dd("calling my sendmmsg");
+
+    if (is_whitelist()) {
+        call_original(API_SENDMMSG, orig.sendmmsg, fd, msgvec, vlen, flags);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLOUT))
+    {
+        return fake_eagain(API_SENDMMSG, fd, fs, MOCKING_WRITES);
+    }
+
+    if (!(mocking_type & MOCKING_WRITES)) {
+        return (*orig.sendmmsg)(fd, msgvec, vlen, flags);
+    }
+
+    if (fs == NULL || !fd_load(fs->polled) || vlen == 0) {
+        retval = (*orig.sendmmsg)(fd, msgvec, vlen, flags);
+
+        if (scans_data(write_matcher) && fs && retval > 0) {
+            (void) match_mmsg(API_SENDMMSG, fd, fs, MOCKING_WRITES, msgvec,
+                              retval);
+        }
+
+        return retval;
+    }
+
+    len = 0;
+    for (i = 0; i < vlen; i++) {
+        len += get_iov_len(msgvec[i].msg_hdr.msg_iov,
+                           (int) msgvec[i].msg_hdr.msg_iovlen);
+    }
+
+    budget = len;
+
+    if (len) {
+        budget = get_io_budget(API_SENDMMSG, fd, fs, MOCKING_WRITES, len);
+        if (budget == 0) {
+            return fake_eagain(API_SENDMMSG, fd, fs, MOCKING_WRITES);
+        }
+    }
+
+    n = clamp_mmsg(msgvec, vlen, budget, &first, new_iov, MAX_CLAMPED_IOV);
+
+    log_event(LOG_WRITE, API_SENDMMSG, fd, budget, len, n ? n : 1, vlen);
+
+    dd("calling the original sendmmsg on fd %d", fd);
+
+    if (n == 0) {
+        retval = (*orig.sendmmsg)(fd, &first, 1, flags);
+
+        if (retval > 0) {
+            msgvec[0].msg_len = first.msg_len;
+        }
+
+    } else {
+        retval = (*orig.sendmmsg)(fd, msgvec, n, flags);
+    }
+
+    if (retval <= 0) {
+        consume_io_budget(API_SENDMMSG, fd, fs, MOCKING_WRITES, len, retval);
+        return retval;
+    }
+
+    sent = match_mmsg(API_SENDMMSG, fd, fs, MOCKING_WRITES, msgvec, retval);
+
+    consume_io_budget(API_SENDMMSG, fd, fs, MOCKING_WRITES, len,
+                      (ssize_t) sent);
+
+    return retval;
+}
+
+
+static ssize_t
+mock_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    ssize_t                  retval;
+    size_t                   budget;
+    fd_state_t              *fs;
+
+    dd("calling my sendfile");
+
+    if (is_whitelist()) {
+        call_original(API_SENDFILE, orig.sendfile, out_fd, in_fd, offset,
+                      count);
+        return retval;
+    }
+
+    fs = get_fd_state(out_fd);
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLOUT))
+    {
+        return fake_eagain(API_SENDFILE, out_fd, fs, MOCKING_WRITES);
+    }
+
+    /* the kernel advances the offset by what it actually sent, so a
+     * clamped count is all it takes to emulate a short write */
+
+    if ((mocking_type & MOCKING_WRITES)
+        && fs
+        && fd_load(fs->polled)
+        && count)
+    {
+        budget = get_io_budget(API_SENDFILE, out_fd, fs, MOCKING_WRITES,
+                               count);
+        if (budget == 0) {
+            return fake_eagain(API_SENDFILE, out_fd, fs, MOCKING_WRITES);
+        }
+
+        log_event(LOG_WRITE, API_SENDFILE, out_fd, budget, count, 0, 0);
+
+        retval = (*orig.sendfile)(out_fd, in_fd, offset, budget);
+        consume_io_budget(API_SENDFILE, out_fd, fs, MOCKING_WRITES, count,
+                          retval);
+
+    } else {
+
+        dd("calling the original sendfile on fd %d", out_fd);
+
+        retval = (*orig.sendfile)(out_fd, in_fd, offset, count);
+    }
+
+    if (scans_data(write_matcher) && fs && retval > 0) {
+        scan_data(API_SENDFILE, out_fd, fs, MOCKING_WRITES, NULL, 0,
+                  (size_t) retval);
+    }
+
+    return retval;
+}
+
+
+static ssize_t
+mock_splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+    size_t len, unsigned int flags)
+{
+    ssize_t                  retval;
+    size_t                   budget;
+    int                      mocking;
+    fd_state_t              *in;
+    fd_state_t              *out;
+
+    dd("calling my splice");
+
+    if (is_whitelist()) {
+        call_original(API_SPLICE, orig.splice, fd_in, off_in, fd_out, off_out,
+                      len, flags);
+        return retval;
+    }
+
+    mocking = mocking_type;
+
+    /* either end may be a mocked socket, the other one being a pipe */
+
+    in = get_fd_state(fd_in);
+    out = get_fd_state(fd_out);
+
+    if (in && fd_load(in->rcv_fault) && read_faulted(API_SPLICE, fd_in, in)) {
+        return -1;
+    }
+
+    if ((mocking & MOCKING_READS) && in && fd_load(in->polled)) {
+        if (!(fd_load(in->active) & POLLIN)) {
+            return fake_eagain(API_SPLICE, fd_in, in, MOCKING_READS);
+        }
+
+    } else {
+        in = NULL;
+    }
+
+    if ((mocking & MOCKING_WRITES) && out && fd_load(out->polled)) {
+        if (!(fd_load(out->active) & POLLOUT)) {
+            return fake_eagain(API_SPLICE, fd_out, out, MOCKING_WRITES);
+        }
+
+    } else {
+        out = NULL;
+    }
+
+    budget = len;
+
+    if (in && budget) {
+        budget = get_io_budget(API_SPLICE, fd_in, in, MOCKING_READS,
+                               budget);
+        if (budget == 0) {
+            return fake_eagain(API_SPLICE, fd_in, in, MOCKING_READS);
+        }
+    }
+
+    if (out && budget) {
+        budget = get_io_budget(API_SPLICE, fd_out, out, MOCKING_WRITES,
+                               budget);
+        if (budget == 0) {
+            return fake_eagain(API_SPLICE, fd_out, out, MOCKING_WRITES);
+        }
+    }
+
+    if (budget < len) {
+        log_event(LOG_SPLICE, API_SPLICE, fd_in, budget, len, fd_out, 0);
+    }
+
+    dd("calling the original splice from fd %d to fd %d", fd_in, fd_out);
+
+    retval = (*orig.splice)(fd_in, off_in, fd_out, off_out, budget, flags);
+
+    if (in) {
+        consume_io_budget(API_SPLICE, fd_in, in, MOCKING_READS, len, retval);
+    }
+
+    if (out) {
+        consume_io_budget(API_SPLICE, fd_out, out, MOCKING_WRITES, len,
+                          retval);
+    }
+
+    /* the bytes moved count for both ends, whether mocked or not */
+
+    if (retval > 0) {
+        in = get_fd_state(fd_in);
+        out = get_fd_state(fd_out);
+
+        if (scans_data(read_matcher) && in) {
+            scan_data(API_SPLICE, fd_in, in, MOCKING_READS, NULL, 0,
+                      (size_t) retval);
+        }
+
+        if (scans_data(write_matcher) && out) {
+            scan_data(API_SPLICE, fd_out, out, MOCKING_WRITES, NULL, 0,
+                      (size_t) retval);
+        }
+    }
+
+    return retval;
+}
+
+
+static ssize_t
+mock_read(int fd, void *buf, size_t len)
+{
+    ssize_t                  retval;
+    size_t                   budget;
+    struct iovec             iov;
+    fd_state_t              *fs;
+
+    dd("calling my read");
+
+    if (is_whitelist()) {
+        call_original(API_READ, orig.read, fd, buf, len);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if (fs && fd_load(fs->rcv_fault) && read_faulted(API_READ, fd, fs)) {
+        return -1;
+    }
+
+    if ((mocking_type & MOCKING_READS)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLIN))
+    {
+        return fake_eagain(API_READ, fd, fs, MOCKING_READS);
+    }
+
+    if ((mocking_type & MOCKING_READS)
+        && fs
+        && fd_load(fs->polled)
+        && len)
+    {
+        budget = get_io_budget(API_READ, fd, fs, MOCKING_READS, len);
+        if (budget == 0) {
+            return fake_eagain(API_READ, fd, fs, MOCKING_READS);
+        }
+
+        log_event(LOG_READ, API_READ, fd, budget, len, 0, 0);
+
+        dd("calling the original read on fd %d", fd);
+
+        retval = (*orig.read)(fd, buf, budget);
+        consume_io_budget(API_READ, fd, fs, MOCKING_READS, len, retval);
+
+    } else {
+        retval = (*orig.read)(fd, buf, len);
+    }
+
+    if (scans_data(read_matcher) && fs && retval > 0) {
+        iov.iov_base = buf;
+        iov.iov_len = (size_t) retval;
+
+        scan_data(API_READ, fd, fs, MOCKING_READS, &iov, 1,
+                  (size_t) retval);
+    }
+
+    return retval;
+}
+
+
+static ssize_t
+mock_recv(int fd, void *buf, size_t len, int flags)
+{
+    ssize_t                  retval;
+    size_t                   budget;
+    struct iovec             iov;
+    fd_state_t              *fs;
+
+    dd("calling my recv");
+
+    if (is_whitelist()) {
+        call_original(API_RECV, orig.recv, fd, buf, len, flags);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if (fs && fd_load(fs->rcv_fault) && read_faulted(API_RECV, fd, fs)) {
+        return -1;
+    }
+
+    if ((mocking_type & MOCKING_READS)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLIN))
+    {
+        return fake_eagain(API_RECV, fd, fs, MOCKING_READS);
+    }
+
+    if ((mocking_type & MOCKING_READS)
+        && fs
+        && fd_load(fs->polled)
+        && len)
+    {
+        budget = get_io_budget(API_RECV, fd, fs, MOCKING_READS, len);
+        if (budget == 0) {
+            return fake_eagain(API_RECV, fd, fs, MOCKING_READS);
+        }
+
+        log_event(LOG_READ, API_RECV, fd, budget, len, 0, 0);
+
+        dd("calling the original recv on fd %d", fd);
+
+        retval = (*orig.recv)(fd, buf, budget, flags);
+        consume_io_budget(API_RECV, fd, fs, MOCKING_READS, len, retval);
+
+    } else {
+        retval = (*orig.recv)(fd, buf, len, flags);
+    }
+
+    if (scans_data(read_matcher) && fs && retval > 0) {
+        iov.iov_base = buf;
+        iov.iov_len = (size_t) retval;
+
+        scan_data(API_RECV, fd, fs, MOCKING_READS, &iov, 1,
+                  (size_t) retval);
+    }
+
+    return retval;
+}
+
+
+static ssize_t
+mock_recvfrom(int fd, void *buf, size_t len, int flags,
+    struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    ssize_t                  retval;
+    size_t                   budget;
+    struct iovec             iov;
+    fd_state_t              *fs;
+
+    dd("calling my recvfrom");
+
+    if (is_whitelist()) {
+        call_original(API_RECVFROM, orig.recvfrom,
+                      fd, buf, len, flags, src_addr, addrlen);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if (fs && fd_load(fs->rcv_fault) && read_faulted(API_RECVFROM, fd, fs)) {
+        return -1;
+    }
+
+    if ((mocking_type & MOCKING_READS)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLIN))
+    {
+        return fake_eagain(API_RECVFROM, fd, fs, MOCKING_READS);
+    }
+
+    if ((mocking_type & MOCKING_READS)
+        && fs
+        && fd_load(fs->polled)
+        && len)
+    {
+        budget = get_io_budget(API_RECVFROM, fd, fs, MOCKING_READS, len);
+        if (budget == 0) {
+            return fake_eagain(API_RECVFROM, fd, fs, MOCKING_READS);
+        }
+
+        log_event(LOG_READ, API_RECVFROM, fd, budget, len, 0, 0);
+
+        dd("calling the original recvfrom on fd %d", fd);
+
+        retval = (*orig.recvfrom)(fd, buf, budget, flags, src_addr, addrlen);
+        consume_io_budget(API_RECVFROM, fd, fs, MOCKING_READS, len, retval);
+
+    } else {
+        retval = (*orig.recvfrom)(fd, buf, len, flags, src_addr, addrlen);
+    }
+
+    if (scans_data(read_matcher) && fs && retval > 0) {
+        iov.iov_base = buf;
+        iov.iov_len = (size_t) retval;
+
+        scan_data(API_RECVFROM, fd, fs, MOCKING_READS, &iov, 1,
+                  (size_t) retval);
+    }
+
+    return retval;
+}
+
+
+static ssize_t
+mock_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t                  retval;
+    struct iovec             new_iov[MAX_CLAMPED_IOV];
+    int                      n = 0;
+    size_t                   len;
+    size_t                   budget;
+    fd_state_t              *fs;
+
+    dd("calling my readv");
+
+    if (is_whitelist()) {
+        call_original(API_READV, orig.readv, fd, iov, iovcnt);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if (fs && fd_load(fs->rcv_fault) && read_faulted(API_READV, fd, fs)) {
+        return -1;
+    }
+
+    if ((mocking_type & MOCKING_READS)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLIN))
+    {
+        return fake_eagain(API_READV, fd, fs, MOCKING_READS);
+    }
+
+    if ((mocking_type & MOCKING_READS) && fs && fd_load(fs->polled)) {
+        len = get_iov_len(iov, iovcnt);
+
+        if (len) {
+            budget = get_io_budget(API_READV, fd, fs, MOCKING_READS, len);
+            if (budget == 0) {
+                return fake_eagain(API_READV, fd, fs, MOCKING_READS);
+            }
+
+            n = clamp_iov(iov, iovcnt, budget, new_iov, MAX_CLAMPED_IOV);
+        }
+    }
+
+    if (n == 0) {
+        retval = (*orig.readv)(fd, iov, iovcnt);
+
+    } else {
+        log_event(LOG_READ, API_READV, fd, budget, len, 0, 0);
+
+        dd("calling the original readv on fd %d", fd);
+
+        retval = (*orig.readv)(fd, new_iov, n);
+        consume_io_budget(API_READV, fd, fs, MOCKING_READS, len, retval);
+    }
+
+    if (scans_data(read_matcher) && fs && retval > 0) {
+        scan_data(API_READV, fd, fs, MOCKING_READS, iov, iovcnt,
+                  (size_t) retval);
+    }
+
+    return retval;
+}
+
+
+static ssize_t
+mock_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    ssize_t                  retval;
+    struct iovec             new_iov[MAX_CLAMPED_IOV];
+    struct msghdr            new_msg;
+    int                      n = 0;
+    size_t                   len;
+    size_t                   budget;
+    fd_state_t              *fs;
+
+    dd("calling my recvmsg");
+
+    if (is_whitelist()) {
+        call_original(API_RECVMSG, orig.recvmsg, fd, msg, flags);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if (fs && fd_load(fs->rcv_fault) && read_faulted(API_RECVMSG, fd, fs)) {
+        return -1;
+    }
+
+    if ((mocking_type & MOCKING_READS)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLIN))
+    {
+        return fake_eagain(API_RECVMSG, fd, fs, MOCKING_READS);
+    }
+
+    if ((mocking_type & MOCKING_READS) && fs && fd_load(fs->polled)) {
+        len = get_iov_len(msg->msg_iov, (int) msg->msg_iovlen);
+
+        if (len) {
+            budget = get_io_budget(API_RECVMSG, fd, fs, MOCKING_READS,
+                                   len);
+            if (budget == 0) {
+                return fake_eagain(API_RECVMSG, fd, fs, MOCKING_READS);
+            }
+
+            n = clamp_iov(msg->msg_iov, (int) msg->msg_iovlen, budget,
+                          new_iov, MAX_CLAMPED_IOV);
+        }
+    }
+
+    if (n == 0) {
+        retval = (*orig.recvmsg)(fd, msg, flags);
+
+    } else {
+        log_event(LOG_READ, API_RECVMSG, fd, budget, len, 0, 0);
+
+        new_msg = *msg;
+        new_msg.msg_iov = new_iov;
+        new_msg.msg_iovlen = n;
+
+        dd("calling the original recvmsg on fd %d", fd);
+
+        retval = (*orig.recvmsg)(fd, &new_msg, flags);
+
+        msg->msg_namelen = new_msg.msg_namelen;
+        msg->msg_controllen = new_msg.msg_controllen;
+        msg->msg_flags = new_msg.msg_flags;
+
+        consume_io_budget(API_RECVMSG, fd, fs, MOCKING_READS, len, retval);
+    }
+
+    if (scans_data(read_matcher) && fs && retval > 0) {
+        scan_data(API_RECVMSG, fd, fs, MOCKING_READS, msg->msg_iov,
+                  (int) msg->msg_iovlen, (size_t) retval);
+    }
+
+    return retval;
+}
+
+
+static int
+mock_recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+    int flags, struct timespec *timeout)
+{
+    int                      retval;
+    struct iovec             new_iov[MAX_CLAMPED_IOV];
+    struct mmsghdr           first;
+    struct msghdr           *msg;
+    unsigned int             i;
+    unsigned int             n;
+    size_t                   len;
+    size_t                   budget;
+    size_t                   received;
+    fd_state_t              *fs;
+
+    dd("calling my recvmmsg");
+
+    if (is_whitelist()) {
+        call_original(API_RECVMMSG, orig.recvmmsg, fd, msgvec, vlen, flags,
+                      timeout);
+        return retval;
+    }
+
+    fs = get_fd_state(fd);
+
+    if (fs && fd_load(fs->rcv_fault) && read_faulted(API_RECVMMSG, fd, fs)) {
+        return -1;
+    }
+
+    if ((mocking_type & MOCKING_READS)
+        && fs
+        && fd_load(fs->polled)
+        && !(fd_load(fs->active) & POLLIN))
+    {
+        return fake_eagain(API_RECVMMSG, fd, fs, MOCKING_READS);
+    }
+
+    if (!(mocking_type & MOCKING_READS)
+        || fs == NULL
+        || !fd_load(fs->polled)
+        || vlen == 0)
+    {
+        retval = (*orig.recvmmsg)(fd, msgvec, vlen, flags, timeout);
+
+        if (scans_data(read_matcher) && fs && retval > 0) {
+            (void) match_mmsg(API_RECVMMSG, fd, fs, MOCKING_READS, msgvec,
+                              retval);
+        }
+
+        return retval;
+    }
+
+    len = 0;
+    for (i = 0; i < vlen; i++) {
+        len += get_iov_len(msgvec[i].msg_hdr.msg_iov,
+                           (int) msgvec[i].msg_hdr.msg_iovlen);
+    }
+
+    budget = len;
+
+    if (len) {
+        budget = get_io_budget(API_RECVMMSG, fd, fs, MOCKING_READS, len);
+        if (budget == 0) {
+            return fake_eagain(API_RECVMMSG, fd, fs, MOCKING_READS);
+        }
+    }
+
+    n = clamp_mmsg(msgvec, vlen, budget, &first, new_iov, MAX_CLAMPED_IOV);
+
+    log_event(LOG_READ, API_RECVMMSG, fd, budget, len, n ? n : 1, vlen);
+
+    dd("calling the original recvmmsg on fd %d", fd);
+
+    if (n == 0) {
+        retval = (*orig.recvmmsg)(fd, &first, 1, flags, timeout);
+
+        if (retval > 0) {
+            msg = &msgvec[0].msg_hdr;
+
+            msg->msg_namelen = first.msg_hdr.msg_namelen;
+            msg->msg_controllen = first.msg_hdr.msg_controllen;
+            msg->msg_flags = first.msg_hdr.msg_flags;
+            msgvec[0].msg_len = first.msg_len;
+        }
+
+    } else {
+        retval = (*orig.recvmmsg)(fd, msgvec, n, flags, timeout);
+    }
+
+    if (retval <= 0) {
+        consume_io_budget(API_RECVMMSG, fd, fs, MOCKING_READS, len, retval);
+        return retval;
+    }
+
+    received = match_mmsg(API_RECVMMSG, fd, fs, MOCKING_READS, msgvec, retval);
+
+    consume_io_budget(API_RECVMMSG, fd, fs, MOCKING_READS, len,
+                      (ssize_t) received);
+
+    return retval;
+}
+
+
+static int
+mock_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    int                      retval;
+    fd_state_t              *fs;
+    epoll_reg_t             *reg;
+    epoll_reg_t              old;
+    struct epoll_event       ev;
+
+    dd("calling my epoll_ctl");
+
+    if (op == EPOLL_CTL_DEL || event == NULL) {
+        retval = (*orig.epoll_ctl)(epfd, op, fd, event);
+
+        if (retval == 0 && op == EPOLL_CTL_DEL) {
+            fs = get_fd_state(fd);
+            if (fs) {
+                set_fd_epoll(fd, fs, epfd, 0);
+            }
+        }
+
+        return retval;
+    }
+
+    reg = get_epoll_reg(epfd, fd, 1);
+    fs = alloc_fd_state(fd);
+
+    /* the kernel must never see the application's own event data, which
+     * epoll_wait() could not map back to an fd */
+
+    if (reg == NULL || fs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* the registration is updated first since another thread may already
+     * be waiting on epfd, and restored if the kernel refuses it */
+
+    old.events = __atomic_load_n(&reg->events, __ATOMIC_RELAXED);
+    old.data.u64 = __atomic_load_n(&reg->data.u64, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&reg->events, event->events, __ATOMIC_RELAXED);
+    __atomic_store_n(&reg->data.u64, event->data.u64, __ATOMIC_RELAXED);
+
+    /* hand our own fd-keyed registration to the kernel, with the events we
+     * are currently withholding masked out */
+
+    ev.events = get_epoll_kernel_events(fs, reg);
+    ev.data.u64 = (uint64_t) fd;
+
+    retval = (*orig.epoll_ctl)(epfd, op, fd, &ev);
+
+    if (retval != 0) {
+        __atomic_store_n(&reg->events, old.events, __ATOMIC_RELAXED);
+        __atomic_store_n(&reg->data.u64, old.data.u64, __ATOMIC_RELAXED);
+
+    } else {
+        set_fd_epoll(fd, fs, epfd, (event->events & (EPOLLET|EPOLLONESHOT))
+                                   == EPOLLET);
+
+        log_event(LOG_EPOLL_CTL, API_EPOLL_CTL, fd, epfd, event->events, op, 0);
+    }
+
+    return retval;
+}
+
+
+static int
+mock_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+    int timeout)
+{
+    dd("calling my epoll_wait");
+
+    return filter_epoll_wait(API_EPOLL_WAIT, epfd, events, maxevents, timeout,
+                           NULL);
+}
+
+
+static int
+mock_epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+    int timeout, const sigset_t *sigmask)
+{
+    dd("calling my epoll_pwait");
+
+    return filter_epoll_wait(API_EPOLL_PWAIT, epfd, events, maxevents, timeout,
+                           sigmask);
+}
+
+
+static int
+filter_epoll_wait(int api, int epfd, struct epoll_event *events,
+    int maxevents, int timeout, const sigset_t *sigmask)
+{
+    int                      retval;
+    struct epoll_event      *ev;
+    epoll_reg_t             *reg;
+    fd_state_t              *fs;
+    int                      i;
+    int                      n;
+    int                      fd;
+    int                      evs;
+    int                      revs;
+    wait_ctx_t               wc;
+
+    init_wait_ctx(&wc, api, timeout, sigmask);
+
+    for ( ;; ) {
+        retval = (*orig.epoll_pwait)(epfd, events, maxevents, timeout,
+                                     sigmask);
+
+        if (retval <= 0) {
+            return retval;
+        }
+
+        n = 0;
+
+        for (i = 0; i < retval; i++) {
+            ev = &events[i];
+            fd = (int) ev->data.u64;
+
+            reg = get_epoll_reg(epfd, fd, 0);
+            if (reg == NULL) {
+                /* registered behind our back, leave it alone */
+                events[n++] = *ev;
+                continue;
+            }
+
+            ev->data.u64 = __atomic_load_n(&reg->data.u64, __ATOMIC_RELAXED);
+
+            revs = (int) (ev->events & 0xffff);
+            evs = filter_events(&wc, fd, revs);
+
+            if (evs != revs) {
+                fs = get_fd_state(fd);
+
+                /* stop the kernel from reporting the suppressed events
+                 * over and over again; for edge-triggered and one-shot
+                 * registrations, this also queues the events we held back
+                 * or swallowed again */
+
+                if (fs
+                    && ((revs & ~get_epoll_kernel_events(fs, reg))
+                        || (__atomic_load_n(&reg->events, __ATOMIC_RELAXED)
+                            & (EPOLLET|EPOLLONESHOT))))
+                {
+                    update_epoll_reg(epfd, fd, fs, reg);
+                }
+
+                if (evs == 0) {
+                    continue;
+                }
+
+                ev->events = (ev->events & ~0xffff) | (uint32_t) evs;
+            }
+
+            events[n++] = *ev;
+        }
+
+        if (n > 0) {
+            return n;
+        }
+
+        if (wc.holdback) {
+            /* the held back fds would show up again right away */
+
+            retval = wait_again(&wc);
+
+            if (retval <= 0) {
+                return retval;
+            }
+
+        } else if (wc.deadline >= 0 && now_us() >= wc.deadline) {
+            return 0;
+        }
+
+        /* keep waiting for the remaining time like the kernel would; the
+         * suppressed events are masked out of the kernel registrations by
+         * now */
+
+        timeout = get_remaining_ms(&wc);
+
+        log_event(LOG_WAIT_MORE, api, epfd, timeout, 0, 0, 0);
+    }
+}
+
+
+/* The trampolines the dispatch table starts out with: a call coming in
+ * before the constructor has run, from another library's constructor say,
+ * sets everything up first and is then dispatched as usual */
+#define init_trampoline(_name, _ret, _params, _args)                    \
+static _ret                                                             \
+boot_##_name _params                                                    \
+{                                                                       \
+    init_mockeagain();                                                  \
+                                                                        \
+    return (*dispatched(_name)) _args;                                  \
+}
+
+
+/* the table calls go through, switched over as a whole with one atomic
+ * store whenever init_dispatch() builds a new one, so that a thread never
+ * sees a table half way through being filled in */
+#define dispatched(_name)  (__atomic_load_n(&dispatch, __ATOMIC_ACQUIRE)->_name)
+
+static funcs_t *dispatch;
+
+
+init_trampoline(poll, int, (struct pollfd *ufds, nfds_t nfds, int timeout),
+    (ufds, nfds, timeout))
+init_trampoline(ppoll, int, (struct pollfd *ufds, nfds_t nfds,
+    const struct timespec *timeout, const sigset_t *sigmask),
+    (ufds, nfds, timeout, sigmask))
+init_trampoline(select, int, (int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, struct timeval *timeout),
+    (nfds, readfds, writefds, exceptfds, timeout))
+init_trampoline(pselect, int, (int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, const struct timespec *timeout,
+    const sigset_t *sigmask),
+    (nfds, readfds, writefds, exceptfds, timeout, sigmask))
+init_trampoline(epoll_wait, int, (int epfd, struct epoll_event *events,
+    int maxevents, int timeout),
+    (epfd, events, maxevents, timeout))
+init_trampoline(epoll_pwait, int, (int epfd, struct epoll_event *events,
+    int maxevents, int timeout, const sigset_t *sigmask),
+    (epfd, events, maxevents, timeout, sigmask))
+init_trampoline(epoll_ctl, int, (int epfd, int op, int fd,
+    struct epoll_event *event),
+    (epfd, op, fd, event))
+init_trampoline(socket, int, (int domain, int type, int protocol),
+    (domain, type, protocol))
+init_trampoline(close, int, (int fd), (fd))
+init_trampoline(write, ssize_t, (int fd, const void *buf, size_t len),
+    (fd, buf, len))
+init_trampoline(writev, ssize_t, (int fd, const struct iovec *iov,
+    int iovcnt),
+    (fd, iov, iovcnt))
+init_trampoline(send, ssize_t, (int fd, const void *buf, size_t len,
+    int flags),
+    (fd, buf, len, flags))
+init_trampoline(sendto, ssize_t, (int fd, const void *buf, size_t len,
+    int flags, const struct sockaddr *dest_addr, socklen_t addrlen),
+    (fd, buf, len, flags, dest_addr, addrlen))
+init_trampoline(sendmsg, ssize_t, (int fd, const struct msghdr *msg,
+    int flags),
+    (fd, msg, flags))
+init_trampoline(sendmmsg, int, (int fd, struct mmsghdr *msgvec,
+    unsigned int vlen, int flags),
+    (fd, msgvec, vlen, flags))
+init_trampoline(sendfile, ssize_t, (int out_fd, int in_fd, off_t *offset,
+    size_t count),
+    (out_fd, in_fd, offset, count))
+init_trampoline(splice, ssize_t, (int fd_in, loff_t *off_in, int fd_out,
+    loff_t *off_out, size_t len, unsigned int flags),
+    (fd_in, off_in, fd_out, off_out, len, flags))
+init_trampoline(read, ssize_t, (int fd, void *buf, size_t len),
+    (fd, buf, len))
+init_trampoline(readv, ssize_t, (int fd, const struct iovec *iov,
+    int iovcnt),
+    (fd, iov, iovcnt))
+init_trampoline(recv, ssize_t, (int fd, void *buf, size_t len, int flags),
+    (fd, buf, len, flags))
+init_trampoline(recvfrom, ssize_t, (int fd, void *buf, size_t len,
+    int flags, struct sockaddr *src_addr, socklen_t *addrlen),
+    (fd, buf, len, flags, src_addr, addrlen))
+init_trampoline(recvmsg, ssize_t, (int fd, struct msghdr *msg, int flags),
+    (fd, msg, flags))
+init_trampoline(recvmmsg, int, (int fd, struct mmsghdr *msgvec,
+    unsigned int vlen, int flags, struct timespec *timeout),
+    (fd, msgvec, vlen, flags, timeout))
+init_trampoline(socketpair, int, (int domain, int type, int protocol,
+    int sv[2]),
+    (domain, type, protocol, sv))
+init_trampoline(accept, int, (int sockfd, struct sockaddr *addr,
+    socklen_t *addrlen),
+    (sockfd, addr, addrlen))
+init_trampoline(accept4, int, (int sockfd, struct sockaddr *addr,
+    socklen_t *addrlen, int flags),
+    (sockfd, addr, addrlen, flags))
+init_trampoline(dup, int, (int oldfd), (oldfd))
+init_trampoline(dup2, int, (int oldfd, int newfd), (oldfd, newfd))
+init_trampoline(dup3, int, (int oldfd, int newfd, int flags),
+    (oldfd, newfd, flags))
+init_trampoline(connect, int, (int sockfd, const struct sockaddr *addr,
+    socklen_t addrlen),
+    (sockfd, addr, addrlen))
+init_trampoline(clock_gettime, int, (clockid_t clk, struct timespec *tp),
+    (clk, tp))
+init_trampoline(gettimeofday, int, (struct timeval *tv, void *tz), (tv, tz))
+init_trampoline(time, time_t, (time_t *tloc), (tloc))
+init_trampoline(pthread_cond_timedwait, int, (pthread_cond_t *cond,
+    pthread_mutex_t *mutex, const struct timespec *abstime),
+    (cond, mutex, abstime))
+init_trampoline(sem_timedwait, int, (sem_t *sem,
+    const struct timespec *abstime),
+    (sem, abstime))
+init_trampoline(clock_nanosleep, int, (clockid_t clk, int flags,
+    const struct timespec *req, struct timespec *rem),
+    (clk, flags, req, rem))
+init_trampoline(timerfd_settime, int, (int fd, int flags,
+    const struct itimerspec *new_value, struct itimerspec *old_value),
+    (fd, flags, new_value, old_value))
+
+
+static int
+boot_fcntl(int fd, int cmd, ...)
+{
+    void                *arg;
+    va_list              args;
+
+    va_start(args, cmd);
+    arg = va_arg(args, void *);
+    va_end(args);
+
+    init_mockeagain();
+
+    return (*dispatched(fcntl))(fd, cmd, arg);
+}
+
+
+/* the functions each interposed API goes to until the first init_dispatch()
+ * picks the mocks or the originals */
+static funcs_t boot = {
+    boot_poll,
+    boot_ppoll,
+    boot_select,
+    boot_pselect,
+    boot_epoll_wait,
+    boot_epoll_pwait,
+    boot_epoll_ctl,
+    boot_socket,
+    boot_close,
+    boot_write,
+    boot_writev,
+    boot_send,
+    boot_sendto,
+    boot_sendmsg,
+    boot_sendmmsg,
+    boot_sendfile,
+    boot_splice,
+    boot_read,
+    boot_readv,
+    boot_recv,
+    boot_recvfrom,
+    boot_recvmsg,
+    boot_recvmmsg,
+    boot_socketpair,
+    boot_accept,
+    boot_accept4,
+    boot_dup,
+    boot_dup2,
+    boot_dup3,
+    boot_fcntl,
+    boot_connect,
+    boot_clock_gettime,
+    boot_gettimeofday,
+    boot_time,
+    boot_pthread_cond_timedwait,
+    boot_sem_timedwait,
+    boot_clock_nanosleep,
+    boot_timerfd_settime
+};
+
+
+static funcs_t *dispatch = &boot;
+
+
+int
+poll(struct pollfd *ufds, nfds_t nfds, int timeout)
+{
+    return (*dispatched(poll))(ufds, nfds, timeout);
+}
+
+
+int
+ppoll(struct pollfd *ufds, nfds_t nfds,
+    const struct timespec *timeout, const sigset_t *sigmask)
+{
+    return (*dispatched(ppoll))(ufds, nfds, timeout, sigmask);
+}
+
+
+int
+select(int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, struct timeval *timeout)
+{
+    return (*dispatched(select))(nfds, readfds, writefds, exceptfds, timeout);
+}
+
+
+int
+pselect(int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, const struct timespec *timeout,
+    const sigset_t *sigmask)
+{
+    return (*dispatched(pselect))(nfds, readfds, writefds, exceptfds, timeout,
+                               sigmask);
+}
+
+
+int
+epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+    int timeout)
+{
+    return (*dispatched(epoll_wait))(epfd, events, maxevents, timeout);
+}
+
+
+int
+epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+    int timeout, const sigset_t *sigmask)
+{
+    return (*dispatched(epoll_pwait))(epfd, events, maxevents, timeout, sigmask);
+}
+
+
+int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    return (*dispatched(epoll_ctl))(epfd, op, fd, event);
+}
+
+
+int
+socket(int domain, int type, int protocol)
+{
+    return (*dispatched(socket))(domain, type, protocol);
+}
+
+
+int
+close(int fd)
+{
+    return (*dispatched(close))(fd);
+}
+
+
+ssize_t
+write(int fd, const void *buf, size_t len)
+{
+    return (*dispatched(write))(fd, buf, len);
+}
+
+
+ssize_t
+writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    return (*dispatched(writev))(fd, iov, iovcnt);
+}
+
+
+ssize_t
+send(int fd, const void *buf, size_t len, int flags)
+{
+    return (*dispatched(send))(fd, buf, len, flags);
+}
+
+
+ssize_t
+sendto(int fd, const void *buf, size_t len, int flags,
+    const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    return (*dispatched(sendto))(fd, buf, len, flags, dest_addr, addrlen);
+}
+
+
+ssize_t
+sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    return (*dispatched(sendmsg))(fd, msg, flags);
+}
+
+
+int
+sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    return (*dispatched(sendmmsg))(fd, msgvec, vlen, flags);
+}
+
+
+ssize_t
+sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    return (*dispatched(sendfile))(out_fd, in_fd, offset, count);
+}
+
+
+ssize_t
+splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+    size_t len, unsigned int flags)
+{
+    return (*dispatched(splice))(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+
+ssize_t
+read(int fd, void *buf, size_t len)
+{
+    return (*dispatched(read))(fd, buf, len);
+}
+
+
+ssize_t
+readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    return (*dispatched(readv))(fd, iov, iovcnt);
+}
+
+
+ssize_t
+recv(int fd, void *buf, size_t len, int flags)
+{
+    return (*dispatched(recv))(fd, buf, len, flags);
+}
+
+
+ssize_t
+recvfrom(int fd, void *buf, size_t len, int flags,
+    struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    return (*dispatched(recvfrom))(fd, buf, len, flags, src_addr, addrlen);
+}
+
+
+ssize_t
+recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    return (*dispatched(recvmsg))(fd, msg, flags);
+}
+
+
+int
+recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+    int flags, struct timespec *timeout)
+{
+    return (*dispatched(recvmmsg))(fd, msgvec, vlen, flags, timeout);
+}
+
+
+int
+socketpair(int domain, int type, int protocol, int sv[2])
+{
+    return (*dispatched(socketpair))(domain, type, protocol, sv);
+}
+
+
+int
+accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    return (*dispatched(accept))(sockfd, addr, addrlen);
+}
+
+
+int
+accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+    return (*dispatched(accept4))(sockfd, addr, addrlen, flags);
+}
+
+
+int
+dup(int oldfd)
+{
+    return (*dispatched(dup))(oldfd);
+}
+
+
+int
+dup2(int oldfd, int newfd)
+{
+    return (*dispatched(dup2))(oldfd, newfd);
+}
+
+
+int
+dup3(int oldfd, int newfd, int flags)
+{
+    return (*dispatched(dup3))(oldfd, newfd, flags);
+}
+
+
+int
+connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    return (*dispatched(connect))(sockfd, addr, addrlen);
+}
+
+
+int
+clock_gettime(clockid_t clk, struct timespec *tp)
+{
+    return (*dispatched(clock_gettime))(clk, tp);
+}
+
+
+int
+gettimeofday(struct timeval *tv, void *tz)
+{
+    return (*dispatched(gettimeofday))(tv, tz);
+}
+
+
+time_t
+time(time_t *tloc)
+{
+    return (*dispatched(time))(tloc);
+}
+
+
+int
+pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+    const struct timespec *abstime)
+{
+    return (*dispatched(pthread_cond_timedwait))(cond, mutex, abstime);
+}
+
+
+int
+sem_timedwait(sem_t *sem, const struct timespec *abstime)
+{
+    return (*dispatched(sem_timedwait))(sem, abstime);
+}
+
+
+int
+clock_nanosleep(clockid_t clk, int flags, const struct timespec *req,
+    struct timespec *rem)
+{
+    return (*dispatched(clock_nanosleep))(clk, flags, req, rem);
+}
+
+
+int
+timerfd_settime(int fd, int flags, const struct itimerspec *new_value,
+    struct itimerspec *old_value)
+{
+    return (*dispatched(timerfd_settime))(fd, flags, new_value, old_value);
+}
+
+
+int
+fcntl(int fd, int cmd, ...)
+{
+    void                *arg;
+    va_list              args;
+
+    va_start(args, cmd);
+    arg = va_arg(args, void *);
+    va_end(args);
+
+    return (*dispatched(fcntl))(fd, cmd, arg);
+}
+
+
+#if (__WORDSIZE == 64)
+
+/* the same call as fcntl() on 64-bit systems, which programs built with
+ * _FILE_OFFSET_BITS=64 call instead */
+int
+fcntl64(int fd, int cmd, ...)
+{
+    void                *arg;
+    va_list              args;
+
+    va_start(args, cmd);
+    arg = va_arg(args, void *);
+    va_end(args);
+
+    return (*dispatched(fcntl))(fd, cmd, arg);
+}
+
+
+/* the same call as sendfile() on 64-bit systems, with its own symbol */
+ssize_t
+sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count)
+{
+    return (*dispatched(sendfile))(out_fd, in_fd, (off_t *) offset, count);
+}
+
+#endif
+
+
+/* Everything is set up as soon as the library is loaded, so that the
+ * interposed calls need not check for it */
+static void
+load_mockeagain()
+{
+    init_mockeagain();
+}
+
+
+/* Parse the environment and set up the global tables exactly once, be it
+ * from the constructor or from a trampoline called before it */
+static void
+init_mockeagain()
+{
+    (void) pthread_once(&init_once, do_init);
+}
+
+
+static void
+do_init()
+{
+    /* the originals go first since everything else may call them, and the
+     * verbose level next since everything else may log; the functions
+     * called from here must not call back into init_mockeagain(), so they
+     * read the globals directly */
+
+    init_originals();
+    init_control();
+    init_verbose_level();
+    init_mocking_type();
+
+    if (!is_mocking_enabled()) {
+        /* nothing but the originals is needed then, so leave the process
+         * alone as much as we can */
+        __atomic_store_n(&dispatch, &orig, __ATOMIC_RELEASE);
+        return;
+    }
+
+    init_log();
+    init_fd_pages();
+    init_stats();
+    init_trace();
+    init_patterns();
+    init_rate();
+    init_random();
+    init_targets();
+    init_whitelist();
+    init_timewarp();
+    init_framer();
+    init_splits();
+
+    init_dispatch();
+}
+
+
+static void *
+get_original(const char *name)
+{
+    void                *f;
+
+    f = dlsym(RTLD_NEXT, name);
+    if (f == NULL) {
+        fprintf(stderr, "mockeagain: could not find the underlying %s: %s\n",
+                name, dlerror());
+        exit(1);
+    }
+
+    return f;
+}
+
+
+#define resolve_original(_name)                                         \
+    orig._name = (_name##_handle) get_original(#_name)
+
+
+static void
+init_originals()
+{
+    resolve_original(poll);
+    resolve_original(ppoll);
+    resolve_original(select);
+    resolve_original(pselect);
+    resolve_original(epoll_wait);
+    resolve_original(epoll_pwait);
+    resolve_original(epoll_ctl);
+    resolve_original(socket);
+    resolve_original(close);
+    resolve_original(write);
+    resolve_original(writev);
+    resolve_original(send);
+    resolve_original(sendto);
+    resolve_original(sendmsg);
+    resolve_original(sendmmsg);
+    resolve_original(sendfile);
+    resolve_original(splice);
+    resolve_original(read);
+    resolve_original(readv);
+    resolve_original(recv);
+    resolve_original(recvfrom);
+    resolve_original(recvmsg);
+    resolve_original(recvmmsg);
+    resolve_original(socketpair);
+    resolve_original(accept);
+    resolve_original(accept4);
+    resolve_original(dup);
+    resolve_original(dup2);
+    resolve_original(dup3);
+    resolve_original(fcntl);
+    resolve_original(connect);
+    resolve_original(clock_gettime);
+    resolve_original(gettimeofday);
+    resolve_original(time);
+    resolve_original(pthread_cond_timedwait);
+    resolve_original(sem_timedwait);
+    resolve_original(clock_nanosleep);
+    resolve_original(timerfd_settime);
+}
+
+
+/* Point every API at its mock only if there is something to mock in its
+ * direction, and straight at the original otherwise. The event APIs and
+ * the calls creating and closing fds keep the per-fd state, so they are
+ * mocked as soon as either direction is. */
+static void
+init_dispatch()
+{
+    int                  active;
+    funcs_t             *d;
+
+    active = mocking_type;
+
+    if (write_matcher->npatterns) {
+        active |= MOCKING_WRITES;
+    }
+
+    if (read_matcher->npatterns) {
+        active |= MOCKING_READS;
+    }
+
+    /* the table in use may be being called through by other threads right
+     * now, so a new one is built every time; the old ones are never freed */
+
+    d = malloc(sizeof(funcs_t));
+    if (d == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return;
+    }
+
+    *d = orig;
+
+    /* the clocks never go back once warped, even if MOCKEAGAIN_CONTROL
+     * turns time warping off again */
+
+    if (timewarp || __atomic_load_n(&warp_us, __ATOMIC_RELAXED)) {
+        d->clock_gettime = mock_clock_gettime;
+        d->gettimeofday = mock_gettimeofday;
+        d->time = mock_time;
+        d->pthread_cond_timedwait = mock_pthread_cond_timedwait;
+        d->sem_timedwait = mock_sem_timedwait;
+        d->clock_nanosleep = mock_clock_nanosleep;
+        d->timerfd_settime = mock_timerfd_settime;
+    }
+
+    /* the event APIs look out for a new configuration from the control
+     * segment, and the per-fd state has to be kept for when it comes */
+
+    if (active == 0 && control == NULL) {
+        dd("nothing to mock, passing everything through");
+        __atomic_store_n(&dispatch, d, __ATOMIC_RELEASE);
+        return;
+    }
+
+    d->poll = mock_poll;
+    d->ppoll = mock_ppoll;
+    d->select = mock_select;
+    d->pselect = mock_pselect;
+    d->epoll_wait = mock_epoll_wait;
+    d->epoll_pwait = mock_epoll_pwait;
+    d->epoll_ctl = mock_epoll_ctl;
+    d->socket = mock_socket;
+    d->close = mock_close;
+    d->splice = mock_splice;
+    d->socketpair = mock_socketpair;
+    d->accept = mock_accept;
+    d->accept4 = mock_accept4;
+    d->dup = mock_dup;
+    d->dup2 = mock_dup2;
+    d->dup3 = mock_dup3;
+    d->fcntl = mock_fcntl;
+
+    d->connect = mock_connect;
+
+    if (active & MOCKING_WRITES) {
+        d->write = mock_write;
+        d->writev = mock_writev;
+        d->send = mock_send;
+        d->sendto = mock_sendto;
+        d->sendmsg = mock_sendmsg;
+        d->sendmmsg = mock_sendmmsg;
+        d->sendfile = mock_sendfile;
+    }
+
+    if (active & MOCKING_READS) {
+        d->read = mock_read;
+        d->readv = mock_readv;
+        d->recv = mock_recv;
+        d->recvfrom = mock_recvfrom;
+        d->recvmsg = mock_recvmsg;
+        d->recvmmsg = mock_recvmmsg;
+    }
+
+    __atomic_store_n(&dispatch, d, __ATOMIC_RELEASE);
+}
+
+
+static void
+init_mocking_type()
+{
+    const char          *p;
+
+    mocking_type = 0;
+
+    p = get_config("MOCKEAGAIN");
+    if (p == NULL || *p == '\0') {
+        dd("MOCKEAGAIN env empty");
+        /* mocking_type = MOCKING_WRITES; */
+        return;
+    }
+
+    while (*p) {
+        if (*p == 'r' || *p == 'R') {
+            mocking_type |= MOCKING_READS;
+
+        } else if (*p == 'w' || *p == 'W') {
+            mocking_type |= MOCKING_WRITES;
+        }
+
+        p++;
+    }
+
+    if (mocking_type == 0) {
+        mocking_type = MOCKING_WRITES;
+    }
+
+    dd("mocking_type %d", mocking_type);
+}
+
+
+/* Whether anything is to be mocked at all, as far as the environment
+ * tells before the patterns are parsed */
+static int
+is_mocking_enabled()
+{
+    const char          *p;
+    size_t               i;
+
+    static const char   *pattern_envs[] = {
+        "MOCKEAGAIN_WRITE_TIMEOUT_PATTERN",
+        "MOCKEAGAIN_WRITE_PATTERNS",
+        "MOCKEAGAIN_READ_PATTERNS"
+    };
+
+    if (mocking_type || control) {
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(pattern_envs) / sizeof(pattern_envs[0]); i++) {
+        p = get_config(pattern_envs[i]);
+        if (p != NULL && *p != '\0') {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+init_verbose_level()
+{
+    const char          *p;
+
+    p = get_config("MOCKEAGAIN_VERBOSE");
+    if (p == NULL || *p == '\0') {
+        dd("MOCKEAGAIN_VERBOSE env empty");
+        verbose = 0;
+        return;
+    }
+
+    if (*p >= '0' && *p <= '9') {
+        dd("MOCKEAGAIN_VERBOSE env value: %s", p);
+        verbose = *p - '0';
+        return;
+    }
+
+    dd("bad verbose env value: %s", p);
+    verbose = 0;
+}
+
+
+/* The value of a configuration variable: from the control segment once a
+ * configuration was written there, from the environment before */
+static const char *
+get_config(const char *name)
+{
+    const char          *p;
+    size_t               len;
+
+    if (control_config == NULL) {
+        return getenv(name);
+    }
+
+    len = strlen(name);
+
+    for (p = control_config; *p; p += strlen(p) + 1) {
+        if (strncmp(p, name, len) == 0 && p[len] == '=') {
+            return p + len + 1;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Map the MOCKEAGAIN_CONTROL segment, creating it if need be, and take the
+ * configuration already written there, if any */
+static void
+init_control()
+{
+    const char          *name;
+    struct stat          st;
+    void                *p;
+    int                  fd;
+
+    name = getenv("MOCKEAGAIN_CONTROL");
+    if (name == NULL || *name == '\0') {
+        dd("MOCKEAGAIN_CONTROL env empty");
+        return;
+    }
+
+    /* only the originals may be called from within the initialization */
+
+    fd = shm_open(name, O_RDWR|O_CREAT, 0600);
+
+    if (fd == -1
+        || fstat(fd, &st) != 0
+        || (st.st_size < (off_t) sizeof(control_t)
+            && ftruncate(fd, (off_t) sizeof(control_t)) != 0))
+    {
+        fprintf(stderr, "mockeagain: failed to open the shared memory "
+                "segment \"%s\": %s\n", name, strerror(errno));
+
+        if (fd != -1) {
+            (void) (*orig.close)(fd);
+        }
+
+        return;
+    }
+
+    p = mmap(NULL, sizeof(control_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+             0);
+
+    (void) (*orig.close)(fd);
+
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return;
+    }
+
+    control = p;
+
+    (void) pthread_atfork(NULL, NULL, reset_control_in_child);
+
+    if (control->magic == 0) {
+        control->version = CONTROL_VERSION;
+        control->magic = CONTROL_MAGIC;
+
+    } else if (control->magic != CONTROL_MAGIC
+               || control->version != CONTROL_VERSION)
+    {
+        fprintf(stderr, "mockeagain: \"%s\" is no MOCKEAGAIN_CONTROL "
+                "segment of version %d, ignored.\n", name, CONTROL_VERSION);
+
+        (void) munmap(p, sizeof(control_t));
+        control = NULL;
+        return;
+    }
+
+    if (__atomic_load_n(&control->generation, __ATOMIC_ACQUIRE)
+        && load_control())
+    {
+        __atomic_store_n(&control->applied, control_generation,
+                         __ATOMIC_RELEASE);
+    }
+}
+
+
+/* The thread applying a configuration did not survive the fork */
+static void
+reset_control_in_child()
+{
+    (void) pthread_mutex_init(&control_mutex, NULL);
+}
+
+
+/* Take a private copy of the configuration in the control segment, split
+ * into NAME=value strings. Returns 0 if the harness bumped the generation
+ * again while we were copying, in which case we try again later. */
+static int
+load_control()
+{
+    uint32_t             gen;
+    char                *buf;
+    char                *dst;
+    const char          *src;
+    const char          *end;
+    const char          *eol;
+    const char          *next;
+
+    gen = __atomic_load_n(&control->generation, __ATOMIC_ACQUIRE);
+
+    buf = malloc(CONTROL_CONFIG_LEN + 2);
+    if (buf == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return 0;
+    }
+
+    memcpy(buf, control->config, CONTROL_CONFIG_LEN);
+    buf[CONTROL_CONFIG_LEN] = '\0';
+
+    if (__atomic_load_n(&control->generation, __ATOMIC_ACQUIRE) != gen) {
+        free(buf);
+        return 0;
+    }
+
+    /* compact the lines in place, skipping the empty ones and comments,
+     * and end the list with an empty string */
+
+    src = buf;
+    dst = buf;
+    end = buf + strlen(buf);
+
+    while (src < end) {
+        next = memchr(src, '\n', end - src);
+        next = next ? next + 1 : end;
+
+        eol = next;
+        while (eol > src
+               && (eol[-1] == '\n' || eol[-1] == '\r' || eol[-1] == ' '))
+        {
+            eol--;
+        }
+
+        if (eol > src && *src != '#') {
+            memmove(dst, src, eol - src);
+            dst += eol - src;
+            *dst++ = '\0';
+        }
+
+        src = next;
+    }
+
+    *dst = '\0';
+
+    /* whatever was parsed from the previous copy has been copied in turn */
+
+    free(control_config);
+
+    control_config = buf;
+    control_generation = gen;
+
+    return 1;
+}
+
+
+/* Switch to the configuration just written to the control segment. The
+ * thread getting the lock does it while the others carry on with the old
+ * configuration, so that no event loop ever blocks on another. */
+static void
+apply_control()
+{
+    if (pthread_mutex_trylock(&control_mutex) != 0) {
+        return;
+    }
+
+    if (__atomic_load_n(&control->generation, __ATOMIC_ACQUIRE)
+        != control_generation
+        && load_control())
+    {
+        init_verbose_level();
+        init_mocking_type();
+        init_patterns();
+        init_rate();
+        init_random();
+        init_targets();
+        init_whitelist();
+        init_timewarp();
+        init_framer();
+        init_splits();
+        reset_fd_mocking();
+        init_dispatch();
+
+        __atomic_store_n(&control->applied, control_generation,
+                         __ATOMIC_RELEASE);
+
+        if (verbose) {
+            fprintf(stderr, "mockeagain: applied the configuration of "
+                    "generation %u from MOCKEAGAIN_CONTROL\n",
+                    control_generation);
+        }
+    }
+
+    (void) pthread_mutex_unlock(&control_mutex);
+}
+
+
+/* Forget what the configuration just replaced decided for every fd: how
+ * far it got into the patterns, what the patterns found did to it, and that
+ * it was polled, so that it is only mocked again once the new configuration
+ * had a say on its events */
+static void
+reset_fd_mocking()
+{
+    int                  i;
+    int                  k;
+    fd_state_t          *page;
+    fd_state_t          *fs;
+
+    for (i = 0; i < fd_npages; i++) {
+        page = __atomic_load_n(&fd_pages[i], __ATOMIC_ACQUIRE);
+        if (page == NULL) {
+            continue;
+        }
+
+        for (k = 0; k < FD_PAGE_SIZE; k++) {
+            fs = &page[k];
+
+            fd_store(fs->polled, 0);
+            fd_store(fs->snd_timeout, 0);
+            fd_store(fs->rcv_fault, 0);
+            fd_store(fs->rcv_errno, 0);
+            fd_store(fs->rcv_until, 0);
+        }
+    }
+}
+
+
+/* Allocate the page directory of the per-fd state table, large enough to
+ * cover every fd below the RLIMIT_NOFILE hard limit */
+static void
+init_fd_pages()
+{
+    struct rlimit        rlim;
+    rlim_t               limit;
+    int                  npages;
+    void                *p;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) != 0
+        || rlim.rlim_max == RLIM_INFINITY
+        || rlim.rlim_max > FD_LIMIT_MAX)
+    {
+        limit = FD_LIMIT_MAX;
+
+    } else {
+        limit = rlim.rlim_max;
+    }
+
+    npages = (int) ((limit + FD_PAGE_SIZE - 1) >> FD_PAGE_BITS);
+    if (npages == 0) {
+        npages = 1;
+    }
+
+    /* mmap()'d memory is zero-filled and only backed when touched, so
+     * directory slots for fds that are never used cost nothing */
+
+    p = mmap(NULL, npages * sizeof(fd_state_t *), PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return;
+    }
+
+    dd("fd table: %d pages of %d fds", npages, FD_PAGE_SIZE);
+
+    /* fd_npages publishes the directory to lookups that do not go through
+     * init_mockeagain() */
+
+    fd_pages = p;
+    __atomic_store_n(&fd_npages, npages, __ATOMIC_RELEASE);
+
+    (void) pthread_atfork(NULL, NULL, reset_fds_in_child);
+}
+
+
+/* A forked child, like a worker forked by a server's master process, gets
+ * copies of the fds of its parent, but not of where the parent got with
+ * them; the socket types and targets they were tagged with still hold */
+static void
+reset_fds_in_child()
+{
+    int                  i;
+    int                  k;
+    fd_state_t          *page;
+
+    reset_fd_mocking();
+
+    for (i = 0; i < fd_npages; i++) {
+        page = fd_pages[i];
+        if (page == NULL) {
+            continue;
+        }
+
+        for (k = 0; k < FD_PAGE_SIZE; k++) {
+            page[k].active = 0;
+            page[k].rrandom = 0;
+            page[k].wrandom = 0;
+        }
+    }
+}
+
+
+/* Look up the state of an fd, returning NULL if it was never tracked */
+static fd_state_t *
+get_fd_state(int fd)
+{
+    fd_state_t          *page;
+
+    if (fd < 0
+        || (fd >> FD_PAGE_BITS) >= __atomic_load_n(&fd_npages,
+                                                   __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    page = __atomic_load_n(&fd_pages[fd >> FD_PAGE_BITS], __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+        return NULL;
+    }
+
+    return &page[fd & FD_PAGE_MASK];
+}
+
+
+/* Look up the state of an fd, allocating its page on demand */
+static fd_state_t *
+alloc_fd_state(int fd)
+{
+    fd_state_t          *fs;
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    fs = get_page_entry((void **) fd_pages, fd, sizeof(fd_state_t), 1);
+
+    if (fs == NULL && (fd >> FD_PAGE_BITS) >= fd_npages && verbose) {
+        fprintf(stderr, "mockeagain: fd %d is out of the tracked range, "
+                "not mocking it.\n", fd);
+    }
+
+    return fs;
+}
+
+
+static void
+reset_fd_state(fd_state_t *fs)
+{
+    if (fs->epoll_regs) {
+        /* the shadow interest set of an epoll instance being closed; the
+         * pages go together with it */
+        free_epoll_regs(fs->epoll_regs);
+    }
+
+    memset(fs, 0, sizeof(fd_state_t));
+}
+
+
+/* Start over with the state of an fd just created, of which only whether
+ * it is a stream socket and whether it is targeted are known */
+static void
+init_fd_state(int fd, int flags)
+{
+    fd_state_t          *fs;
+
+    reset_frames(fd);
+    reset_splits(fd);
+    reset_epolls(fd);
+
+    if (flags) {
+        dd("the current fd %d has flags %d", fd, flags);
+
+        fs = alloc_fd_state(fd);
+        if (fs) {
+            reset_fd_state(fs);
+            fd_store(fs->weird, (flags & FD_WEIRD) != 0);
+            fd_store(fs->targeted, flags & ~FD_WEIRD);
+        }
+
+        return;
+    }
+
+    fs = get_fd_state(fd);
+    if (fs) {
+        reset_fd_state(fs);
+    }
+}
+
+
+static int
+get_fd_flags(int fd)
+{
+    fd_state_t          *fs;
+
+    fs = get_fd_state(fd);
+    if (fs == NULL) {
+        return 0;
+    }
+
+    return (fd_load(fs->weird) ? FD_WEIRD : 0) | fd_load(fs->targeted);
+}
+
+
+/* Return the address of entry n in a directory of lazily allocated pages of
+ * FD_PAGE_SIZE entries each; the directory has the same size as the fd
+ * table's */
+static void *
+get_page_entry(void **pages, int n, size_t size, int create)
+{
+    int                  i;
+    char                *page;
+    void                *expected;
+
+    i = n >> FD_PAGE_BITS;
+
+    if (n < 0 || i >= __atomic_load_n(&fd_npages, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    page = __atomic_load_n(&pages[i], __ATOMIC_ACQUIRE);
+
+    if (page == NULL) {
+        if (!create) {
+            return NULL;
+        }
+
+        page = mmap(NULL, FD_PAGE_SIZE * size, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED) {
+            fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+            return NULL;
+        }
+
+        /* another thread may be allocating the same page concurrently;
+         * the loser drops its copy */
+
+        expected = NULL;
+
+        if (!__atomic_compare_exchange_n(&pages[i], &expected, page, 0,
+                                         __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE))
+        {
+            munmap(page, FD_PAGE_SIZE * size);
+            page = expected;
+
+        } else {
+            dd("allocated page %d of %d-byte entries", i, (int) size);
+        }
+    }
+
+    return page + (size_t) (n & FD_PAGE_MASK) * size;
+}
+
+
+/* The timeout of ppoll(), select() or pselect() in ms, its fraction of a
+ * ms already rounded up as the kernel does, clamped to INT_MAX for the ones
+ * of over 24 days */
+static int
+get_timeout_ms(time_t sec, long ms)
+{
+    int64_t              t;
+
+    if (sec > INT_MAX / 1000) {
+        return INT_MAX;
+    }
+
+    t = (int64_t) sec * 1000 + ms;
+
+    return t > INT_MAX ? INT_MAX : (int) t;
+}
+
+
+/* Start the bookkeeping of an event API call with a timeout in ms (negative
+ * for none). We only need to keep track of the time when we may suppress
+ * events. */
+static void
+init_wait_ctx(wait_ctx_t *wc, int api, int timeout,
+    const sigset_t *sigmask)
+{
+    if (control
+        && __atomic_load_n(&control->generation, __ATOMIC_RELAXED)
+           != control_generation)
+    {
+        apply_control();
+    }
+
+    wc->api = api;
+    wc->holdback = 0;
+    wc->sigmask = sigmask;
+
+    count_stat(api, -1, STAT_WAITS, 1);
+
+    if (timeout >= 0
+        && (write_matcher->npatterns || read_matcher->npatterns || rate
+            || replay))
+    {
+        wc->deadline = now_us() + (int64_t) timeout * 1000;
+
+    } else {
+        wc->deadline = -1;
+    }
+}
+
+
+/* The timeout in ms to pass to the event API when waiting again */
+static int
+get_remaining_ms(wait_ctx_t *wc)
+{
+    int64_t              left;
+
+    if (wc->deadline < 0) {
+        return -1;
+    }
+
+    left = wc->deadline - now_us();
+    if (left <= 0) {
+        return 0;
+    }
+
+    return (int) ((left + 999) / 1000);
+}
+
+
+/* Every ready fd got suppressed. If some were only held back by the rate
+ * limit, sleep until the first of them may be ready, and return 1 to make
+ * the caller wait again; otherwise emulate the timeout. Returns 0 on
+ * timeout and -1 if interrupted by a signal. */
+static int
+wait_again(wait_ctx_t *wc)
+{
+    struct timespec      ts;
+    int64_t              t;
+    int64_t              wait;
+
+    if (wc->holdback == 0) {
+        return emulate_timeout(wc);
+    }
+
+    wait = wc->holdback;
+    wc->holdback = 0;
+
+    if (wc->deadline >= 0) {
+        t = now_us();
+
+        if (t >= wc->deadline) {
+            return 0;
+        }
+
+        if (t + wait > wc->deadline) {
+            wait = wc->deadline - t;
+        }
+    }
+
+    dd("%s: holding back for %lld us", api_names[wc->api],
+       (long long) wait);
+
+    if (timewarp) {
+        warp_clock(wc->api, wait);
+        return 1;
+    }
+
+    ts.tv_sec = wait / 1000000;
+    ts.tv_nsec = (long) (wait % 1000000) * 1000;
+
+    if ((*orig.ppoll)(NULL, 0, &ts, wc->sigmask) < 0) {
+        return -1;
+    }
+
+    return 1;
+}
+
+
+/* Record the readiness an event API reported for fd, and return the events
+ * to pass on to the application */
+static int
+filter_events(wait_ctx_t *wc, int fd, int events)
+{
+    fd_state_t          *fs;
+    trace_record_t      *r;
+    int                  held;
+    int                  reported;
+
+    fs = alloc_fd_state(fd);
+    if (fs == NULL
+        || fd_load(fs->weird)
+        || (ntargets && !is_targeted(wc->api, fd, fs)))
+    {
+        dd("skipping fd %d", fd);
+        return events;
+    }
+
+    if (events == 0) {
+        /* found not ready, so nothing is to go through until the next
+         * readiness reported */
+        fd_store(fs->active, 0);
+        fd_store(fs->polled, 1);
+        return 0;
+    }
+
+    reported = events;
+
+    if (replay && (r = get_replay_record(fd, REPLAY_POLL, TRACE_POLL,
+                                         (uint32_t) events)))
+    {
+        held = (int) (r->requested & ~r->granted);
+
+        if (events & held) {
+            events &= ~held;
+            count_stat(wc->api, fd, STAT_HELD, 1);
+
+            if (r->arg && (wc->holdback == 0 || r->arg < wc->holdback)) {
+                wc->holdback = r->arg;
+            }
+        }
+
+    } else {
+        events = decide_events(wc, fd, fs, events);
+    }
+
+    trace_decision(wc->api, fd, 0, TRACE_POLL, reported, events,
+                   events != reported ? (uint32_t) wc->holdback : 0);
+
+    if (events == 0) {
+        return 0;
+    }
+
+    fd_store(fs->active, (short) events);
+    fd_store(fs->polled, 1);
+
+    log_event(LOG_POLLED, wc->api, fd, events, 0, 0, 0);
+
+    return events;
+}
+
+
+/* Suppress the events of fd that the patterns found so far and the rate
+ * limit call for */
+static int
+decide_events(wait_ctx_t *wc, int fd, fd_state_t *fs, int events)
+{
+    int64_t              t;
+    int64_t              wait;
+
+    if ((events & POLLOUT) && fd_load(fs->snd_timeout)) {
+
+        log_event(LOG_HANG, wc->api, fd, 0, 0, 0, 0);
+
+        events &= ~POLLOUT;
+
+        count_stat(wc->api, fd, STAT_HELD, 1);
+
+        if (events == 0) {
+            return 0;
+        }
+    }
+
+    if ((events & POLLIN) && fd_load(fs->rcv_fault) == PATTERN_STALL) {
+        wait = get_stall_wait(fs, now_us());
+
+        if (wait) {
+            log_event(LOG_STALL, wc->api, fd, 0, 0, 0, 0);
+
+            events &= ~POLLIN;
+
+            count_stat(wc->api, fd, STAT_HELD, 1);
+
+            if (wait > 0 && (wc->holdback == 0 || wait < wc->holdback)) {
+                wc->holdback = wait;
+            }
+
+            if (events == 0) {
+                return 0;
+            }
+        }
+    }
+
+    if (rate && (events & (POLLIN|POLLOUT))) {
+        t = now_us();
+
+        /* hold back readiness until the bucket is full again, so that a
+         * throttled fd is only woken up RATE_BURST_DIVISOR times a second */
+
+        if ((events & POLLIN) && (mocking_type & MOCKING_READS)) {
+            wait = get_bucket_wait(&fs->rbucket, t);
+
+            if (wait) {
+                events &= ~POLLIN;
+                count_stat(wc->api, fd, STAT_HELD, 1);
+
+                if (wc->holdback == 0 || wait < wc->holdback) {
+                    wc->holdback = wait;
+                }
+            }
+        }
+
+        if ((events & POLLOUT) && (mocking_type & MOCKING_WRITES)) {
+            wait = get_bucket_wait(&fs->wbucket, t);
+
+            if (wait) {
+                events &= ~POLLOUT;
+                count_stat(wc->api, fd, STAT_HELD, 1);
+
+                if (wc->holdback == 0 || wait < wc->holdback) {
+                    wc->holdback = wait;
+                }
+            }
+        }
+
+        if (events == 0) {
+            log_event(LOG_HOLD, wc->api, fd, 0, 0, 0, 0);
+        }
+    }
+
+    return events;
+}
+
+
+/* Run the readiness reported by poll() or ppoll() through filter_events(),
+ * the fds found not ready included, returning the number of fds that are
+ * still ready */
+static int
+filter_pollfds(wait_ctx_t *wc, struct pollfd *ufds, nfds_t nfds, int nready)
+{
+    struct pollfd           *p;
+    nfds_t                   i;
+    short                    revents;
+
+    p = ufds;
+    for (i = 0; i < nfds; i++, p++) {
+        if (p->fd < 0) {
+            continue;
+        }
+
+        revents = p->revents;
+
+        p->revents = (short) filter_events(wc, p->fd, revents);
+
+        if (revents && p->revents == 0) {
+            nready--;
+        }
+    }
+
+    return nready;
+}
+
+
+/* The select() flavour of filter_pollfds(), where saved holds the sets
+ * asked for, returning the number of bits still set in the three sets */
+static int
+filter_fdsets(wait_ctx_t *wc, int nfds, fd_set *saved, fd_set *readfds,
+    fd_set *writefds, fd_set *exceptfds)
+{
+    int                  fd;
+    int                  events;
+    int                  nready = 0;
+
+    for (fd = 0; fd < nfds; fd++) {
+        if (!(readfds && FD_ISSET(fd, &saved[0]))
+            && !(writefds && FD_ISSET(fd, &saved[1]))
+            && !(exceptfds && FD_ISSET(fd, &saved[2])))
+        {
+            continue;
+        }
+
+        events = 0;
+
+        if (readfds && FD_ISSET(fd, readfds)) {
+            events |= POLLIN;
+        }
+
+        if (writefds && FD_ISSET(fd, writefds)) {
+            events |= POLLOUT;
+        }
+
+        if (exceptfds && FD_ISSET(fd, exceptfds)) {
+            events |= POLLPRI;
+        }
+
+        events = filter_events(wc, fd, events);
+
+        if (events & POLLIN) {
+            nready++;
+
+        } else if (readfds) {
+            FD_CLR(fd, readfds);
+        }
+
+        if (events & POLLOUT) {
+            nready++;
+
+        } else if (writefds) {
+            FD_CLR(fd, writefds);
+        }
+
+        if (events & POLLPRI) {
+            nready++;
+
+        } else if (exceptfds) {
+            FD_CLR(fd, exceptfds);
+        }
+    }
+
+    return nready;
+}
+
+
+static void
+save_fdsets(fd_set *saved, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds)
+{
+    if (readfds) {
+        saved[0] = *readfds;
+    }
+
+    if (writefds) {
+        saved[1] = *writefds;
+    }
+
+    if (exceptfds) {
+        saved[2] = *exceptfds;
+    }
+}
+
+
+static void
+restore_fdsets(fd_set *saved, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds)
+{
+    if (readfds) {
+        *readfds = saved[0];
+    }
+
+    if (writefds) {
+        *writefds = saved[1];
+    }
+
+    if (exceptfds) {
+        *exceptfds = saved[2];
+    }
+}
+
+
+/* Every ready fd got suppressed, so sleep out the rest of the timeout like
+ * the event API would have done. The signal mask of ppoll() and pselect()
+ * is honoured while sleeping. */
+static int
+emulate_timeout(wait_ctx_t *wc)
+{
+    struct timespec      ts;
+    int64_t              diff;
+
+    log_event(LOG_TIMEOUT, wc->api, -1, 0, 0, 0, 0);
+
+    if (wc->deadline < 0) {
+        ts.tv_sec = 3600 * 24;
+        ts.tv_nsec = 0;
+
+        log_event(LOG_SLEEP, wc->api, -1, 3600 * 24 * 1000, 0, 0, 0);
+
+    } else {
+        diff = wc->deadline - now_us();
+
+        if (diff <= 0) {
+            return 0;
+        }
+
+        if (timewarp) {
+            warp_clock(wc->api, diff);
+            return 0;
+        }
+
+        ts.tv_sec = diff / 1000000;
+        ts.tv_nsec = (long) (diff % 1000000) * 1000;
+
+        log_event(LOG_SLEEP, wc->api, -1, diff / 1000, 0, 0, 0);
+    }
+
+    return (*orig.ppoll)(NULL, 0, &ts, wc->sigmask);
+}
+
+
+static epoll_reg_t *
+get_epoll_reg(int epfd, int fd, int create)
+{
+    fd_state_t          *efs;
+    epoll_reg_t        **regs;
+    epoll_reg_t        **expected;
+
+    efs = create ? alloc_fd_state(epfd) : get_fd_state(epfd);
+    if (efs == NULL) {
+        return NULL;
+    }
+
+    regs = __atomic_load_n(&efs->epoll_regs, __ATOMIC_ACQUIRE);
+
+    if (regs == NULL) {
+        if (!create) {
+            return NULL;
+        }
+
+        regs = mmap(NULL, fd_npages * sizeof(epoll_reg_t *),
+                    PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (regs == MAP_FAILED) {
+            fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+            return NULL;
+        }
+
+        expected = NULL;
+
+        if (!__atomic_compare_exchange_n(&efs->epoll_regs, &expected, regs,
+                                         0, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE))
+        {
+            munmap(regs, fd_npages * sizeof(epoll_reg_t *));
+            regs = expected;
+        }
+    }
+
+    return get_page_entry((void **) regs, fd, sizeof(epoll_reg_t), create);
+}
+
+
+/* The events we let the kernel watch for on behalf of a registration */
+static uint32_t
+get_epoll_kernel_events(fd_state_t *fs, epoll_reg_t *reg)
+{
+    uint32_t             events;
+
+    events = __atomic_load_n(&reg->events, __ATOMIC_RELAXED);
+
+    if (fd_load(fs->snd_timeout)) {
+        events &= ~EPOLLOUT;
+    }
+
+    /* the timed stalls are held back in epoll_wait() instead, since
+     * nothing would unmask them again in time */
+
+    if (fd_load(fs->rcv_fault) == PATTERN_STALL
+        && fd_load(fs->rcv_until) == 0)
+    {
+        events &= ~EPOLLIN;
+    }
+
+    return events;
+}
+
+
+/* Push the events we currently let through for fd into the kernel; like a
+ * real EPOLL_CTL_MOD, this queues a fresh event if the fd is still ready */
+static void
+update_epoll_reg(int epfd, int fd, fd_state_t *fs, epoll_reg_t *reg)
+{
+    struct epoll_event   ev;
+
+    ev.events = get_epoll_kernel_events(fs, reg);
+    ev.data.u64 = (uint64_t) fd;
+
+    if ((*orig.epoll_ctl)(epfd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+        dd("failed to update fd %d in epoll instance %d: %s", fd, epfd,
+           strerror(errno));
+    }
+}
+
+
+/* Look up the epoll instances of an fd, allocating the page directory and
+ * its page on demand */
+static fd_epolls_t *
+get_fd_epolls(int fd, int create)
+{
+    fd_epolls_t        **pages;
+    void                *expected;
+
+    pages = __atomic_load_n(&epoll_pages, __ATOMIC_ACQUIRE);
+
+    if (pages == NULL) {
+        if (!create || fd_npages == 0) {
+            return NULL;
+        }
+
+        pages = mmap(NULL, fd_npages * sizeof(fd_epolls_t *),
+                     PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (pages == MAP_FAILED) {
+            fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+            return NULL;
+        }
+
+        expected = NULL;
+
+        if (!__atomic_compare_exchange_n(&epoll_pages, &expected, pages, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            munmap(pages, fd_npages * sizeof(fd_epolls_t *));
+            pages = expected;
+        }
+    }
+
+    return get_page_entry((void **) pages, fd, sizeof(fd_epolls_t), create);
+}
+
+
+/* Record whether fd is now registered edge-triggered in epfd. An fd can be
+ * in several epoll instances at once, like a listening socket shared by the
+ * event loops of several threads, and each of them needs the new edge */
+static void
+set_fd_epoll(int fd, fd_state_t *fs, int epfd, int et)
+{
+    int                  i;
+    int                  v;
+    int                  slot;
+    int                  expected;
+    fd_epolls_t         *fe;
+
+    fe = get_fd_epolls(fd, et);
+    if (fe == NULL) {
+        if (!et) {
+            fd_store(fs->epoll_et, 0);
+        }
+
+        return;
+    }
+
+    slot = -1;
+
+    for (i = 0; i < MAX_FD_EPOLLS; i++) {
+        v = __atomic_load_n(&fe->epfds[i], __ATOMIC_RELAXED);
+
+        if (v == epfd + 1) {
+            if (!et) {
+                __atomic_store_n(&fe->epfds[i], 0, __ATOMIC_RELAXED);
+            }
+
+            et = 0;
+
+        } else if (v == 0 && slot == -1) {
+            slot = i;
+        }
+    }
+
+    if (et) {
+        for (i = slot; i >= 0 && i < MAX_FD_EPOLLS; i++) {
+            expected = 0;
+
+            if (__atomic_compare_exchange_n(&fe->epfds[i], &expected,
+                                            epfd + 1, 0, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+
+        if (i < 0 || i == MAX_FD_EPOLLS) {
+            dd("fd %d is edge-triggered in more than %d epoll instances, "
+               "not re-arming it in %d", fd, MAX_FD_EPOLLS, epfd);
+        }
+    }
+
+    for (i = 0; i < MAX_FD_EPOLLS; i++) {
+        if (__atomic_load_n(&fe->epfds[i], __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    fd_store(fs->epoll_et, i < MAX_FD_EPOLLS);
+}
+
+
+static void
+reset_epolls(int fd)
+{
+    fd_epolls_t         *fe;
+
+    fe = get_fd_epolls(fd, 0);
+    if (fe) {
+        memset(fe, 0, sizeof(fd_epolls_t));
+    }
+}
+
+
+/* Called whenever we fake an EAGAIN. An edge-triggered registration only
+ * fires again once the fd's readiness changes, which a real slow peer
+ * would eventually cause, so emulate that new edge in every epoll instance
+ * the fd is in. One-shot registrations are left to the application to
+ * re-arm. */
+static void
+rearm_epoll(int fd, fd_state_t *fs)
+{
+    int                  i;
+    int                  epfd;
+    int                  saved_errno;
+    fd_epolls_t         *fe;
+    epoll_reg_t         *reg;
+
+    if (!fd_load(fs->epoll_et)) {
+        return;
+    }
+
+    fe = get_fd_epolls(fd, 0);
+    if (fe == NULL) {
+        return;
+    }
+
+    saved_errno = errno;
+
+    for (i = 0; i < MAX_FD_EPOLLS; i++) {
+        epfd = __atomic_load_n(&fe->epfds[i], __ATOMIC_RELAXED) - 1;
+        if (epfd < 0) {
+            continue;
+        }
+
+        /* the instance may have been closed since, and its number taken
+         * by another one */
+
+        reg = get_epoll_reg(epfd, fd, 0);
+        if (reg == NULL
+            || (__atomic_load_n(&reg->events, __ATOMIC_RELAXED)
+                & (EPOLLET|EPOLLONESHOT)) != EPOLLET)
+        {
+            continue;
+        }
+
+        log_event(LOG_REARM, API_EPOLL_CTL, fd, epfd, 0, 0, 0);
+
+        update_epoll_reg(epfd, fd, fs, reg);
+    }
+
+    errno = saved_errno;
+}
+
+
+static void
+free_epoll_regs(epoll_reg_t **regs)
+{
+    int                  i;
+
+    for (i = 0; i < fd_npages; i++) {
+        if (regs[i]) {
+            munmap(regs[i], FD_PAGE_SIZE * sizeof(epoll_reg_t));
+        }
+    }
+
+    munmap(regs, fd_npages * sizeof(epoll_reg_t *));
+}
+
+
+/* Parse MOCKEAGAIN_RATE, e.g. "64k/s", into a rate in bytes per second */
+static void
+init_rate()
+{
+    const char          *p;
+    char                *end;
+    unsigned long long   v;
+    uint64_t             burst;
+
+    rate = 0;
+
+    p = get_config("MOCKEAGAIN_RATE");
+    if (p == NULL || *p == '\0') {
+        dd("MOCKEAGAIN_RATE env empty");
+        return;
+    }
+
+    v = strtoull(p, &end, 10);
+
+    switch (*end) {
+    case 'k':
+    case 'K':
+        v *= 1024;
+        end++;
+        break;
+
+    case 'm':
+    case 'M':
+        v *= 1024 * 1024;
+        end++;
+        break;
+
+    case 'g':
+    case 'G':
+        v *= 1024 * 1024 * 1024;
+        end++;
+        break;
+
+    default:
+        break;
+    }
+
+    if (*end == 'b' || *end == 'B') {
+        end++;
+    }
+
+    if (v == 0 || end == p || (*end != '\0' && strcmp(end, "/s") != 0)) {
+        fprintf(stderr, "mockeagain: bad MOCKEAGAIN_RATE value \"%s\", "
+                "ignored.\n", p);
+        return;
+    }
+
+    burst = v / RATE_BURST_DIVISOR;
+
+    if (burst == 0) {
+        burst = 1;
+
+    } else if (burst > INT32_MAX / 2) {
+        burst = INT32_MAX / 2;
+    }
+
+    rate_burst = (int32_t) burst;
+    rate = v;
+
+    if (verbose) {
+        fprintf(stderr, "mockeagain: limiting mocked fds to %llu bytes/s "
+                "in bursts of %d bytes\n", v, (int) rate_burst);
+    }
+}
+
+
+/* Parse MOCKEAGAIN_CHUNK, MOCKEAGAIN_EAGAIN_PROB and MOCKEAGAIN_SEED, any of
+ * which enables the random chunking mode */
+static void
+init_random()
+{
+    const char          *chunk;
+    const char          *prob;
+    const char          *seed;
+    char                *end;
+    unsigned long        lo;
+    unsigned long        hi;
+    double               p;
+    struct timespec      ts;
+
+    chunk = get_config("MOCKEAGAIN_CHUNK");
+    prob = get_config("MOCKEAGAIN_EAGAIN_PROB");
+    seed = get_config("MOCKEAGAIN_SEED");
+
+    random_chunks = 0;
+    chunk_min = 1;
+    chunk_max = 1;
+    eagain_threshold = 0;
+
+    if ((chunk == NULL || *chunk == '\0')
+        && (prob == NULL || *prob == '\0')
+        && (seed == NULL || *seed == '\0'))
+    {
+        dd("random chunking env empty");
+        return;
+    }
+
+    if (chunk && *chunk) {
+        lo = strtoul(chunk, &end, 10);
+        hi = lo;
+
+        if (*end == '-') {
+            hi = strtoul(end + 1, &end, 10);
+        }
+
+        if (end == chunk || *end != '\0' || lo == 0 || hi < lo) {
+            fprintf(stderr, "mockeagain: bad MOCKEAGAIN_CHUNK value \"%s\", "
+                    "ignored.\n", chunk);
+
+        } else {
+            chunk_min = lo;
+            chunk_max = hi;
+        }
+    }
+
+    if (prob && *prob) {
+        p = strtod(prob, &end);
+
+        if (*end == '%') {
+            p /= 100;
+            end++;
+        }
+
+        if (end == prob || *end != '\0' || p < 0 || p > 1) {
+            fprintf(stderr, "mockeagain: bad MOCKEAGAIN_EAGAIN_PROB value "
+                    "\"%s\", ignored.\n", prob);
+
+        } else {
+            eagain_threshold = p >= 1 ? UINT32_MAX
+                                      : (uint32_t) (p * 4294967296.0);
+        }
+    }
+
+    if (seed && *seed) {
+        random_seed = (uint32_t) strtoul(seed, NULL, 0);
+
+    } else {
+        (*orig.clock_gettime)(CLOCK_REALTIME, &ts);
+        random_seed = (uint32_t) (ts.tv_sec ^ ts.tv_nsec ^ getpid());
+
+        /* always tell, or a failing run could never be reproduced */
+
+        fprintf(stderr, "mockeagain: using random seed %u, set "
+                "MOCKEAGAIN_SEED=%u to reproduce.\n", random_seed,
+                random_seed);
+    }
+
+    random_chunks = 1;
+
+    if (verbose) {
+        fprintf(stderr, "mockeagain: random chunks of %lu to %lu bytes, "
+                "EAGAIN threshold %u, seed %u\n", (unsigned long) chunk_min,
+                (unsigned long) chunk_max, eagain_threshold, random_seed);
+    }
+}
+
+
+/* MOCKEAGAIN_TIMEWARP turns sleeping into moving the clocks forward */
+static void
+init_timewarp()
+{
+    const char          *p;
+
+    p = get_config("MOCKEAGAIN_TIMEWARP");
+
+    timewarp = p != NULL && *p != '\0' && strcmp(p, "0") != 0;
+
+    if (timewarp && verbose) {
+        fprintf(stderr, "mockeagain: warping the clocks instead of "
+                "sleeping\n");
+    }
+}
+
+
+/* Move the virtual clock forward by us, as if that long was slept. The
+ * threads of a process share the clock, so a thread warping its timeout
+ * also brings the timers of the others closer. */
+static void
+warp_clock(int api, int64_t us)
+{
+    (void) __atomic_add_fetch(&warp_us, us, __ATOMIC_RELAXED);
+
+    log_event(LOG_WARP, api, -1, us, 0, 0, 0);
+}
+
+
+/* Parse MOCKEAGAIN_FRAMER, the protocol spoken over the mocked fds. The
+ * table of frames is set up the first time and kept, so that a framer
+ * turned on again through MOCKEAGAIN_CONTROL finds it. */
+static void
+init_framer()
+{
+    const char          *p;
+    int                  i;
+    void                *pages;
+
+    framer = 0;
+
+    p = get_config("MOCKEAGAIN_FRAMER");
+    if (p == NULL || *p == '\0') {
+        dd("MOCKEAGAIN_FRAMER env empty");
+        return;
+    }
+
+    for (i = 1; i < FRAMER_MAX; i++) {
+        if (strcmp(p, framer_names[i]) == 0) {
+            break;
+        }
+    }
+
+    if (i == FRAMER_MAX) {
+        fprintf(stderr, "mockeagain: bad MOCKEAGAIN_FRAMER value \"%s\", "
+                "ignored.\n", p);
+        return;
+    }
+
+    if (frame_pages == NULL) {
+        if (fd_npages == 0) {
+            return;
+        }
+
+        pages = mmap(NULL, fd_npages * sizeof(fd_frames_t *),
+                     PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (pages == MAP_FAILED) {
+            fprintf(stderr, "mockeagain: ERROR: failed to allocate "
+                    "memory.\n");
+            return;
+        }
+
+        __atomic_store_n(&frame_pages, pages, __ATOMIC_RELEASE);
+    }
+
+    framer = i;
+
+    if (verbose) {
+        fprintf(stderr, "mockeagain: splitting the mocked transfers at the "
+                "%s message boundaries\n", framer_names[i]);
+    }
+}
+
+
+/* Look up where the framer got in direction dir of fd, starting over if
+ * it was set up by another framer */
+static frame_t *
+get_frame(int fd, int dir, int create)
+{
+    fd_frames_t        **pages;
+    fd_frames_t         *ff;
+    frame_t             *f;
+
+    pages = __atomic_load_n(&frame_pages, __ATOMIC_ACQUIRE);
+    if (pages == NULL) {
+        return NULL;
+    }
+
+    ff = get_page_entry((void **) pages, fd, sizeof(fd_frames_t), create);
+    if (ff == NULL) {
+        return NULL;
+    }
+
+    f = dir == MOCKING_WRITES ? &ff->write : &ff->read;
+
+    if (f->framer != framer) {
+        memset(f, 0, sizeof(frame_t));
+        f->framer = (uint8_t) framer;
+    }
+
+    return f;
+}
+
+
+static void
+reset_frames(int fd)
+{
+    fd_frames_t        **pages;
+    fd_frames_t         *ff;
+
+    pages = __atomic_load_n(&frame_pages, __ATOMIC_ACQUIRE);
+    if (pages == NULL) {
+        return;
+    }
+
+    ff = get_page_entry((void **) pages, fd, sizeof(fd_frames_t), 0);
+    if (ff) {
+        memset(ff, 0, sizeof(fd_frames_t));
+    }
+}
+
+
+/* The bytes of headers go one by one, while a body goes in three pieces:
+ * its first byte, all but its last byte, and its last byte, so that each
+ * boundary is split right at it and right next to it on either side */
+static size_t
+get_frame_budget(frame_t *f)
+{
+    switch (f->state) {
+
+    case FRAME_BODY:
+        if (f->pos == 0 || f->left == 1) {
+            return 1;
+        }
+
+        return f->left - 1 < SIZE_MAX ? (size_t) (f->left - 1) : SIZE_MAX;
+
+    case FRAME_STREAM:
+        return f->pos == 0 ? 1 : SIZE_MAX;
+
+    default:
+        return 1;
+    }
+}
+
+
+/* Feed the n bytes just transferred by iov to the framer of fd for the
+ * direction dir, see scan_data() */
+static void
+run_framer(int api, int fd, int dir, const struct iovec *iov, int iovcnt,
+    size_t n)
+{
+    const unsigned char *p;
+    size_t               len;
+    size_t               k;
+    int                  i;
+    frame_t             *f;
+
+    f = get_frame(fd, dir, 1);
+    if (f == NULL) {
+        return;
+    }
+
+    if (iov == NULL) {
+        while (n) {
+            n -= feed_frame(f, NULL, n);
+        }
+
+        return;
+    }
+
+    for (i = 0; i < iovcnt && n; i++) {
+        p = iov[i].iov_base;
+        len = iov[i].iov_len < n ? iov[i].iov_len : n;
+        n -= len;
+
+        while (len) {
+            k = feed_frame(f, p, len);
+
+            p += k;
+            len -= k;
+
+            if (f->state == FRAME_BODY && f->pos == 0) {
+                log_event(LOG_FRAME, api, fd, f->left, 0, framer, dir);
+            }
+        }
+    }
+}
+
+
+/* Move the frame over the bytes at p, stopping right after a body starts;
+ * returns the number of bytes taken */
+static size_t
+feed_frame(frame_t *f, const unsigned char *p, size_t len)
+{
+    size_t               n;
+
+    if (f->state == FRAME_STREAM) {
+        f->pos = 1;
+        return len;
+    }
+
+    if (f->state == FRAME_BODY) {
+        n = f->left < len ? (size_t) f->left : len;
+
+        f->left -= n;
+        f->pos = 1;
+
+        if (f->left == 0) {
+            end_body(f);
+        }
+
+        return n;
+    }
+
+    if (p == NULL) {
+        /* a header went by unseen, there is no telling where the next one
+         * starts */
+        f->state = FRAME_STREAM;
+        f->pos = 1;
+        return len;
+    }
+
+    for (n = 0; n < len; /* void */) {
+        frame_byte(f, p[n++]);
+
+        if (f->state == FRAME_BODY || f->state == FRAME_STREAM) {
+            break;
+        }
+    }
+
+    return n;
+}
+
+
+static void
+frame_byte(frame_t *f, unsigned char c)
+{
+    if (f->state == FRAME_CRLF) {
+        if (c == '\n') {
+            f->state = f->framer == FRAMER_HTTP ? FRAME_CHUNK : FRAME_HEADER;
+            f->pos = 0;
+            f->value = 0;
+            f->flags &= ~FRAME_NAME_DONE;
+        }
+
+        return;
+    }
+
+    switch (f->framer) {
+
+    case FRAMER_HTTP:
+        frame_http(f, c);
+        break;
+
+    case FRAMER_RESP:
+        frame_resp(f, c);
+        break;
+
+    case FRAMER_TLS:
+        /* content type, version, and the length in big endian */
+        if (f->pos == 0) {
+            f->value = 0;
+
+        } else if (f->pos >= 3) {
+            f->value = f->value << 8 | c;
+        }
+
+        if (++f->pos == 5) {
+            f->pos = 0;
+
+            if (f->value) {
+                start_body(f, f->value);
+            }
+        }
+
+        break;
+
+    case FRAMER_MYSQL:
+        /* the length in little endian, and the sequence number */
+        if (f->pos == 0) {
+            f->value = 0;
+        }
+
+        if (f->pos < 3) {
+            f->value |= (uint64_t) c << (8 * f->pos);
+        }
+
+        if (++f->pos == 4) {
+            f->pos = 0;
+
+            if (f->value) {
+                start_body(f, f->value);
+            }
+        }
+
+        break;
+    }
+}
+
+
+static void
+start_body(frame_t *f, uint64_t len)
+{
+    f->state = FRAME_BODY;
+    f->left = len;
+    f->pos = 0;
+}
+
+
+static void
+end_body(frame_t *f)
+{
+    f->pos = 0;
+    f->value = 0;
+
+    if (f->framer == FRAMER_RESP
+        || (f->framer == FRAMER_HTTP && (f->flags & FRAME_CHUNKED)))
+    {
+        f->state = FRAME_CRLF;
+        return;
+    }
+
+    f->state = FRAME_HEADER;
+}
+
+
+/* Follow the start line and the header fields of HTTP/1.x messages for the
+ * lengths of their bodies, and the size lines of chunked bodies */
+static void
+frame_http(frame_t *f, unsigned char c)
+{
+    int                  pos;
+    int                  d;
+    unsigned char        lc;
+
+    static const char    response[] = "HTTP/";
+    static const char    length[] = "content-length";
+    static const char    encoding[] = "transfer-encoding";
+    static const char    chunked[] = "chunked";
+
+    if (c == '\r') {
+        return;
+    }
+
+    if (f->state == FRAME_CHUNK) {
+        if (c == '\n') {
+            if (f->value) {
+                start_body(f, f->value);
+
+            } else {
+                f->state = FRAME_TRAILER;
+                f->pos = 0;
+            }
+
+            f->value = 0;
+            f->flags &= ~FRAME_NAME_DONE;
+            return;
+        }
+
+        if (f->flags & FRAME_NAME_DONE) {
+            /* chunk extensions */
+            return;
+        }
+
+        if (c >= '0' && c <= '9') {
+            d = c - '0';
+
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            d = (c | 0x20) - 'a' + 10;
+
+        } else {
+            f->flags |= FRAME_NAME_DONE;
+            return;
+        }
+
+        f->value = f->value << 4 | d;
+        return;
+    }
+
+    if (c == '\n') {
+        if (f->pos == 0) {
+            if (f->state == FRAME_TRAILER) {
+                f->state = FRAME_HEADER;
+                f->flags = 0;
+
+            } else if (f->flags & FRAME_STARTED) {
+                end_http_headers(f);
+            }
+
+            /* and empty lines before the start line are skipped */
+
+            return;
+        }
+
+        if ((f->flags & FRAME_IN_ENCODING) && f->match == sizeof(chunked) - 1)
+        {
+            f->flags |= FRAME_CHUNKED;
+        }
+
+        f->flags &= ~(FRAME_IN_LENGTH|FRAME_IN_ENCODING|FRAME_NAME_DONE);
+        f->flags |= FRAME_STARTED;
+        f->pos = 0;
+        f->match = 0;
+        return;
+    }
+
+    pos = f->pos;
+
+    if (f->pos < UINT16_MAX) {
+        f->pos++;
+    }
+
+    if (!(f->flags & FRAME_STARTED)) {
+        /* the version of a status line, then its status code */
+
+        if (pos < (int) sizeof(response) - 1) {
+            if (f->match == pos && c == response[pos]) {
+                f->match++;
+
+                if (f->match == sizeof(response) - 1) {
+                    f->flags |= FRAME_RESPONSE;
+                }
+            }
+
+        } else if (f->flags & FRAME_RESPONSE) {
+            if (c == ' ') {
+                f->flags |= FRAME_NAME_DONE;
+
+            } else if ((f->flags & FRAME_NAME_DONE)
+                       && c >= '0' && c <= '9' && f->status < 100)
+            {
+                f->status = f->status * 10 + (c - '0');
+            }
+        }
+
+        return;
+    }
+
+    lc = c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+
+    if (!(f->flags & FRAME_NAME_DONE)) {
+        if (pos == 0) {
+            f->match = 0x03;
+        }
+
+        if (c != ':') {
+            if (pos >= (int) sizeof(length) - 1 || lc != length[pos]) {
+                f->match &= ~0x01;
+            }
+
+            if (pos >= (int) sizeof(encoding) - 1 || lc != encoding[pos]) {
+                f->match &= ~0x02;
+            }
+
+            return;
+        }
+
+        f->flags |= FRAME_NAME_DONE;
+
+        if ((f->match & 0x01) && pos == sizeof(length) - 1) {
+            f->flags |= FRAME_IN_LENGTH;
+            f->value = 0;
+
+        } else if ((f->match & 0x02) && pos == sizeof(encoding) - 1) {
+            f->flags |= FRAME_IN_ENCODING;
+        }
+
+        f->match = 0;
+        return;
+    }
+
+    if (f->flags & FRAME_IN_LENGTH) {
+        if (c >= '0' && c <= '9') {
+            f->value = f->value * 10 + (c - '0');
+            f->flags |= FRAME_LENGTH;
+        }
+
+        return;
+    }
+
+    if ((f->flags & FRAME_IN_ENCODING) && f->match < sizeof(chunked) - 1) {
+        if (lc == chunked[f->match]) {
+            f->match++;
+
+        } else {
+            f->match = lc == chunked[0];
+        }
+    }
+}
+
+
+/* Tell from the header fields and the status how the body of a message is
+ * delimited; the responses to HEAD requests cannot be told apart, which
+ * only makes for splits in the wrong places */
+static void
+end_http_headers(frame_t *f)
+{
+    uint64_t             len;
+    int                  flags;
+    int                  status;
+
+    len = f->value;
+    flags = f->flags;
+    status = f->status;
+
+    f->pos = 0;
+    f->value = 0;
+    f->status = 0;
+    f->match = 0;
+    f->flags = 0;
+
+    if (status == 101) {
+        /* switched protocols */
+        f->state = FRAME_STREAM;
+        return;
+    }
+
+    if (status / 100 == 1 || status == 204 || status == 304) {
+        return;
+    }
+
+    if (flags & FRAME_CHUNKED) {
+        f->state = FRAME_CHUNK;
+        f->flags = FRAME_CHUNKED;
+        return;
+    }
+
+    if (flags & FRAME_LENGTH) {
+        if (len) {
+            start_body(f, len);
+        }
+
+        return;
+    }
+
+    if (flags & FRAME_RESPONSE) {
+        /* delimited by the end of the connection */
+        f->state = FRAME_STREAM;
+    }
+}
+
+
+/* Follow the lines of RESP for the lengths of the bulk strings, which are
+ * the only parts of Redis replies and commands not ending in "\r\n" */
+static void
+frame_resp(frame_t *f, unsigned char c)
+{
+    if (f->pos == 0) {
+        f->match = c;
+        f->value = 0;
+        f->flags = 0;
+
+    } else if (c >= '0' && c <= '9') {
+        f->value = f->value * 10 + (c - '0');
+
+    } else if (c == '-' && f->pos == 1) {
+        f->flags |= FRAME_NULL;
+    }
+
+    if (c != '\n') {
+        if (f->pos < UINT16_MAX) {
+            f->pos++;
+        }
+
+        return;
+    }
+
+    f->pos = 0;
+
+    if ((f->match == '$' || f->match == '=' || f->match == '!')
+        && !(f->flags & FRAME_NULL))
+    {
+        if (f->value) {
+            start_body(f, f->value);
+
+        } else {
+            f->state = FRAME_CRLF;
+        }
+    }
+}
+
+
+/* Parse MOCKEAGAIN_SPLIT, a list of stream offsets separated by commas or
+ * spaces, at each of which a single EAGAIN is injected */
+static void
+init_splits()
+{
+    const char          *p;
+    char                *end;
+    unsigned long long   v;
+    uint64_t            *t;
+    void                *pages;
+    int                  n;
+    int                  i;
+
+    p = get_config("MOCKEAGAIN_SPLIT");
+    if (p == NULL || *p == '\0') {
+        dd("MOCKEAGAIN_SPLIT env empty");
+        nsplits = 0;
+        return;
+    }
+
+    if (split_pages == NULL) {
+        if (fd_npages == 0) {
+            return;
+        }
+
+        pages = mmap(NULL, fd_npages * sizeof(fd_splits_t *),
+                     PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (pages == MAP_FAILED) {
+            fprintf(stderr, "mockeagain: ERROR: failed to allocate "
+                    "memory.\n");
+            return;
+        }
+
+        __atomic_store_n(&split_pages, pages, __ATOMIC_RELEASE);
+    }
+
+    /* a new table every time, like the one of MOCKEAGAIN_TARGET */
+
+    t = calloc(MAX_SPLITS, sizeof(uint64_t));
+    if (t == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return;
+    }
+
+    n = 0;
+
+    for ( ;; ) {
+        while (*p == ',' || *p == ' ') {
+            p++;
+        }
+
+        if (*p == '\0') {
+            break;
+        }
+
+        v = strtoull(p, &end, 10);
+
+        if (end == p || (*end != '\0' && *end != ',' && *end != ' ')) {
+            fprintf(stderr, "mockeagain: bad MOCKEAGAIN_SPLIT value \"%s\", "
+                    "ignored.\n", p);
+            free(t);
+            return;
+        }
+
+        p = end;
+
+        if (n == MAX_SPLITS) {
+            fprintf(stderr, "mockeagain: too many MOCKEAGAIN_SPLIT offsets, "
+                    "ignoring the ones from %llu on.\n", v);
+            break;
+        }
+
+        /* kept sorted, without duplicates */
+
+        for (i = n; i > 0 && t[i - 1] > v; i--) {
+            t[i] = t[i - 1];
+        }
+
+        if (i > 0 && t[i - 1] == v) {
+            memmove(&t[i], &t[i + 1], (n - i) * sizeof(uint64_t));
+            continue;
+        }
+
+        t[i] = v;
+        n++;
+    }
+
+    __atomic_store_n(&splits, t, __ATOMIC_RELEASE);
+    __atomic_store_n(&nsplits, n, __ATOMIC_RELEASE);
+
+    if (verbose) {
+        fprintf(stderr, "mockeagain: splitting the mocked streams at %d "
+                "offsets\n", n);
+    }
+}
+
+
+static split_t *
+get_split(int fd, int dir, int create)
+{
+    fd_splits_t        **pages;
+    fd_splits_t         *fsp;
+
+    pages = __atomic_load_n(&split_pages, __ATOMIC_ACQUIRE);
+    if (pages == NULL) {
+        return NULL;
+    }
+
+    fsp = get_page_entry((void **) pages, fd, sizeof(fd_splits_t), create);
+    if (fsp == NULL) {
+        return NULL;
+    }
+
+    return dir == MOCKING_WRITES ? &fsp->write : &fsp->read;
+}
+
+
+static void
+reset_splits(int fd)
+{
+    fd_splits_t        **pages;
+    fd_splits_t         *fsp;
+
+    pages = __atomic_load_n(&split_pages, __ATOMIC_ACQUIRE);
+    if (pages == NULL) {
+        return;
+    }
+
+    fsp = get_page_entry((void **) pages, fd, sizeof(fd_splits_t), 0);
+    if (fsp) {
+        memset(fsp, 0, sizeof(fd_splits_t));
+    }
+}
+
+
+/* Move the stream of fd on by n bytes, counting the split offsets it
+ * stops at */
+static void
+advance_split(int api, int fd, int dir, size_t n)
+{
+    int                  i;
+    int                  nt;
+    uint64_t            *t;
+    split_t             *sp;
+
+    sp = get_split(fd, dir, 1);
+    if (sp == NULL) {
+        return;
+    }
+
+    sp->offset += n;
+
+    if (!stats) {
+        return;
+    }
+
+    nt = __atomic_load_n(&nsplits, __ATOMIC_ACQUIRE);
+    t = __atomic_load_n(&splits, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < nt && t[i] <= sp->offset; i++) {
+        if (t[i] == sp->offset) {
+            add_stat(api, fd, STAT_SPLIT, 1);
+            break;
+        }
+    }
+}
+
+
+/* Let the data through up to the next split offset, and fake a single
+ * EAGAIN once the stream is there; the offsets gone past while the fd was
+ * not mocked yet are missed */
+static size_t
+get_split_budget(int api, int fd, int dir, split_t *sp, size_t len)
+{
+    int                  i;
+    int                  n;
+    uint64_t            *t;
+    uint64_t             off;
+
+    n = __atomic_load_n(&nsplits, __ATOMIC_ACQUIRE);
+    t = __atomic_load_n(&splits, __ATOMIC_ACQUIRE);
+    off = sp->offset;
+
+    for (i = 0; i < n; i++) {
+        if (t[i] < off || t[i] + 1 == sp->done) {
+            continue;
+        }
+
+        if (t[i] == off) {
+            sp->done = off + 1;
+
+            log_event(LOG_SPLIT, api, fd, off, 0, 0, dir);
+
+            if (off == 0) {
+                /* reached by every stream, see advance_split() */
+                count_stat(api, fd, STAT_SPLIT, 1);
+            }
+
+            return 0;
+        }
+
+        return t[i] - off < len ? (size_t) (t[i] - off) : len;
+    }
+
+    return len;
+}
+
+
+/* Parse MOCKEAGAIN_TARGET, a list of rules separated by commas or spaces,
+ * each of the form "[upstream:|downstream:]address", where the address
+ * is a port, an IPv4 address, an IPv6 one in brackets or an AF_UNIX path,
+ * the IP addresses optionally followed by ":port" */
+static void
+init_targets()
+{
+    const char          *p;
+    const char          *end;
+    size_t               len;
+    int                  n;
+    uint16_t             gen;
+    target_t            *t;
+
+    p = get_config("MOCKEAGAIN_TARGET");
+    if (p == NULL || *p == '\0') {
+        dd("MOCKEAGAIN_TARGET env empty");
+        __atomic_store_n(&ntargets, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    /* a new table every time, all of it zeroed, so that a lookup racing
+     * with MOCKEAGAIN_CONTROL sees either table with any of the counts */
+
+    t = calloc(MAX_TARGETS, sizeof(target_t));
+    if (t == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return;
+    }
+
+    n = 0;
+
+    for ( ;; ) {
+        while (*p == ',' || *p == ' ') {
+            p++;
+        }
+
+        if (*p == '\0') {
+            break;
+        }
+
+        end = p;
+        while (*end && *end != ',' && *end != ' ') {
+            end++;
+        }
+
+        len = end - p;
+
+        if (n == MAX_TARGETS) {
+            fprintf(stderr, "mockeagain: too many MOCKEAGAIN_TARGET rules, "
+                    "ignoring \"%.*s\" and the rest.\n", (int) len, p);
+            break;
+        }
+
+        if (parse_target(&t[n], p, len) == 0) {
+            n++;
+
+        } else {
+            fprintf(stderr, "mockeagain: bad MOCKEAGAIN_TARGET rule "
+                    "\"%.*s\", ignored.\n", (int) len, p);
+        }
+
+        p = end;
+    }
+
+    if (n == 0) {
+        /* no valid rules would not mean everything */
+        fprintf(stderr, "mockeagain: no valid MOCKEAGAIN_TARGET rules, "
+                "mocking nothing.\n");
+
+        memset(&t[0], 0, sizeof(target_t));
+        n = 1;
+    }
+
+    /* the table replaced is never freed, other threads may still be
+     * looking at it */
+
+    __atomic_store_n(&targets, t, __ATOMIC_RELEASE);
+    __atomic_store_n(&ntargets, n, __ATOMIC_RELEASE);
+
+    /* the connections already open are matched again when next seen */
+
+    gen = targets_generation + 1;
+    if (gen == 0) {
+        gen = 1;
+    }
+
+    __atomic_store_n(&targets_generation, gen, __ATOMIC_RELEASE);
+
+    if (verbose) {
+        fprintf(stderr, "mockeagain: mocking only the fds of %d "
+                "MOCKEAGAIN_TARGET rules\n", n);
+    }
+}
+
+
+static int
+parse_target(target_t *t, const char *p, size_t len)
+{
+    char                 buf[128];
+    char                *host, *port, *end;
+    unsigned long        n;
+
+    memset(t, 0, sizeof(target_t));
+
+    t->roles = TARGET_UPSTREAM|TARGET_DOWNSTREAM;
+    t->family = AF_UNSPEC;
+
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+
+    host = buf;
+
+    if (strncmp(host, "upstream", 8) == 0
+        && (host[8] == ':' || host[8] == '\0'))
+    {
+        t->roles = TARGET_UPSTREAM;
+        host += host[8] ? 9 : 8;
+
+    } else if (strncmp(host, "downstream", 10) == 0
+               && (host[10] == ':' || host[10] == '\0'))
+    {
+        t->roles = TARGET_DOWNSTREAM;
+        host += host[10] ? 11 : 10;
+    }
+
+    if (*host == '\0') {
+        return 0;
+    }
+
+    if (*host == '/') {
+        t->family = AF_UNIX;
+        t->path = strdup(host);
+        return t->path ? 0 : -1;
+    }
+
+    port = NULL;
+
+    if (*host == '[') {
+        end = strchr(host, ']');
+        if (end == NULL || (end[1] != '\0' && end[1] != ':')) {
+            return -1;
+        }
+
+        *end = '\0';
+        port = end[1] ? end + 2 : NULL;
+        host++;
+
+        if (inet_pton(AF_INET6, host, t->addr) != 1) {
+            return -1;
+        }
+
+        t->family = AF_INET6;
+
+    } else if (strspn(host, "0123456789") == strlen(host)) {
+        port = host;
+
+    } else {
+        port = strchr(host, ':');
+        if (port) {
+            *port++ = '\0';
+        }
+
+        if (strcmp(host, "*") == 0) {
+            /* any address */
+
+        } else if (inet_pton(AF_INET, host, t->addr) == 1) {
+            t->family = AF_INET;
+
+        } else {
+            return -1;
+        }
+    }
+
+    if (port) {
+        n = strtoul(port, &end, 10);
+        if (end == port || *end != '\0' || n == 0 || n > 65535) {
+            return -1;
+        }
+
+        t->port = (int) n;
+    }
+
+    return 0;
+}
+
+
+/* Whether the server end of a connection in the given role matches any of
+ * the MOCKEAGAIN_TARGET rules; sets the port of that end, 0 if none */
+static int
+match_target(int role, const struct sockaddr *sa, socklen_t len, int *port)
+{
+    int                  i;
+    int                  n;
+    int                  family;
+    const unsigned char *addr;
+    const char          *path;
+    target_t            *t;
+    target_t            *tt;
+
+    const struct sockaddr_in   *sin;
+    const struct sockaddr_in6  *sin6;
+    const struct sockaddr_un   *sun;
+
+    *port = 0;
+    addr = NULL;
+    path = NULL;
+    family = sa->sa_family;
+
+    switch (family) {
+
+    case AF_INET:
+        sin = (const struct sockaddr_in *) sa;
+        addr = (const unsigned char *) &sin->sin_addr;
+        *port = ntohs(sin->sin_port);
+        break;
+
+    case AF_INET6:
+        sin6 = (const struct sockaddr_in6 *) sa;
+        addr = (const unsigned char *) &sin6->sin6_addr;
+        *port = ntohs(sin6->sin6_port);
+
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            family = AF_INET;
+            addr += 12;
+        }
+
+        break;
+
+    case AF_UNIX:
+        sun = (const struct sockaddr_un *) sa;
+
+        if (len > offsetof(struct sockaddr_un, sun_path)) {
+            path = sun->sun_path;
+        }
+
+        break;
+
+    default:
+        return 0;
+    }
+
+    n = __atomic_load_n(&ntargets, __ATOMIC_ACQUIRE);
+    tt = __atomic_load_n(&targets, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < n; i++) {
+        t = &tt[i];
+
+        if (!(t->roles & role)) {
+            continue;
+        }
+
+        if (t->family == AF_UNIX) {
+            if (path && strncmp(path, t->path, len
+                                - offsetof(struct sockaddr_un, sun_path))
+                        == 0)
+            {
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (t->port && t->port != *port) {
+            continue;
+        }
+
+        if (t->family == AF_UNSPEC) {
+            if (family == AF_INET || family == AF_INET6) {
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (t->family == family
+            && memcmp(t->addr, addr, family == AF_INET ? 4 : 16) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Add the tokens accumulated since the last refill. The timestamps wrap
+ * every 71 minutes, which at worst makes a bucket that stayed idle for
+ * that long refill a bit slower. */
+static void
+refill_bucket(bucket_t *b, int64_t now)
+{
+    uint32_t             t;
+    uint32_t             stamp;
+    int32_t              tokens;
+    int32_t              burst;
+    uint64_t             add;
+    uint64_t             r;
+
+    /* the rate may be changed through MOCKEAGAIN_CONTROL meanwhile */
+
+    r = rate;
+    burst = rate_burst;
+
+    if (r == 0) {
+        return;
+    }
+
+    t = (uint32_t) now;
+    if (t == 0) {
+        t = 1;
+    }
+
+    stamp = fd_load(b->stamp);
+
+    if (stamp == 0) {
+        fd_store(b->tokens, burst);
+        fd_store(b->stamp, t);
+        return;
+    }
+
+    add = (uint64_t) (uint32_t) (t - stamp) * r / 1000000;
+    if (add == 0) {
+        /* keep accumulating from the old stamp */
+        return;
+    }
+
+    tokens = fd_load(b->tokens);
+
+    if (tokens >= burst || add >= (uint64_t) (burst - tokens)) {
+        fd_store(b->tokens, burst);
+        fd_store(b->stamp, t);
+        return;
+    }
+
+    /* only account for the time the whole tokens took to accumulate */
+
+    stamp += (uint32_t) (add * 1000000 / r);
+
+    fd_store(b->tokens, tokens + (int32_t) add);
+    fd_store(b->stamp, stamp ? stamp : 1);
+}
+
+
+/* Returns the time in us until the bucket is full, or 0 if it already is */
+static int64_t
+get_bucket_wait(bucket_t *b, int64_t now)
+{
+    int32_t              tokens;
+    int32_t              burst;
+    uint64_t             r;
+
+    r = rate;
+    burst = rate_burst;
+
+    if (r == 0) {
+        return 0;
+    }
+
+    refill_bucket(b, now);
+
+    tokens = fd_load(b->tokens);
+
+    if (tokens >= burst) {
+        return 0;
+    }
+
+    return (int64_t) (((uint64_t) (burst - tokens) * 1000000 + r - 1) / r);
+}
+
+
+/* The number of bytes a mocked read or write of len bytes may transfer, as
+ * recorded in the trace being replayed or decided by decide_io_budget().
+ * Returns 0 if we should fake an EAGAIN. */
+static size_t
+get_io_budget(int api, int fd, fd_state_t *fs, int dir, size_t len)
+{
+    trace_record_t      *r;
+    size_t               budget;
+
+    if (replay && (r = get_replay_record(fd, dir == MOCKING_WRITES
+                                             ? REPLAY_WRITES : REPLAY_READS,
+                                         TRACE_BUDGET, len)))
+    {
+        budget = r->granted < len ? r->granted : len;
+
+    } else {
+        budget = decide_io_budget(api, fs, fd, dir, len);
+    }
+
+    trace_decision(api, fd, dir, TRACE_BUDGET, len, budget, 0);
+
+    return budget;
+}
+
+
+/* A single byte by default, up to the next split offset or message
+ * boundary when given, a random chunk in random mode, and no more than what
+ * the token bucket allows */
+static size_t
+decide_io_budget(int api, fd_state_t *fs, int fd, int dir, size_t len)
+{
+    bucket_t            *b;
+    int32_t              tokens;
+    size_t               budget;
+    frame_t             *f;
+    split_t             *sp;
+
+    if (nsplits && (sp = get_split(fd, dir, 1))) {
+        budget = get_split_budget(api, fd, dir, sp, len);
+        if (budget == 0) {
+            return 0;
+        }
+
+    } else if (framer && (f = get_frame(fd, dir, 1))) {
+        budget = get_frame_budget(f);
+
+    } else if (random_chunks) {
+        if (eagain_threshold && get_random(fs, fd, dir) < eagain_threshold) {
+            return 0;
+        }
+
+        budget = chunk_min;
+
+        if (chunk_max > chunk_min) {
+            budget += get_random(fs, fd, dir) % (chunk_max - chunk_min + 1);
+        }
+
+    } else if (rate) {
+        budget = len;
+
+    } else {
+        return 1;
+    }
+
+    if (rate) {
+        b = dir == MOCKING_WRITES ? &fs->wbucket : &fs->rbucket;
+
+        refill_bucket(b, now_us());
+
+        tokens = fd_load(b->tokens);
+
+        /* a ready fd always has tokens left, see consume_io_budget() */
+
+        if (tokens > 0 && (size_t) tokens < budget) {
+            budget = (size_t) tokens;
+        }
+    }
+
+    return budget < len ? budget : len;
+}
+
+
+/* Account for a mocked transfer, and withdraw the readiness of the fd once
+ * it has used up its budget so that it has to be polled again */
+static void
+consume_io_budget(int api, int fd, fd_state_t *fs, int dir, size_t len,
+    ssize_t n)
+{
+    bucket_t            *b;
+    int32_t              tokens;
+    trace_record_t      *r;
+    int                  withdraw = 1;
+
+    if (n > 0) {
+        count_stat(api, fd, dir == MOCKING_WRITES ? STAT_WBYTES : STAT_RBYTES,
+                   (uint64_t) n);
+
+        if ((size_t) n < len) {
+            count_stat(api, fd, STAT_PARTIAL, 1);
+        }
+
+        if (rate) {
+            b = dir == MOCKING_WRITES ? &fs->wbucket : &fs->rbucket;
+
+            tokens = fd_load(b->tokens) - (int32_t) n;
+            fd_store(b->tokens, tokens);
+
+            withdraw = tokens <= 0;
+
+        } else if (nsplits || (random_chunks && !framer)) {
+            /* only the injected EAGAINs make us poll again */
+            withdraw = 0;
+        }
+    }
+
+    if (replay && (r = get_replay_record(fd, dir == MOCKING_WRITES
+                                             ? REPLAY_WRITES : REPLAY_READS,
+                                         TRACE_CONSUME, len)))
+    {
+        withdraw = r->arg;
+    }
+
+    trace_decision(api, fd, dir, TRACE_CONSUME, len, n > 0 ? n : 0,
+                   withdraw);
+
+    if (withdraw) {
+        fd_clear(fs->active, dir == MOCKING_WRITES ? POLLOUT : POLLIN);
+    }
+}
+
+
+/* Make a mocked read or write fail with EAGAIN until the fd gets polled
+ * again */
+static ssize_t
+fake_eagain(int api, int fd, fd_state_t *fs, int dir)
+{
+    count_stat(api, fd, STAT_EAGAIN, 1);
+
+    log_event(LOG_EAGAIN, api, fd, 0, 0, 0, 0);
+
+    trace_decision(api, fd, dir, TRACE_EAGAIN, 0, 0, 0);
+
+    fd_clear(fs->active, dir == MOCKING_WRITES ? POLLOUT : POLLIN);
+
+    rearm_epoll(fd, fs);
+
+    errno = EAGAIN;
+    return -1;
+}
+
+
+/* The next number from the PRNG of fd for the given direction. Each stream
+ * is seeded from MOCKEAGAIN_SEED, the fd and the direction only, so a run
+ * can be reproduced exactly by passing its seed again. */
+static uint32_t
+get_random(fd_state_t *fs, int fd, int dir)
+{
+    uint32_t            *state;
+    uint32_t             z;
+
+    state = dir == MOCKING_WRITES ? &fs->wrandom : &fs->rrandom;
+
+    z = *state;
+
+    if (z == 0) {
+        z = random_seed ^ ((uint32_t) fd * 0x9e3779b9)
+            ^ ((uint32_t) dir * 0x85ebca6b);
+    }
+
+    /* a Weyl sequence scrambled by the murmur3 finalizer */
+
+    z += 0x9e3779b9;
+    *state = z ? z : 1;
+
+    z = (z ^ (z >> 16)) * 0x85ebca6b;
+    z = (z ^ (z >> 13)) * 0xc2b2ae35;
+
+    return z ^ (z >> 16);
+}
+
+
+/* the total length of the slots of iov */
+static size_t
+get_iov_len(const struct iovec *iov, int iovcnt)
+{
+    int                  i;
+    size_t               len = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    return len;
+}
+
+
+/* Cut a batch of messages down to the budget: returns the number of whole
+ * messages fitting into it, or 0 after setting up in first a copy of the
+ * first message with its iovec clamped into iov, so that it gets split at
+ * a byte boundary instead; the data itself is never copied */
+static unsigned int
+clamp_mmsg(struct mmsghdr *msgvec, unsigned int vlen, size_t budget,
+    struct mmsghdr *first, struct iovec *iov, int niov)
+{
+    unsigned int         i;
+    size_t               len;
+    size_t               total = 0;
+    struct msghdr       *msg;
+
+    for (i = 0; i < vlen; i++) {
+        msg = &msgvec[i].msg_hdr;
+        len = get_iov_len(msg->msg_iov, (int) msg->msg_iovlen);
+
+        if (total + len > budget) {
+            break;
+        }
+
+        total += len;
+    }
+
+    if (i) {
+        return i;
+    }
+
+    *first = msgvec[0];
+
+    first->msg_hdr.msg_iov = iov;
+    first->msg_hdr.msg_iovlen = clamp_iov(msgvec[0].msg_hdr.msg_iov,
+                                          (int) msgvec[0].msg_hdr.msg_iovlen,
+                                          budget, iov, niov);
+
+    return 0;
+}
+
+
+/* Feed the first n messages transferred in a batch to the pattern matcher
+ * and the framer, and return the total number of bytes in them */
+static size_t
+match_mmsg(int api, int fd, fd_state_t *fs, int dir,
+    struct mmsghdr *msgvec, int n)
+{
+    int                  i;
+    size_t               total = 0;
+    matcher_t           *m;
+    struct msghdr       *msg;
+
+    m = dir == MOCKING_WRITES ? write_matcher : read_matcher;
+
+    for (i = 0; i < n; i++) {
+        msg = &msgvec[i].msg_hdr;
+        total += msgvec[i].msg_len;
+
+        if (scans_data(m) && msgvec[i].msg_len) {
+            scan_data(api, fd, fs, dir, msg->msg_iov,
+                      (int) msg->msg_iovlen, msgvec[i].msg_len);
+        }
+    }
+
+    return total;
+}
+
+
+/* Fill out with the leading slots of iov covering at most budget bytes, and
+ * return the number of slots used */
+static int
+clamp_iov(const struct iovec *iov, int iovcnt, size_t budget,
+    struct iovec *out, int nout)
+{
+    int                  i;
+    int                  n = 0;
+
+    for (i = 0; i < iovcnt && budget && n < nout; i++) {
+        if (iov[i].iov_base == NULL || iov[i].iov_len == 0) {
+            continue;
+        }
+
+        out[n].iov_base = iov[i].iov_base;
+        out[n].iov_len = iov[i].iov_len < budget ? iov[i].iov_len : budget;
+
+        budget -= out[n].iov_len;
+        n++;
+    }
+
+    return n;
+}
+
+
+/* Account for the n bytes just transferred by iov in the direction dir of
+ * fd; a NULL iov stands for bytes moved by sendfile() or splice() that we
+ * never get to see */
+static void
+scan_data(int api, int fd, fd_state_t *fs, int dir,
+    const struct iovec *iov, int iovcnt, size_t n)
+{
+    if (nsplits) {
+        advance_split(api, fd, dir, n);
+    }
+
+    if (framer) {
+        run_framer(api, fd, dir, iov, iovcnt, n);
+    }
+
+    match_patterns(api, fd, fs, dir, iov, iovcnt, n);
+}
+
+
+/* Feed the n bytes just transferred by iov to the pattern matcher of fd
+ * for the direction dir, and carry out the actions of the patterns found */
+static void
+match_patterns(int api, int fd, fd_state_t *fs, int dir,
+    const struct iovec *iov, int iovcnt, size_t n)
+{
+    const unsigned char *p;
+    size_t               len;
+    size_t               pos;
+    int                  i;
+    int                  k;
+    matcher_t           *m;
+    uint32_t            *state;
+    uint32_t             s;
+    mock_pattern_t      *pat;
+
+    if (dir == MOCKING_WRITES) {
+        m = __atomic_load_n(&write_matcher, __ATOMIC_ACQUIRE);
+        state = &fs->wmatch;
+
+    } else {
+        m = __atomic_load_n(&read_matcher, __ATOMIC_ACQUIRE);
+        state = &fs->rmatch;
+    }
+
+    if (m->npatterns == 0) {
+        /* just dropped through MOCKEAGAIN_CONTROL */
+        return;
+    }
+
+    if (fd_load(fs->mgen) != m->generation) {
+        /* the states are left over from the patterns replaced */
+        fd_store(fs->wmatch, 0);
+        fd_store(fs->rmatch, 0);
+        fd_store(fs->mgen, m->generation);
+    }
+
+    /* another thread still running the old matchers on this fd may have
+     * written back one of their states since, so make sure it is a row of
+     * ours before using it */
+
+    s = fd_load(*state);
+    if (s >= m->size || s % m->nclasses) {
+        s = 0;
+    }
+
+    for (i = 0; i < iovcnt && n; i++) {
+        p = iov[i].iov_base;
+        len = iov[i].iov_len < n ? iov[i].iov_len : n;
+        n -= len;
+
+        while (len) {
+            k = run_matcher(m, &s, p, len, &pos);
+
+            p += pos;
+            len -= pos;
+
+            if (k < 0) {
+                break;
+            }
+
+            pat = &m->patterns[k];
+
+            log_event(LOG_MATCH, api, fd, 0, 0, k, dir);
+
+            trace_decision(api, fd, dir, TRACE_MATCH, 0, 0, k);
+
+            if (dir == MOCKING_READS) {
+                apply_read_action(fd, fs, pat);
+                continue;
+            }
+
+            switch (pat->action) {
+
+            case PATTERN_HANG:
+                fd_store(fs->snd_timeout, 1);
+                break;
+
+            case PATTERN_RESET:
+                reset_connection(fd);
+                break;
+
+            case PATTERN_CLOSE:
+                (void) shutdown(fd, SHUT_RDWR);
+                break;
+            }
+        }
+    }
+
+    fd_store(*state, s);
+}
+
+
+/* The read patterns only take effect from the next read on, since the
+ * bytes up to the end of the buffer have been consumed already */
+static void
+apply_read_action(int fd, fd_state_t *fs, mock_pattern_t *pat)
+{
+    uint32_t             until;
+
+    if (fd_load(fs->rcv_fault) == PATTERN_ERROR) {
+        return;
+    }
+
+    switch (pat->action) {
+
+    case PATTERN_STALL:
+        until = 0;
+
+        if (pat->arg) {
+            until = (uint32_t) (now_us() / 1000) + (uint32_t) pat->arg;
+            if (until == 0) {
+                until = 1;
+            }
+        }
+
+        fd_store(fs->rcv_until, until);
+        fd_store(fs->rcv_fault, PATTERN_STALL);
+        break;
+
+    case PATTERN_ERROR:
+        fd_store(fs->rcv_errno, (unsigned char) (pat->arg > 0 && pat->arg < 256
+                                                 ? pat->arg : ECONNRESET));
+        fd_store(fs->rcv_fault, PATTERN_ERROR);
+
+        /* make the fd readable for good so that the error gets read */
+
+        (void) shutdown(fd, SHUT_RD);
+        break;
+    }
+}
+
+
+/* Returns 1 with errno set if a read on fd has to fail because of a read
+ * pattern found earlier */
+static int
+read_faulted(int api, int fd, fd_state_t *fs)
+{
+    switch (fd_load(fs->rcv_fault)) {
+
+    case PATTERN_ERROR:
+        log_event(LOG_FAIL, api, fd, fd_load(fs->rcv_errno), 0, 0, 0);
+
+        trace_decision(api, fd, MOCKING_READS, TRACE_FAIL, 0, 0,
+                       fd_load(fs->rcv_errno));
+
+        errno = fd_load(fs->rcv_errno);
+        return 1;
+
+    case PATTERN_STALL:
+        if (get_stall_wait(fs, now_us()) == 0) {
+            return 0;
+        }
+
+        (void) fake_eagain(api, fd, fs, MOCKING_READS);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Returns the us left of the read stall of fs, -1 if it never ends, or 0
+ * if it is over */
+static int64_t
+get_stall_wait(fd_state_t *fs, int64_t now)
+{
+    uint32_t             until;
+    int32_t              left;
+
+    if (fd_load(fs->rcv_fault) != PATTERN_STALL) {
+        return 0;
+    }
+
+    until = fd_load(fs->rcv_until);
+    if (until == 0) {
+        return -1;
+    }
+
+    left = (int32_t) (until - (uint32_t) (now / 1000));
+    if (left > 0) {
+        return (int64_t) left * 1000;
+    }
+
+    fd_store(fs->rcv_fault, 0);
+
+    return 0;
+}
+
+
+/* Abort the connection so that the peer sees a RST, falling back to an
+ * orderly shutdown for sockets other than TCP */
+static void
+reset_connection(int fd)
+{
+    struct sockaddr      sa;
+    int                  saved_errno;
+
+    saved_errno = errno;
+
+    memset(&sa, 0, sizeof(struct sockaddr));
+    sa.sa_family = AF_UNSPEC;
+
+    /* not through our own connect(), which would target the fd anew by
+     * the AF_UNSPEC address */
+
+    if ((*orig.connect)(fd, &sa, sizeof(struct sockaddr)) != 0) {
+        (void) shutdown(fd, SHUT_RDWR);
+    }
+
+    errno = saved_errno;
+}
+
+
+/* Load the write patterns from MOCKEAGAIN_WRITE_TIMEOUT_PATTERN and
+ * MOCKEAGAIN_WRITE_PATTERNS, and the read ones from
+ * MOCKEAGAIN_READ_PATTERNS */
+static void
+init_patterns()
+{
+    const char          *p;
+    matcher_t           *wm;
+    matcher_t           *rm;
+
+    wm = calloc(2, sizeof(matcher_t));
+    if (wm == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return;
+    }
+
+    rm = wm + 1;
+
+    matcher_generation++;
+    wm->generation = matcher_generation;
+    rm->generation = matcher_generation;
+
+    p = get_config("MOCKEAGAIN_WRITE_TIMEOUT_PATTERN");
+    if (p == NULL || *p == '\0') {
+        dd("write_timeout env empty");
+
+    } else {
+        if (verbose) {
+            fprintf(stderr, "mockeagain: reading write timeout pattern: %s\n",
+                p);
+        }
+
+        add_pattern(wm, (const unsigned char *) p, strlen(p),
+                    PATTERN_HANG, 0);
+    }
+
+    p = get_config("MOCKEAGAIN_WRITE_PATTERNS");
+    if (p && *p) {
+        parse_patterns(wm, "MOCKEAGAIN_WRITE_PATTERNS", p,
+                       write_actions,
+                       sizeof(write_actions) / sizeof(write_actions[0]));
+    }
+
+    if (wm->npatterns && !build_matcher(wm)) {
+        wm->npatterns = 0;
+    }
+
+    p = get_config("MOCKEAGAIN_READ_PATTERNS");
+    if (p && *p) {
+        parse_patterns(rm, "MOCKEAGAIN_READ_PATTERNS", p,
+                       read_actions,
+                       sizeof(read_actions) / sizeof(read_actions[0]));
+    }
+
+    if (rm->npatterns && !build_matcher(rm)) {
+        rm->npatterns = 0;
+    }
+
+    /* the matchers replaced are never freed, other threads may still be
+     * running them, or logging their patterns */
+
+    __atomic_store_n(&write_matcher, wm, __ATOMIC_RELEASE);
+    __atomic_store_n(&read_matcher, rm, __ATOMIC_RELEASE);
+}
+
+
+/* Parse a list of "action:pattern" entries separated by "|", where the
+ * actions are named by actions[1..nactions - 1]. Entries without a known
+ * action prefix use the first one. The usual C escapes, "\xHH" and "\|"
+ * are recognized in the patterns. */
+static void
+parse_patterns(matcher_t *m, const char *name, const char *spec,
+    const char **actions, int nactions)
+{
+    const char          *p;
+    const char          *q;
+    unsigned char       *buf;
+    size_t               len;
+    size_t               n;
+    int                  action;
+    int                  arg;
+    int                  i;
+    unsigned int         c;
+
+    buf = malloc(strlen(spec) + 1);
+    if (buf == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return;
+    }
+
+    p = spec;
+
+    while (*p) {
+        action = 1;
+        arg = 0;
+
+        for (i = 1; i < nactions; i++) {
+            n = strlen(actions[i]);
+
+            if (strncmp(p, actions[i], n) != 0) {
+                continue;
+            }
+
+            if (p[n] == ':') {
+                action = i;
+                p += n + 1;
+                break;
+            }
+
+            q = strchr(p + n, ':');
+
+            if (p[n] == '=' && q) {
+                arg = parse_pattern_arg(p + n + 1, q - p - n - 1);
+                if (arg < 0) {
+                    fprintf(stderr, "mockeagain: bad argument \"%.*s\" of "
+                            "the %s action in %s ignored.\n",
+                            (int) (q - p - n - 1), p + n + 1, actions[i],
+                            name);
+                    arg = 0;
+                }
+
+                action = i;
+                p = q + 1;
+                break;
+            }
+        }
+
+        len = 0;
+
+        while (*p && *p != '|') {
+            if (*p != '\\' || p[1] == '\0') {
+                buf[len++] = (unsigned char) *p++;
+                continue;
+            }
+
+            p++;
+
+            switch (*p) {
+            case 'n':
+                c = '\n';
+                break;
+
+            case 'r':
+                c = '\r';
+                break;
+
+            case 't':
+                c = '\t';
+                break;
+
+            case '0':
+                c = '\0';
+                break;
+
+            case 'x':
+                if (sscanf(p + 1, "%2x", &c) == 1) {
+                    p += 2;
+                    break;
+                }
+
+                /* fall through */
+
+            default:
+                c = (unsigned char) *p;
+                break;
+            }
+
+            buf[len++] = (unsigned char) c;
+            p++;
+        }
+
+        if (*p == '|') {
+            p++;
+        }
+
+        if (len == 0) {
+            fprintf(stderr, "mockeagain: empty pattern in %s ignored.\n",
+                    name);
+            continue;
+        }
+
+        if (verbose) {
+            fprintf(stderr, "mockeagain: adding %s pattern \"%.*s\"\n",
+                    actions[action], (int) len, buf);
+        }
+
+        if (!add_pattern(m, buf, len, action, arg)) {
+            break;
+        }
+    }
+
+    free(buf);
+}
+
+
+/* Parse the argument of an action, which is either a number, like the ms
+ * of a stall, or the name of an errno value */
+static int
+parse_pattern_arg(const char *p, size_t len)
+{
+    static const struct {
+        const char  *name;
+        int          value;
+    } errnos[] = {
+        { "ECONNRESET", ECONNRESET },
+        { "ECONNABORTED", ECONNABORTED },
+        { "ECONNREFUSED", ECONNREFUSED },
+        { "ETIMEDOUT", ETIMEDOUT },
+        { "EPIPE", EPIPE },
+        { "EIO", EIO },
+        { "ENETUNREACH", ENETUNREACH },
+        { "EHOSTUNREACH", EHOSTUNREACH },
+    };
+
+    size_t               i;
+    int                  n;
+
+    if (len == 0) {
+        return -1;
+    }
+
+    if (*p >= '0' && *p <= '9') {
+        n = 0;
+
+        for (i = 0; i < len; i++) {
+            if (p[i] < '0' || p[i] > '9' || n > (INT_MAX - 9) / 10) {
+                return -1;
+            }
+
+            n = n * 10 + (p[i] - '0');
+        }
+
+        return n;
+    }
+
+    for (i = 0; i < sizeof(errnos) / sizeof(errnos[0]); i++) {
+        if (strlen(errnos[i].name) == len
+            && strncmp(p, errnos[i].name, len) == 0)
+        {
+            return errnos[i].value;
+        }
+    }
+
+    return -1;
+}
+
+
+static int
+add_pattern(matcher_t *m, const unsigned char *data, size_t len, int action,
+    int arg)
+{
+    mock_pattern_t      *pats;
+    unsigned char       *copy;
+
+    pats = realloc(m->patterns, (m->npatterns + 1) * sizeof(mock_pattern_t));
+    copy = malloc(len);
+
+    if (pats == NULL || copy == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+
+        if (pats) {
+            m->patterns = pats;
+        }
+
+        free(copy);
+        return 0;
+    }
+
+    memcpy(copy, data, len);
+
+    m->patterns = pats;
+    m->patterns[m->npatterns].data = copy;
+    m->patterns[m->npatterns].len = len;
+    m->patterns[m->npatterns].action = action;
+    m->patterns[m->npatterns].arg = arg;
+    m->npatterns++;
+
+    return 1;
+}
+
+
+/* Compile the patterns of m into its DFA: build the trie, then resolve the
+ * failure links breadth first so that every missing transition points to
+ * where the longest matching suffix would continue */
+static int
+build_matcher(matcher_t *m)
+{
+    int                  i;
+    int                  c;
+    int                  n;
+    size_t               k;
+    uint32_t             s;
+    uint32_t             t;
+    uint32_t             nstates;
+    uint32_t             total;
+    uint32_t             head;
+    uint32_t             tail;
+    uint32_t            *delta;
+    uint32_t            *fail;
+    uint32_t            *queue;
+    int                 *match;
+    mock_pattern_t      *pat;
+    unsigned char        used[256];
+
+    memset(used, 0, sizeof(used));
+
+    n = 0;
+    total = 1;
+
+    for (i = 0; i < m->npatterns; i++) {
+        pat = &m->patterns[i];
+
+        for (k = 0; k < pat->len; k++) {
+            if (!used[pat->data[k]]) {
+                used[pat->data[k]] = 1;
+                n++;
+            }
+        }
+
+        total += (uint32_t) pat->len;
+    }
+
+    /* class 0 stands for all the bytes no pattern uses, if there are any,
+     * so that the classes always fit into a byte */
+
+    memset(m->classes, 0, sizeof(m->classes));
+
+    n = n < 256 ? 1 : 0;
+
+    for (c = 0; c < 256; c++) {
+        if (used[c]) {
+            m->classes[c] = (unsigned char) n++;
+        }
+    }
+
+    delta = malloc((size_t) total * n * sizeof(uint32_t));
+    match = malloc((size_t) total * sizeof(int));
+    fail = malloc((size_t) total * sizeof(uint32_t));
+    queue = malloc((size_t) total * sizeof(uint32_t));
+
+    if (delta == NULL || match == NULL || fail == NULL || queue == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        free(delta);
+        free(match);
+        free(fail);
+        free(queue);
+        return 0;
+    }
+
+    memset(delta, 0xff, (size_t) total * n * sizeof(uint32_t));
+
+    for (s = 0; s < total; s++) {
+        match[s] = -1;
+    }
+
+    nstates = 1;
+
+    for (i = 0; i < m->npatterns; i++) {
+        pat = &m->patterns[i];
+        s = 0;
+
+        for (k = 0; k < pat->len; k++) {
+            c = m->classes[pat->data[k]];
+
+            if (delta[s * n + c] == UINT32_MAX) {
+                delta[s * n + c] = nstates++;
+            }
+
+            s = delta[s * n + c];
+        }
+
+        if (match[s] < 0) {
+            match[s] = i;
+        }
+    }
+
+    head = 0;
+    tail = 0;
+
+    for (c = 0; c < n; c++) {
+        t = delta[c];
+
+        if (t == UINT32_MAX) {
+            delta[c] = 0;
+
+        } else {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+
+    while (head < tail) {
+        s = queue[head++];
+
+        /* a state also completes whatever its longest suffix completes */
+
+        if (match[s] < 0) {
+            match[s] = match[fail[s]];
+        }
+
+        for (c = 0; c < n; c++) {
+            t = delta[s * n + c];
+
+            if (t == UINT32_MAX) {
+                delta[s * n + c] = delta[fail[s] * n + c];
+
+            } else {
+                fail[t] = delta[fail[s] * n + c];
+                queue[tail++] = t;
+            }
+        }
+    }
+
+    /* switch to row offsets and flag the transitions completing a pattern */
+
+    for (k = 0; k < (size_t) nstates * n; k++) {
+        t = delta[k];
+        delta[k] = t * n | (match[t] >= 0 ? MATCH_FLAG : 0);
+    }
+
+    free(fail);
+    free(queue);
+
+    m->delta = delta;
+    m->match = match;
+    m->nclasses = n;
+    m->size = nstates * n;
+
+    dd("matcher: %d patterns, %u states, %d byte classes", m->npatterns,
+       nstates, n);
+
+    return 1;
+}
+
+
+/* Run up to len bytes through the matcher, stopping right after the first
+ * pattern completed. Returns the index of that pattern or -1, and the
+ * number of bytes consumed in pos. */
+static int
+run_matcher(matcher_t *m, uint32_t *state, const unsigned char *p,
+    size_t len, size_t *pos)
+{
+    uint32_t             s;
+    size_t               i;
+
+    s = *state;
+
+    for (i = 0; i < len; i++) {
+        s = m->delta[s + m->classes[p[i]]];
+
+        if (s & MATCH_FLAG) {
+            s &= ~MATCH_FLAG;
+
+            *state = s;
+            *pos = i + 1;
+
+            return m->match[s / m->nclasses];
+        }
+    }
+
+    *state = s;
+    *pos = len;
+
+    return -1;
+}
+
+
+/* Set up the statistics if MOCKEAGAIN_STATS or MOCKEAGAIN_STATS_SHM is
+ * set, and arrange for them to be dumped at exit or on a signal */
+static void
+init_stats()
+{
+    const char          *out;
+    const char          *shm;
+    const char          *sig;
+    size_t               size;
+    void                *p;
+    int                  fd;
+    int                  i;
+    int                  signo;
+    struct sigaction     sa;
+
+    out = getenv("MOCKEAGAIN_STATS");
+    if (out && (*out == '\0' || strcmp(out, "0") == 0)) {
+        out = NULL;
+    }
+
+    shm = getenv("MOCKEAGAIN_STATS_SHM");
+    if (shm && *shm == '\0') {
+        shm = NULL;
+    }
+
+    if (out == NULL && shm == NULL) {
+        return;
+    }
+
+    /* only the originals may be called from within the initialization */
+
+    size = sizeof(stats_header_t) + MAX_STATS_THREADS * sizeof(thread_stats_t);
+
+    if (shm) {
+        fd = shm_open(shm, O_RDWR|O_CREAT|O_TRUNC, 0600);
+
+        if (fd == -1 || ftruncate(fd, (off_t) size) != 0) {
+            fprintf(stderr, "mockeagain: failed to create the shared memory "
+                    "segment \"%s\": %s\n", shm, strerror(errno));
+
+            if (fd != -1) {
+                (void) (*orig.close)(fd);
+            }
+
+            return;
+        }
+
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+        (void) (*orig.close)(fd);
+
+    } else {
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                 -1, 0);
+    }
+
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return;
+    }
+
+    fd_stats_pages = mmap(NULL, fd_npages * sizeof(fd_stats_t *),
+                          PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                          -1, 0);
+    if (fd_stats_pages == MAP_FAILED) {
+        fd_stats_pages = NULL;
+    }
+
+    stats_slots = (thread_stats_t *) ((char *) p + sizeof(stats_header_t));
+
+    stats = p;
+    stats->version = STATS_VERSION;
+    stats->napis = API_MAX;
+    stats->nstats = STAT_MAX;
+    stats->nslots = MAX_STATS_THREADS;
+    stats->pid = (int32_t) getpid();
+
+    for (i = 0; i < API_MAX; i++) {
+        strncpy(stats->api_names[i], api_names[i], STATS_NAME_LEN - 1);
+    }
+
+    for (i = 0; i < STAT_MAX; i++) {
+        strncpy(stats->stat_names[i], stat_names[i], STATS_NAME_LEN - 1);
+    }
+
+    /* the magic goes last so that readers see a complete header */
+
+    __atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+    (void) pthread_atfork(NULL, NULL, reset_stats_in_child);
+
+    if (out == NULL) {
+        return;
+    }
+
+    if (strcmp(out, "1") == 0 || strcmp(out, "stderr") == 0) {
+        stats_fd = STDERR_FILENO;
+
+    } else {
+        stats_fd = open(out, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+        if (stats_fd == -1) {
+            fprintf(stderr, "mockeagain: failed to open the stats file "
+                    "\"%s\": %s\n", out, strerror(errno));
+            return;
+        }
+    }
+
+    atexit(dump_stats);
+
+    sig = getenv("MOCKEAGAIN_STATS_SIGNAL");
+    if (sig == NULL || *sig == '\0') {
+        return;
+    }
+
+    if (strncmp(sig, "SIG", 3) == 0) {
+        sig += 3;
+    }
+
+    if (strcmp(sig, "USR1") == 0) {
+        signo = SIGUSR1;
+
+    } else if (strcmp(sig, "USR2") == 0) {
+        signo = SIGUSR2;
+
+    } else {
+        signo = atoi(sig);
+    }
+
+    if (signo <= 0 || signo >= NSIG) {
+        fprintf(stderr, "mockeagain: bad MOCKEAGAIN_STATS_SIGNAL value "
+                "\"%s\" ignored.\n", sig);
+        return;
+    }
+
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = dump_stats_on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(signo, &sa, NULL) != 0) {
+        fprintf(stderr, "mockeagain: failed to install the handler of "
+                "signal %d: %s\n", signo, strerror(errno));
+    }
+}
+
+
+/* Count n more of stat for api in the block of the calling thread, and for
+ * fd if not -1. The blocks are claimed on first use and only ever written
+ * by their own threads, so no atomic read-modify-write is needed. */
+static void
+add_stat(int api, int fd, int stat, uint64_t n)
+{
+    thread_stats_t      *ts;
+    fd_stats_t          *fst;
+    uint64_t            *c;
+    uint32_t             i;
+
+    ts = thread_stats;
+
+    if (ts == NULL) {
+        i = __atomic_fetch_add(&stats->used, 1, __ATOMIC_RELAXED);
+        if (i >= MAX_STATS_THREADS) {
+            i = MAX_STATS_THREADS - 1;
+        }
+
+        ts = &stats_slots[i];
+
+        if (i < MAX_STATS_THREADS - 1) {
+            __atomic_store_n(&ts->pid, (int32_t) getpid(), __ATOMIC_RELEASE);
+        }
+
+        thread_stats = ts;
+    }
+
+    c = &ts->counters[api][stat];
+
+    if (ts == &stats_slots[MAX_STATS_THREADS - 1]) {
+        /* the overflow block is shared */
+        (void) __atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+
+    } else {
+        __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+    }
+
+    if (fd < 0 || fd_stats_pages == NULL) {
+        return;
+    }
+
+    /* an fd may be polled and read by different threads */
+
+    fst = get_page_entry((void **) fd_stats_pages, fd, sizeof(fd_stats_t), 1);
+    if (fst) {
+        (void) __atomic_fetch_add(&fst->counters[stat], n, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* A forked child claims blocks of its own, under its own pid, so that the
+ * counters of the workers of a server can be told apart in the shared
+ * segment, and starts over with the counters of its fds */
+static void
+reset_stats_in_child()
+{
+    int                  i;
+    fd_stats_t          *page;
+
+    thread_stats = NULL;
+
+    if (fd_stats_pages == NULL) {
+        return;
+    }
+
+    for (i = 0; i < fd_npages; i++) {
+        page = fd_stats_pages[i];
+        if (page) {
+            memset(page, 0, FD_PAGE_SIZE * sizeof(fd_stats_t));
+        }
+    }
+}
+
+
+/* Report and clear the statistics of an fd going away */
+static void
+flush_fd_stats(int fd, const char *why)
+{
+    fd_stats_t          *fst;
+    char                 buf[512];
+    int                  n;
+    int                  len;
+    int                  i;
+
+    if (fd_stats_pages == NULL) {
+        return;
+    }
+
+    fst = get_page_entry((void **) fd_stats_pages, fd, sizeof(fd_stats_t), 0);
+    if (fst == NULL) {
+        return;
+    }
+
+    if (stats_fd != -1) {
+        n = snprintf(buf, sizeof(buf), "mockeagain: stats of fd %d (%s):", fd,
+                     why);
+
+        len = format_stats(buf + n, sizeof(buf) - n, fst->counters);
+        if (len) {
+            write_stats(buf, n + len);
+        }
+    }
+
+    for (i = 0; i < STAT_MAX; i++) {
+        __atomic_store_n(&fst->counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* Write out the totals per API, and the statistics of the fds still
+ * open. The lines are put together by hand in a buffer on the stack and
+ * written out with the original write(), without snprintf() or anything
+ * else that is not async-signal-safe, so that this can run from the
+ * handler of MOCKEAGAIN_STATS_SIGNAL as well. */
+static void
+dump_stats()
+{
+    char                 buf[512];
+    uint64_t             sums[STAT_MAX];
+    uint32_t             nslots;
+    uint32_t             i;
+    int32_t              pid;
+    int                  api;
+    int                  k;
+    int                  n;
+    int                  len;
+    int                  fd;
+    fd_stats_t          *fst;
+
+    if (stats == NULL || stats_fd == -1) {
+        return;
+    }
+
+    pid = (int32_t) getpid();
+
+    n = append_str(buf, sizeof(buf), 0, "mockeagain: stats of process ");
+    n = append_uint(buf, sizeof(buf), n, (uint64_t) pid);
+    n = append_str(buf, sizeof(buf), n, ":\n");
+    write_stats(buf, n);
+
+    nslots = __atomic_load_n(&stats->used, __ATOMIC_RELAXED);
+    if (nslots > MAX_STATS_THREADS) {
+        nslots = MAX_STATS_THREADS;
+    }
+
+    for (api = 0; api < API_MAX; api++) {
+        memset(sums, 0, sizeof(sums));
+
+        for (i = 0; i < nslots; i++) {
+
+            /* the blocks of the parent and of the siblings are theirs to
+             * report, the overflow block is everybody's */
+
+            if (i < MAX_STATS_THREADS - 1
+                && __atomic_load_n(&stats_slots[i].pid, __ATOMIC_ACQUIRE)
+                   != pid)
+            {
+                continue;
+            }
+
+            for (k = 0; k < STAT_MAX; k++) {
+                sums[k] += __atomic_load_n(&stats_slots[i].counters[api][k],
+                                           __ATOMIC_RELAXED);
+            }
+        }
+
+        n = append_str(buf, sizeof(buf), 0, "mockeagain:   ");
+        n = append_str(buf, sizeof(buf), n, api_names[api]);
+        n = append_str(buf, sizeof(buf), n, ":");
+
+        len = format_stats(buf + n, sizeof(buf) - n, sums);
+        if (len) {
+            write_stats(buf, n + len);
+        }
+    }
+
+    if (fd_stats_pages == NULL) {
+        return;
+    }
+
+    for (fd = 0; (fd >> FD_PAGE_BITS) < fd_npages; fd += FD_PAGE_SIZE) {
+        if (__atomic_load_n(&fd_stats_pages[fd >> FD_PAGE_BITS],
+                            __ATOMIC_ACQUIRE) == NULL)
+        {
+            continue;
+        }
+
+        for (k = 0; k < FD_PAGE_SIZE; k++) {
+            fst = get_page_entry((void **) fd_stats_pages, fd + k,
+                                 sizeof(fd_stats_t), 0);
+
+            n = append_str(buf, sizeof(buf), 0, "mockeagain:   fd ");
+            n = append_uint(buf, sizeof(buf), n, (uint64_t) (fd + k));
+            n = append_str(buf, sizeof(buf), n, ":");
+
+            len = format_stats(buf + n, sizeof(buf) - n, fst->counters);
+            if (len) {
+                write_stats(buf, n + len);
+            }
+        }
+    }
+}
+
+
+static void
+dump_stats_on_signal(int signo)
+{
+    int                  saved_errno;
+
+    saved_errno = errno;
+
+    dump_stats();
+
+    errno = saved_errno;
+}
+
+
+/* Append the non-zero counters to buf, ending the line; returns the length
+ * added, or 0 if all of them are zero. Safe in a signal handler. */
+static int
+format_stats(char *buf, size_t size, const uint64_t *counters)
+{
+    int                  i;
+    int                  n = 0;
+    uint64_t             v;
+
+    for (i = 0; i < STAT_MAX; i++) {
+        v = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+
+        if (v == 0 || (size_t) n + 48 > size) {
+            continue;
+        }
+
+        if (n) {
+            n = append_str(buf, size, n, ",");
+        }
+
+        n = append_str(buf, size, n, " ");
+        n = append_str(buf, size, n, stat_names[i]);
+        n = append_str(buf, size, n, " ");
+        n = append_uint(buf, size, n, v);
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    buf[n++] = '\n';
+
+    return n;
+}
+
+
+/* Append s to the n bytes in buf as far as it fits, and return the new
+ * length; the stand-in for snprintf() in signal handlers */
+static int
+append_str(char *buf, size_t size, int n, const char *s)
+{
+    while (*s && (size_t) n < size) {
+        buf[n++] = *s++;
+    }
+
+    return n;
+}
+
+
+/* The same for v in decimal */
+static int
+append_uint(char *buf, size_t size, int n, uint64_t v)
+{
+    char                 digits[20];
+    int                  i = 0;
+
+    do {
+        digits[i++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    while (i && (size_t) n < size) {
+        buf[n++] = digits[--i];
+    }
+
+    return n;
+}
+
+
+static void
+write_stats(const char *buf, size_t len)
+{
+    ssize_t              n;
+
+    while (len) {
+        n = (*orig.write)(stats_fd, buf, len);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return;
+        }
+
+        buf += n;
+        len -= (size_t) n;
+    }
+}
+
+
+/* Set up where the verbose events go: by default they are formatted and
+ * written to stderr right away, while MOCKEAGAIN_LOG names a file that they
+ * are written to in batches from the log ring of each thread */
+static void
+init_log()
+{
+    const char          *p;
+
+    if (verbose <= 0) {
+        return;
+    }
+
+    p = getenv("MOCKEAGAIN_LOG");
+    if (p == NULL || *p == '\0') {
+        return;
+    }
+
+    if (pthread_key_create(&log_key, release_log_ring) != 0) {
+        fprintf(stderr, "mockeagain: failed to create the log key, "
+                "logging to stderr.\n");
+        return;
+    }
+
+    log_fd = open(p, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    if (log_fd == -1) {
+        fprintf(stderr, "mockeagain: failed to open the log file \"%s\": "
+                "%s, logging to stderr.\n", p, strerror(errno));
+        return;
+    }
+
+    p = getenv("MOCKEAGAIN_LOG_THREAD");
+    log_threaded = (p == NULL || *p != '0');
+
+    (void) pthread_atfork(NULL, NULL, reset_log_in_child);
+
+    atexit(drain_log);
+}
+
+
+/* Record a verbose event; this is all the work done in the hot path when
+ * logging to a file */
+static void
+add_log_record(int event, int api, int fd, int64_t a, int64_t b, int32_t c,
+    int32_t d)
+{
+    log_record_t         r;
+    log_ring_t          *ring;
+    uint32_t             head;
+    char                 buf[LOG_LINE_LEN];
+    int                  n;
+
+    r.time = 0;
+    r.a = a;
+    r.b = b;
+    r.c = c;
+    r.d = d;
+    r.fd = fd;
+    r.event = (uint16_t) event;
+    r.api = (uint16_t) api;
+
+    if (log_fd == -1) {
+        n = format_log_record(buf, sizeof(buf), &r);
+        write_log(STDERR_FILENO, buf, n);
+        return;
+    }
+
+    ring = log_ring;
+
+    if (ring == NULL) {
+        ring = claim_log_ring();
+        if (ring == NULL) {
+            (void) __atomic_fetch_add(&log_lost, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+        >= LOG_RING_SIZE)
+    {
+        if (log_threaded) {
+            (void) __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        /* without a flusher the producer makes room itself */
+
+        (void) pthread_mutex_lock(&log_mutex);
+        drain_log_ring(ring);
+        (void) pthread_mutex_unlock(&log_mutex);
+    }
+
+    r.time = now_us();
+    ring->records[head & (LOG_RING_SIZE - 1)] = r;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (!log_threaded) {
+        return;
+    }
+
+    if (!__atomic_load_n(&log_flusher_running, __ATOMIC_RELAXED)) {
+        start_log_flusher();
+
+    } else if (head - ring->tail == LOG_RING_SIZE / 4 * 3) {
+        (void) pthread_cond_signal(&log_cond);
+    }
+}
+
+
+/* Take a ring not owned by any live thread, or allocate a new one */
+static log_ring_t *
+claim_log_ring()
+{
+    log_ring_t          *ring;
+    log_ring_t          *expected;
+    int                  used;
+    int                  i;
+
+    for (i = 0; i < MAX_LOG_THREADS; i++) {
+        ring = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+
+        if (ring == NULL) {
+            ring = mmap(NULL, sizeof(log_ring_t), PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if (ring == MAP_FAILED) {
+                return NULL;
+            }
+
+            ring->slot = i;
+            ring->used = 1;
+
+            expected = NULL;
+
+            if (__atomic_compare_exchange_n(&log_rings[i], &expected, ring,
+                                            0, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            {
+                break;
+            }
+
+            /* another thread got this slot first */
+
+            (void) munmap(ring, sizeof(log_ring_t));
+            ring = expected;
+        }
+
+        used = 0;
+
+        if (__atomic_compare_exchange_n(&ring->used, &used, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if (i == MAX_LOG_THREADS) {
+        return NULL;
+    }
+
+    log_ring = ring;
+    (void) pthread_setspecific(log_key, ring);
+
+    return ring;
+}
+
+
+/* Flush the ring of a thread going away and hand it on to the next one */
+static void
+release_log_ring(void *data)
+{
+    log_ring_t          *ring = data;
+
+    (void) pthread_mutex_lock(&log_mutex);
+    drain_log_ring(ring);
+    (void) pthread_mutex_unlock(&log_mutex);
+
+    log_ring = NULL;
+
+    __atomic_store_n(&ring->used, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Start the flusher thread on the first record, and again in a forked
+ * child; if that fails, the producers drain their own rings instead */
+static void
+start_log_flusher()
+{
+    pthread_t            tid;
+    pthread_attr_t       attr;
+    sigset_t             all;
+    sigset_t             saved;
+    int                  expected = 0;
+
+    if (!__atomic_compare_exchange_n(&log_flusher_running, &expected, 1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    /* the flusher must not take the signals meant for the application */
+
+    sigfillset(&all);
+    (void) pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&tid, &attr, run_log_flusher, NULL) != 0) {
+        log_threaded = 0;
+    }
+
+    (void) pthread_attr_destroy(&attr);
+    (void) pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+
+static void *
+run_log_flusher(void *data)
+{
+    struct timespec      ts;
+
+    for ( ;; ) {
+        /* the condition variable goes by the real clock */
+
+        (*orig.clock_gettime)(CLOCK_REALTIME, &ts);
+
+        ts.tv_nsec += LOG_FLUSH_INTERVAL * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        (void) pthread_mutex_lock(&log_wait_mutex);
+        (void) (*orig.pthread_cond_timedwait)(&log_cond, &log_wait_mutex,
+                                              &ts);
+        (void) pthread_mutex_unlock(&log_wait_mutex);
+
+        drain_log();
+    }
+
+    return NULL;
+}
+
+
+/* Format the records in ring in batches and write them out; the caller
+ * holds log_mutex, which also guards log_buf */
+static void
+drain_log_ring(log_ring_t *ring)
+{
+    uint32_t             head;
+    uint32_t             tail;
+    uint32_t             dropped;
+    log_record_t        *r;
+    size_t               n = 0;
+    int                  len;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+
+    dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        n = snprintf(log_buf, LOG_LINE_LEN, "mockeagain: [%d] dropped %u "
+                     "records, the log ring was full.\n", ring->slot,
+                     dropped);
+    }
+
+    for ( /* void */ ; tail != head; tail++) {
+        if (sizeof(log_buf) - n < LOG_LINE_LEN) {
+            write_log(log_fd, log_buf, n);
+            n = 0;
+        }
+
+        r = &ring->records[tail & (LOG_RING_SIZE - 1)];
+
+        len = snprintf(log_buf + n, 32, "%lld.%06d [%d] ",
+                       (long long) (r->time / 1000000),
+                       (int) (r->time % 1000000), ring->slot);
+        n += len;
+
+        n += format_log_record(log_buf + n, LOG_LINE_LEN - len, r);
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    if (n) {
+        write_log(log_fd, log_buf, n);
+    }
+}
+
+
+/* Write out the records of all threads, from the flusher and at exit */
+static void
+drain_log()
+{
+    uint32_t             lost;
+    log_ring_t          *ring;
+    int                  n;
+    int                  i;
+
+    (void) pthread_mutex_lock(&log_mutex);
+
+    for (i = 0; i < MAX_LOG_THREADS; i++) {
+        ring = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        if (ring == NULL) {
+            break;
+        }
+
+        drain_log_ring(ring);
+    }
+
+    lost = __atomic_exchange_n(&log_lost, 0, __ATOMIC_RELAXED);
+    if (lost) {
+        n = snprintf(log_buf, LOG_LINE_LEN, "mockeagain: dropped %u records "
+                     "of threads beyond %d.\n", lost, MAX_LOG_THREADS);
+        write_log(log_fd, log_buf, n);
+    }
+
+    (void) pthread_mutex_unlock(&log_mutex);
+}
+
+
+/* The records inherited by a forked child are the parent's to write out,
+ * and the rings of the other threads are free again; the flusher did not
+ * survive the fork either */
+static void
+reset_log_in_child()
+{
+    log_ring_t          *ring;
+    int                  i;
+
+    (void) pthread_mutex_init(&log_mutex, NULL);
+    (void) pthread_mutex_init(&log_wait_mutex, NULL);
+    (void) pthread_cond_init(&log_cond, NULL);
+
+    for (i = 0; i < MAX_LOG_THREADS; i++) {
+        ring = log_rings[i];
+        if (ring == NULL) {
+            break;
+        }
+
+        ring->tail = ring->head;
+        ring->dropped = 0;
+
+        if (ring != log_ring) {
+            ring->used = 0;
+        }
+    }
+
+    log_lost = 0;
+    log_flusher_running = 0;
+}
+
+
+/* Format a verbose event into buf as a full line; returns its length */
+static int
+format_log_record(char *buf, size_t size, log_record_t *r)
+{
+    const char          *api = api_names[r->api];
+    const char          *action;
+    mock_pattern_t      *pat;
+    matcher_t           *m;
+    int                  n;
+
+    switch (r->event) {
+
+    case LOG_WRITE:
+    case LOG_READ:
+        n = snprintf(buf, size, "mockeagain: mocking \"%s\" on fd %d to %s "
+                     "%lld of %lld bytes", api, r->fd,
+                     r->event == LOG_WRITE ? "emit" : "read",
+                     (long long) r->a, (long long) r->b);
+
+        if (r->api == API_SENDMMSG || r->api == API_RECVMMSG) {
+            n += snprintf(buf + n, size - n, " in %d of %d messages",
+                          (int) r->c, (int) r->d);
+        }
+
+        n += snprintf(buf + n, size - n, ".\n");
+        break;
+
+    case LOG_SPLICE:
+        n = snprintf(buf, size, "mockeagain: mocking \"splice\" from fd %d "
+                     "to fd %d to move %lld of %lld bytes.\n", r->fd,
+                     (int) r->c, (long long) r->a, (long long) r->b);
+        break;
+
+    case LOG_EAGAIN:
+        n = snprintf(buf, size, "mockeagain: mocking \"%s\" on fd %d to "
+                     "signal EAGAIN.\n", api, r->fd);
+        break;
+
+    case LOG_MATCH:
+        m = r->d == MOCKING_READS ? read_matcher : write_matcher;
+
+        if ((int) r->c >= m->npatterns) {
+            /* replaced through MOCKEAGAIN_CONTROL since */
+            n = snprintf(buf, size, "mockeagain: \"%s\" has found a match "
+                         "for pattern %d on fd %d.\n", api, (int) r->c,
+                         r->fd);
+            break;
+        }
+
+        pat = &m->patterns[r->c];
+        action = r->d == MOCKING_READS ? read_actions[pat->action]
+                                       : write_actions[pat->action];
+
+        n = snprintf(buf, size, "mockeagain: \"%s\" has found a match for "
+                     "the %s pattern \"%.*s\" on fd %d.\n", api, action,
+                     (int) (pat->len < 128 ? pat->len : 128), pat->data,
+                     r->fd);
+        break;
+
+    case LOG_FAIL:
+        n = snprintf(buf, size, "mockeagain: mocking \"%s\" on fd %d to fail "
+                     "with errno %d.\n", api, r->fd, (int) r->a);
+        break;
+
+    case LOG_TIMEOUT:
+        n = snprintf(buf, size, "mockeagain: %s: emulating timeout.\n", api);
+        break;
+
+    case LOG_HANG:
+    case LOG_STALL:
+        n = snprintf(buf, size, "mockeagain: %s: should suppress %s event on "
+                     "fd %d.\n", api, r->event == LOG_HANG ? "write" : "read",
+                     r->fd);
+        break;
+
+    case LOG_HOLD:
+        n = snprintf(buf, size, "mockeagain: %s: holding back events on fd "
+                     "%d for the rate limit.\n", api, r->fd);
+        break;
+
+    case LOG_BYPASS:
+        n = snprintf(buf, size, "mockeagain: calling the original libc: "
+                     "'%s'\n", api);
+        break;
+
+    case LOG_POLLED:
+        n = snprintf(buf, size, "mockeagain: %s: fd %d polled with events "
+                     "%d\n", api, r->fd, (int) r->a);
+        break;
+
+    case LOG_EPOLL_CTL:
+        n = snprintf(buf, size, "mockeagain: epoll_ctl: %s fd %d in epoll "
+                     "instance %d with events %#x\n",
+                     r->c == EPOLL_CTL_ADD ? "added" : "modified", r->fd,
+                     (int) r->a, (unsigned) r->b);
+        break;
+
+    case LOG_WAIT_MORE:
+        n = snprintf(buf, size, "mockeagain: %s: all events suppressed, "
+                     "waiting for %d more ms on epoll instance %d.\n", api,
+                     (int) r->a, r->fd);
+        break;
+
+    case LOG_WARP:
+        n = snprintf(buf, size, "mockeagain: %s: warping the clock %lld us "
+                     "ahead instead of sleeping.\n", api, (long long) r->a);
+        break;
+
+    case LOG_SLEEP:
+        if (r->a == 3600 * 24 * 1000) {
+            n = snprintf(buf, size, "mockeagain: %s: sleeping 1 day.\n", api);
+
+        } else {
+            n = snprintf(buf, size, "mockeagain: %s: sleeping %d ms.\n", api,
+                         (int) r->a);
+        }
+
+        break;
+
+    case LOG_REARM:
+        n = snprintf(buf, size, "mockeagain: re-arming edge-triggered fd %d "
+                     "in epoll instance %d.\n", r->fd, (int) r->a);
+        break;
+
+    case LOG_FRAME:
+        n = snprintf(buf, size, "mockeagain: %s: the %s framer found a body "
+                     "of %lld bytes in the %s of fd %d.\n", api,
+                     r->c > 0 && r->c < FRAMER_MAX ? framer_names[r->c] : "",
+                     (long long) r->a,
+                     r->d == MOCKING_READS ? "reads" : "writes", r->fd);
+        break;
+
+    case LOG_SPLIT:
+        n = snprintf(buf, size, "mockeagain: mocking \"%s\" on fd %d to "
+                     "split the %s at offset %lld.\n", api, r->fd,
+                     r->d == MOCKING_READS ? "reads" : "writes",
+                     (long long) r->a);
+        break;
+
+    case LOG_TARGET:
+        n = snprintf(buf, size, "mockeagain: %s: %s fd %d to port %d %s.\n",
+                     api, r->c == TARGET_UPSTREAM ? "upstream" : "downstream",
+                     r->fd, (int) r->b,
+                     r->a ? "is a target" : "is no target, leaving it alone");
+        break;
+
+    default:
+        n = snprintf(buf, size, "mockeagain: unknown event %d.\n",
+                     (int) r->event);
+        break;
+    }
+
+    if (n < 0) {
+        return 0;
+    }
+
+    if ((size_t) n >= size) {
+        /* truncated, keep the line ending */
+        n = (int) size - 1;
+        buf[n - 1] = '\n';
+    }
+
+    return n;
+}
+
+
+/* Write out buf in full, leaving errno as the mocked call set it */
+static void
+write_log(int fd, const char *buf, size_t len)
+{
+    ssize_t              n;
+    int                  saved_errno;
+
+    saved_errno = errno;
+
+    while (len) {
+        n = (*orig.write)(fd, buf, len);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
         }
-#endif
 
-        if (matchbufs && matchbufs[fd]) {
-            free(matchbufs[fd]);
-            matchbufs[fd] = NULL;
+        if (n <= 0) {
+            break;
         }
 
-        active_fds[fd] = 0;
-        polled_fds[fd] = 0;
-        snd_timeout_fds[fd] = 0;
-        weird_fds[fd] = 0;
+        buf += n;
+        len -= (size_t) n;
     }
 
-    retval = (*orig_close)(fd);
-
-    return retval;
+    errno = saved_errno;
 }
 
 
-ssize_t
-send(int fd, const void *buf, size_t len, int flags)
+/* Set up the recording of the mocking decisions to MOCKEAGAIN_TRACE, and
+ * their replay from MOCKEAGAIN_REPLAY. The records go straight into a
+ * shared mapping of the file, so they survive a crash, and the forked
+ * children append to the same file. */
+static void
+init_trace()
 {
-    ssize_t                  retval;
-    static send_handle       orig_send = NULL;
+    const char          *p;
+    trace_header_t      *h;
+    size_t               size;
+    void                *m;
+    int                  fd;
+
+    p = getenv("MOCKEAGAIN_REPLAY");
+    if (p && *p != '\0') {
+        init_replay(p);
+    }
 
-    dd("calling my send");
+    p = getenv("MOCKEAGAIN_TRACE");
+    if (p == NULL || *p == '\0') {
+        goto done;
+    }
 
-    if (is_whitelist()) {
-        call_original("send", orig_send, fd, buf, len, flags);
-        return retval;
+    fd = open(p, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "mockeagain: failed to open the trace file \"%s\": "
+                "%s\n", p, strerror(errno));
+        goto done;
     }
 
-    if ((get_mocking_type() & MOCKING_WRITES)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && !(active_fds[fd] & POLLOUT))
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"send\" on fd %d to "
-                    "signal EAGAIN\n", fd);
-        }
+    size = sizeof(trace_header_t)
+           + (size_t) TRACE_MAX_RECORDS * sizeof(trace_record_t);
 
-        errno = EAGAIN;
-        return -1;
+    if (ftruncate(fd, (off_t) size) != 0) {
+        goto failed;
     }
 
-    init_libc_handle();
-
-    if (orig_send == NULL) {
-        orig_send = dlsym(libc_handle, "send");
-        if (orig_send == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying send: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
+    m = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        goto failed;
     }
 
-    if ((get_mocking_type() & MOCKING_WRITES)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && len)
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"send\" on fd %d to emit "
-                    "1 byte data only\n", fd);
-        }
+    /* no fd is kept open, so that the application gets the same fds when
+     * replaying */
 
-        retval = (*orig_send)(fd, buf, 1, flags);
-        active_fds[fd] &= ~POLLOUT;
+    (void) (*orig.close)(fd);
 
-    } else {
+    h = m;
+    h->magic = TRACE_MAGIC;
+    h->version = TRACE_VERSION;
+    h->record_size = sizeof(trace_record_t);
+    h->capacity = TRACE_MAX_RECORDS;
+    h->nprocs = 1;
 
-        dd("calling the original send on fd %d", fd);
+    trace_records = (trace_record_t *) (h + 1);
+    trace_nprocs = &h->nprocs;
+    trace = h;
 
-        retval = (*orig_send)(fd, buf, len, flags);
-    }
+    trace_decision(0, -1, 0, TRACE_PROC, 0, 0, (uint32_t) getpid());
 
-    return retval;
-}
+done:
 
+    if (replay && trace_nprocs == NULL) {
+        /* number the forked children as when recording */
 
-ssize_t
-read(int fd, void *buf, size_t len)
-{
-    ssize_t                  retval;
-    static read_handle       orig_read = NULL;
+        m = mmap(NULL, sizeof(uint32_t), PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if (m != MAP_FAILED) {
+            trace_nprocs = m;
+            *trace_nprocs = 1;
+        }
+    }
 
-    dd("calling my read");
+    if (trace || replay) {
+        (void) pthread_atfork(NULL, NULL, reset_trace_in_child);
+    }
 
-    if (is_whitelist()) {
-        call_original("read", orig_read, fd, buf, len);
-        return retval;
+    if (replay) {
+        atexit(report_replay);
     }
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && !(active_fds[fd] & POLLIN))
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"read\" on fd %d to "
-                    "signal EAGAIN\n", fd);
-        }
+    return;
 
-        errno = EAGAIN;
-        return -1;
-    }
+failed:
 
-    init_libc_handle();
+    fprintf(stderr, "mockeagain: failed to map the trace file \"%s\": %s\n",
+            p, strerror(errno));
 
-    if (orig_read == NULL) {
-        orig_read = dlsym(libc_handle, "read");
-        if (orig_read == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying read: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
-    }
+    (void) (*orig.close)(fd);
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && len)
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"read\" on fd %d to read "
-                    "1 byte only\n", fd);
-        }
+    goto done;
+}
 
-        dd("calling the original read on fd %d", fd);
 
-        retval = (*orig_read)(fd, buf, 1);
-        active_fds[fd] &= ~POLLIN;
+/* Load the trace to replay and index the decisions of this process */
+static void
+init_replay(const char *path)
+{
+    trace_header_t      *h;
+    struct stat          st;
+    uint64_t             n;
+    void                *m;
+    int                  fd;
+
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "mockeagain: failed to open the trace file \"%s\" "
+                "to replay: %s\n", path, strerror(errno));
+        return;
+    }
 
-    } else {
-        retval = (*orig_read)(fd, buf, len);
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(trace_header_t)) {
+        fprintf(stderr, "mockeagain: bad trace file \"%s\" to replay.\n",
+                path);
+        (void) (*orig.close)(fd);
+        return;
     }
 
-    return retval;
-}
+    m = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
+    (void) (*orig.close)(fd);
 
-ssize_t
-recv(int fd, void *buf, size_t len, int flags)
-{
-    ssize_t                  retval;
-    static recv_handle       orig_recv = NULL;
+    if (m == MAP_FAILED) {
+        fprintf(stderr, "mockeagain: failed to map the trace file \"%s\" "
+                "to replay: %s\n", path, strerror(errno));
+        return;
+    }
 
-    dd("calling my recv");
+    h = m;
 
-    if (is_whitelist()) {
-        call_original("recv", orig_recv, fd, buf, len, flags);
-        return retval;
+    if (h->magic != TRACE_MAGIC || h->version != TRACE_VERSION
+        || h->record_size != sizeof(trace_record_t))
+    {
+        fprintf(stderr, "mockeagain: bad trace file \"%s\" to replay.\n",
+                path);
+        (void) munmap(m, (size_t) st.st_size);
+        return;
     }
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && !(active_fds[fd] & POLLIN))
+    /* the records beyond the capacity were dropped, and the last ones may
+     * not have made it to the file */
+
+    n = h->count < h->capacity ? h->count : h->capacity;
+
+    if (n > ((size_t) st.st_size - sizeof(trace_header_t))
+            / sizeof(trace_record_t))
     {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"recv\" on fd %d to "
-                    "signal EAGAIN\n", fd);
-        }
+        n = ((size_t) st.st_size - sizeof(trace_header_t))
+            / sizeof(trace_record_t);
+    }
 
-        errno = EAGAIN;
-        return -1;
+    replay_records = (trace_record_t *) (h + 1);
+    replay_nrecords = (uint32_t) n;
+    replay_size = (size_t) st.st_size;
+    replay = h;
+
+    if (build_replay_index() != 0) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        (void) munmap(m, replay_size);
+        replay = NULL;
     }
+}
 
-    init_libc_handle();
 
-    if (orig_recv == NULL) {
-        orig_recv = dlsym(libc_handle, "recv");
-        if (orig_recv == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying recv: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
+/* Append a decision to the trace. Records beyond the capacity are counted
+ * but dropped. */
+static void
+add_trace_record(int api, int fd, int dir, int decision, uint64_t requested,
+    uint64_t granted, uint32_t arg)
+{
+    trace_record_t      *r;
+    uint64_t             i;
+
+    i = __atomic_fetch_add(&trace->count, 1, __ATOMIC_RELAXED);
+    if (i >= TRACE_MAX_RECORDS) {
+        return;
     }
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && len)
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"recv\" on fd %d to read "
-                    "1 byte only\n", fd);
-        }
+    r = &trace_records[i];
 
-        dd("calling the original recv on fd %d", fd);
+    r->fd = fd;
+    r->requested = requested < UINT32_MAX ? (uint32_t) requested : UINT32_MAX;
+    r->granted = granted < UINT32_MAX ? (uint32_t) granted : UINT32_MAX;
+    r->arg = arg;
+    r->api = (uint8_t) api;
+    r->dir = (uint8_t) dir;
+    r->decision = (uint8_t) decision;
+    r->proc = trace_proc;
+}
 
-        retval = (*orig_recv)(fd, buf, 1, flags);
-        active_fds[fd] &= ~POLLIN;
 
-    } else {
-        retval = (*orig_recv)(fd, buf, len, flags);
+/* The per-fd stream a recorded decision is replayed from, or -1 for the
+ * decisions that follow from the others */
+static int
+get_replay_stream(trace_record_t *r)
+{
+    switch (r->decision) {
+
+    case TRACE_BUDGET:
+    case TRACE_CONSUME:
+        return r->dir == MOCKING_WRITES ? REPLAY_WRITES : REPLAY_READS;
+
+    case TRACE_POLL:
+        return REPLAY_POLL;
     }
 
-    return retval;
+    return -1;
 }
 
 
-ssize_t
-recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+/* Group the decisions of the current process by fd and stream, in the
+ * order they were recorded */
+static int
+build_replay_index()
 {
-    ssize_t                  retval;
-    static recvfrom_handle   orig_recvfrom = NULL;
-
-    dd("calling my recvfrom");
+    trace_record_t      *r;
+    replay_stream_t     *rs;
+    uint32_t             i;
+    uint32_t             off;
+    int                  nfds = 0;
+    int                  fd;
+    int                  k;
+    void                *m;
+
+    if (replay_streams) {
+        (void) munmap(replay_streams, replay_nfds * sizeof(replay_stream_t));
+        replay_streams = NULL;
+        replay_nfds = 0;
+    }
 
-    if (is_whitelist()) {
-        call_original("recvfrom", orig_recvfrom,
-                      fd, buf, len, flags, src_addr, addrlen);
-        return retval;
+    if (replay_index) {
+        (void) munmap(replay_index, replay_nrecords * sizeof(uint32_t));
+        replay_index = NULL;
     }
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && !(active_fds[fd] & POLLIN))
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"recvfrom\" on fd %d to "
-                    "signal EAGAIN\n", fd);
+    for (i = 0; i < replay_nrecords; i++) {
+        r = &replay_records[i];
+
+        if (r->proc == trace_proc && r->fd >= nfds && r->fd < FD_LIMIT_MAX
+            && get_replay_stream(r) != -1)
+        {
+            nfds = r->fd + 1;
         }
+    }
 
-        errno = EAGAIN;
+    if (nfds == 0) {
+        return 0;
+    }
+
+    m = mmap(NULL, nfds * sizeof(replay_stream_t), PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
         return -1;
     }
 
-    init_libc_handle();
+    replay_streams = m;
+    replay_nfds = nfds;
 
-    if (orig_recvfrom == NULL) {
-        orig_recvfrom = dlsym(libc_handle, "recvfrom");
-        if (orig_recvfrom == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying recvfrom: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
+    m = mmap(NULL, replay_nrecords * sizeof(uint32_t), PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        return -1;
     }
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && len)
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"recvfrom\" on fd %d to read "
-                    "1 byte only\n", fd);
+    replay_index = m;
+
+    for (i = 0; i < replay_nrecords; i++) {
+        r = &replay_records[i];
+
+        if (r->proc == trace_proc && r->fd >= 0 && r->fd < nfds
+            && (k = get_replay_stream(r)) != -1)
+        {
+            replay_streams[r->fd].count[k]++;
         }
+    }
 
-        dd("calling the original recvfrom on fd %d", fd);
+    off = 0;
 
-        retval = (*orig_recvfrom)(fd, buf, 1, flags, src_addr, addrlen);
-        active_fds[fd] &= ~POLLIN;
+    for (fd = 0; fd < nfds; fd++) {
+        rs = &replay_streams[fd];
 
-    } else {
-        retval = (*orig_recvfrom)(fd, buf, len, flags, src_addr, addrlen);
+        for (k = 0; k < REPLAY_MAX; k++) {
+            rs->first[k] = off;
+            off += rs->count[k];
+            rs->count[k] = 0;
+        }
     }
 
-    return retval;
+    for (i = 0; i < replay_nrecords; i++) {
+        r = &replay_records[i];
+
+        if (r->proc == trace_proc && r->fd >= 0 && r->fd < nfds
+            && (k = get_replay_stream(r)) != -1)
+        {
+            rs = &replay_streams[r->fd];
+            replay_index[rs->first[k] + rs->count[k]++] = i;
+        }
+    }
+
+    return 0;
 }
 
 
-static int
-get_mocking_type() {
-    const char          *p;
+/* The next recorded decision of fd in stream, or NULL if there is none
+ * left or it is not the one expected, in which case the live state
+ * decides */
+static trace_record_t *
+get_replay_record(int fd, int stream, int decision, uint64_t requested)
+{
+    replay_stream_t     *rs;
+    trace_record_t      *r;
+    uint32_t             i;
 
-#if 1
-    if (mocking_type >= 0) {
-        return mocking_type;
+    if (fd < 0 || fd >= replay_nfds) {
+        goto missed;
     }
-#endif
 
-    mocking_type = 0;
+    rs = &replay_streams[fd];
 
-    p = getenv("MOCKEAGAIN");
-    if (p == NULL || *p == '\0') {
-        dd("MOCKEAGAIN env empty");
-        /* mocking_type = MOCKING_WRITES; */
-        return mocking_type;
+    i = __atomic_fetch_add(&rs->pos[stream], 1, __ATOMIC_RELAXED);
+    if (i >= rs->count[stream]) {
+        goto missed;
     }
 
-    while (*p) {
-        if (*p == 'r' || *p == 'R') {
-            mocking_type |= MOCKING_READS;
-
-        } else if (*p == 'w' || *p == 'W') {
-            mocking_type |= MOCKING_WRITES;
-        }
+    r = &replay_records[replay_index[rs->first[stream] + i]];
 
-        p++;
+    if (r->decision != decision) {
+        (void) __atomic_fetch_add(&replay_counts[1], 1, __ATOMIC_RELAXED);
+        return NULL;
     }
 
-    if (mocking_type == 0) {
-        mocking_type = MOCKING_WRITES;
+    if (r->requested != (requested < UINT32_MAX ? requested : UINT32_MAX)) {
+        /* the application asked for something else this time, replay the
+         * decision anyway */
+        (void) __atomic_fetch_add(&replay_counts[1], 1, __ATOMIC_RELAXED);
     }
 
-    dd("mocking_type %d", mocking_type);
+    (void) __atomic_fetch_add(&replay_counts[0], 1, __ATOMIC_RELAXED);
 
-    return mocking_type;
-}
+    return r;
 
+missed:
 
-static int
-get_verbose_level()
-{
-    const char          *p;
+    (void) __atomic_fetch_add(&replay_counts[2], 1, __ATOMIC_RELAXED);
 
-    if (verbose >= 0) {
-        return verbose;
-    }
+    return NULL;
+}
 
-    p = getenv("MOCKEAGAIN_VERBOSE");
-    if (p == NULL || *p == '\0') {
-        dd("MOCKEAGAIN_VERBOSE env empty");
-        verbose = 0;
-        return verbose;
-    }
 
-    if (*p >= '0' && *p <= '9') {
-        dd("MOCKEAGAIN_VERBOSE env value: %s", p);
-        verbose = *p - '0';
-        return verbose;
+static void
+report_replay()
+{
+    if (replay == NULL) {
+        return;
     }
 
-    dd("bad verbose env value: %s", p);
-    verbose = 0;
-    return verbose;
+    fprintf(stderr, "mockeagain: process %d replayed %llu decisions, %llu "
+            "of them mismatched, and %llu were not in the trace.\n",
+            (int) trace_proc,
+            (unsigned long long) replay_counts[0],
+            (unsigned long long) replay_counts[1],
+            (unsigned long long) replay_counts[2]);
 }
 
 
+/* A forked child gets the next process number, and replays the decisions
+ * recorded under it */
 static void
-init_matchbufs()
+reset_trace_in_child()
 {
-    const char          *p;
-    int                  len;
-
-    if (matchbufs != NULL) {
-        return;
-    }
+    uint32_t             n;
 
-    p = getenv("MOCKEAGAIN_WRITE_TIMEOUT_PATTERN");
-    if (p == NULL || *p == '\0') {
-        dd("write_timeout env empty");
-        matchbuf_len = 0;
-        return;
+    if (trace_nprocs) {
+        n = __atomic_fetch_add(trace_nprocs, 1, __ATOMIC_RELAXED);
+        trace_proc = n < MAX_TRACE_PROCS ? n : MAX_TRACE_PROCS;
     }
 
-    len = strlen(p);
+    trace_decision(0, -1, 0, TRACE_PROC, 0, 0, (uint32_t) getpid());
 
-    matchbufs = malloc((MAX_FD + 1) * sizeof(char *));
-    if (matchbufs == NULL) {
-        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+    if (replay == NULL) {
         return;
     }
 
-    memset(matchbufs, 0, (MAX_FD + 1) * sizeof(char *));
-    matchbuf_len = len + 1;
+    memset(replay_counts, 0, sizeof(replay_counts));
 
-    pattern = p;
-
-    if (get_verbose_level()) {
-        fprintf(stderr, "mockeagain: reading write timeout pattern: %s\n",
-            pattern);
+    if (build_replay_index() != 0) {
+        replay = NULL;
     }
 }
 
 
-/* returns a time in milliseconds */
-static int now() {
-   struct timeval tv;
+/* returns a monotonic time in microseconds */
+static int64_t now_us() {
+   struct timespec ts;
 
-   gettimeofday(&tv, NULL);
+   (*orig.clock_gettime)(CLOCK_MONOTONIC, &ts);
 
-   return tv.tv_sec % (3600 * 24) + tv.tv_usec/1000;
+   return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000
+          + __atomic_load_n(&warp_us, __ATOMIC_RELAXED);
 }
 
 
 /* Test if a function is whitelisted in the callstack */
 static int is_whitelist()
 {
-    const char          delimiters[] = "(+";
     void                *buff[MAX_BACKTRACE];
-    char                **symbols;
-    int                 size;
-    int                 i;
-    char                *token;
-    ENTRY               e;
-    ENTRY               *ep = NULL;
-    int                 retval = 0;
-
-    if (whitelist_status == WHITELIST_UNSET) {
-        dd("initializing whitelist");
-        whitelist_status = WHITELIST_ERR;
-        get_whitelist();
-    }
+    int                  size;
+    int                  i;
+    whitelist_t         *wl;
 
-    if (whitelist_status != WHITELIST_OK) {
+    wl = __atomic_load_n(&whitelist, __ATOMIC_ACQUIRE);
+    if (wl == NULL) {
         return 0;
     }
 
     size = backtrace(buff, MAX_BACKTRACE);
 
-    symbols = backtrace_symbols(buff, size);
-
     for (i = 0; i < size; i++) {
+        if (is_whitelisted_addr(wl, (uintptr_t) buff[i])) {
+            return 1;
+        }
+    }
 
-#if DDEBUG
-        fprintf(stderr, "\tsymbol: %s\n", symbols[i]);
-#endif
+    return 0;
+}
 
-        strtok(symbols[i], delimiters);
-        token = strtok(NULL, delimiters);
 
-        if (token && (*token == ')' || *token == '0')) {
-            /* symbol doesn't contain function name.
-             *   e.g : nginx/objs/nginx() [0x43299c],
-             *   or : mockeagain/mockeagain.so(+0x3563)
-             */
-            continue;
+/* Test if a return address lies within one of the whitelisted functions,
+ * consulting the per-call-site decision cache first */
+static int
+is_whitelisted_addr(whitelist_t *wl, uintptr_t addr)
+{
+    uint64_t            *slot;
+    uint64_t             key;
+    uint64_t             entry;
+    int                  hit;
+
+    /* user space addresses never use the top bit, so shift the address
+     * up and keep the decision in the lowest bit of a single word; this
+     * way readers never observe a torn (address, decision) pair */
+
+    key = (uint64_t) addr << 1;
+    slot = &wl->cache[((uint64_t) addr * 0x9e3779b97f4a7c15ULL)
+                      >> (64 - WHITELIST_CACHE_BITS)];
+
+    entry = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    if ((entry & ~(uint64_t) 1) == key) {
+        return (int) (entry & 1);
+    }
+
+    hit = resolve_whitelisted_addr(wl, addr);
+
+    __atomic_store_n(slot, key | (uint64_t) hit, __ATOMIC_RELAXED);
+
+    return hit;
+}
+
+
+/* The cache-miss path: look the address up in the function address ranges
+ * resolved at init time, and fall back to a dladdr() symbol lookup for the
+ * functions that could not be resolved (e.g. dlopen()'d later or missing
+ * the symbol size) */
+static int
+resolve_whitelisted_addr(whitelist_t *wl, uintptr_t addr)
+{
+    int                  i;
+    Dl_info              info;
+    whitelist_func_t    *f;
+
+    /* a return address points right after the call instruction, so it is
+     * always in (start, end] of its caller */
+
+    for (i = 0; i < wl->nfuncs; i++) {
+        f = &wl->funcs[i];
+
+        if (f->start && addr > f->start && addr <= f->end) {
+            goto found;
         }
+    }
 
-#if DDEBUG
-        fprintf(stderr, "\tfunction: \"%s\"\n", token);
-#endif
+    if (!wl->unresolved) {
+        return 0;
+    }
 
-        e.key = token;
-        ep = hsearch(e, FIND);
-        if (ep != NULL) {
-            if (get_verbose_level()) {
-                fprintf(stderr, "mockeagain: whitelist:"
-                        " found function: \"%s\"\n", token);
-            }
+    if (dladdr((void *) addr, &info) == 0 || info.dli_sname == NULL) {
+        return 0;
+    }
 
-            retval = 1;
-            break;
+    for (i = 0; i < wl->nfuncs; i++) {
+        f = &wl->funcs[i];
+
+        if (!f->start && strcmp(f->name, info.dli_sname) == 0) {
+            goto found;
         }
+    }
+
+    return 0;
+
+found:
 
+    if (verbose) {
+        fprintf(stderr, "mockeagain: whitelist:"
+                " found function: \"%s\" at %p\n", f->name, (void *) addr);
     }
 
-    free(symbols);
-    return retval;
+    return 1;
 }
 
 
-/* Get the whitelist from the MOCKEAGAIN_WL env variable */
-static int
+/* Load the whitelist from MOCKEAGAIN_WL into a new table along with an
+ * empty cache, and switch the callers over to it at once; the threads
+ * still walking the table replaced keep it, since it is never freed */
+static void
+init_whitelist()
+{
+    __atomic_store_n(&whitelist, get_whitelist(), __ATOMIC_RELEASE);
+}
+
+
+/* Get the whitelist from the MOCKEAGAIN_WL env variable and resolve the
+ * function names into address ranges; returns NULL if there is none */
+static whitelist_t *
 get_whitelist()
 {
-    const char          delimiters[] = " ,";
-    char                *p;
+    const char           delimiters[] = " ,";
+    const char          *env;
     char                *token;
-    ENTRY               e;
-    ENTRY               *ep = NULL;
-
-    p = getenv("MOCKEAGAIN_WL");
-    if (p == NULL || *p == '\0') {
+    char                *last;
+    void                *addr;
+    Dl_info              info;
+    const ElfW(Sym)     *sym;
+    whitelist_t         *wl;
+    whitelist_func_t    *f;
+
+    env = get_config("MOCKEAGAIN_WL");
+    if (env == NULL || *env == '\0') {
         dd("MOCKEAGAIN_WL env empty");
-        return 1;
+        return NULL;
     }
 
-    token = strtok(p, delimiters);
-
-    if (!token) {
-        return 1;
-    }
-
-    if (hcreate(MAX_WHITELIST) == 0) {
-        fprintf(stderr, "mockeagain: whitelist:"
-                " Unable to create hash table of"
-                " %d elements\n", MAX_WHITELIST);
-        return 0;
+    wl = calloc(1, sizeof(whitelist_t));
+    if (wl == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return NULL;
     }
 
-    whitelist_status = WHITELIST_OK;
+    /* do not tokenize the environment in place */
 
-    while (token) {
+    wl->names = strdup(env);
+    if (wl->names == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        free(wl);
+        return NULL;
+    }
 
-        e.key = token;
-        e.data = (void *) 1;
+    token = strtok_r(wl->names, delimiters, &last);
 
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: whitelist:"
-                    " adding function \"%s\"\n", token);
-        }
+    if (!token) {
+        free(wl->names);
+        free(wl);
+        return NULL;
+    }
 
-        ep = hsearch(e, ENTER);
+    while (token) {
 
-        if (ep == NULL) {
+        if (wl->nfuncs == MAX_WHITELIST) {
             fprintf(stderr,
                     "mockeagain: whitelist:"
                     " unable to store entry \"%s\","
                     " MAX_WHITELIST(%d) exceeded.\n",
-                    e.key, MAX_WHITELIST);
-            return 1;
+                    token, MAX_WHITELIST);
+            break;
+        }
+
+        f = &wl->funcs[wl->nfuncs++];
+
+        f->name = token;
+        f->start = 0;
+        f->end = 0;
+
+        addr = dlsym(RTLD_DEFAULT, token);
+
+        if (addr != NULL
+            && dladdr1(addr, &info, (void **) &sym, RTLD_DL_SYMENT) != 0
+            && sym != NULL
+            && sym->st_size > 0)
+        {
+            f->start = (uintptr_t) addr;
+            f->end = (uintptr_t) addr + sym->st_size;
+
+        } else {
+            wl->unresolved++;
         }
 
-        token = strtok(NULL, delimiters);
+        if (verbose) {
+            if (f->start) {
+                fprintf(stderr, "mockeagain: whitelist:"
+                        " adding function \"%s\" at %p-%p\n", token,
+                        (void *) f->start, (void *) f->end);
+
+            } else {
+                fprintf(stderr, "mockeagain: whitelist:"
+                        " adding function \"%s\" (unresolved)\n", token);
+            }
+        }
+
+        token = strtok_r(NULL, delimiters, &last);
     }
 
-    return 1;
+    return wl;
 }